@@ -0,0 +1,361 @@
+/* Microbenchmark of the module's request path: peer_init() queueing a
+ * request, dispatch() handing it to a backend through find_upstream() and
+ * queue_shift(), and peer_free() giving the slot back. nginx is replaced by
+ * the mock in ngx_mock.c, so what is measured is the module plus the
+ * mock's malloc()-based pools and list-based timers; nginx's own pools and
+ * timer tree are cheaper than that, not dearer. The fair queuing rows give
+ * each request a max_connections_fair_key picked at random. The failing
+ * connects rows make every fourth connect fail at once, as a refused
+ * connection does, with a dispatch_batch of 2.
+ *
+ * The module is included rather than linked so that the benchmark can get
+ * at its static functions.
+ *
+ *   ./bench/bench [iterations]
+ */
+
+#include "../max_connections_module.c"
+#include <stdio.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#define BENCH_MAX_CONNECTIONS 2
+
+typedef struct bench_request_s bench_request_t;
+struct bench_request_s {
+  ngx_http_request_t r;
+  ngx_connection_t c;
+  ngx_http_upstream_t u;
+  void *ctx[1];
+  ngx_http_variable_value_t key; /* of max_connections_fair_key */
+  u_char key_data[NGX_INT_T_LEN];
+  ngx_uint_t active; /* index in active[], or -1 */
+  bench_request_t *next_free;
+};
+
+static ngx_conf_t cf;
+static ngx_http_upstream_srv_conf_t uscf;
+static max_connections_srv_conf_t *maxconn_cf;
+
+static bench_request_t *free_requests;
+static bench_request_t **active;
+static ngx_uint_t nactive;
+static ngx_uint_t finalized;
+static ngx_uint_t nkeys; /* fair queuing over this many keys, 0 for off */
+static ngx_uint_t balance = BALANCE_LEAST_CONN;
+static ngx_uint_t fail_every; /* every this many connects fail, 0 for none */
+static ngx_uint_t connects;
+
+static double
+now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void
+request_recycle (bench_request_t *b)
+{
+  ngx_destroy_pool(b->r.pool);
+  b->next_free = free_requests;
+  free_requests = b;
+}
+
+/* ngx_http_upstream_connect(): the request is now on a backend, or with
+ * fail_every its connect failed and, out of tries, it is finalized. That
+ * happens inside dispatch(), whose loop must carry on. */
+static void
+bench_connect (ngx_http_request_t *r)
+{
+  bench_request_t *b = (bench_request_t *) r;
+
+  if (fail_every && ++connects % fail_every == 0) {
+    r->upstream->peer.free(&r->upstream->peer, r->upstream->peer.data, NGX_PEER_FAILED);
+    ngx_http_finalize_request(r, NGX_HTTP_BAD_GATEWAY);
+    return;
+  }
+
+  b->active = nactive;
+  active[nactive++] = b;
+}
+
+/* queue expiration or rejection: nginx would clean the upstream up */
+static void
+bench_finalize (ngx_http_request_t *r, ngx_int_t rc)
+{
+  bench_request_t *b = (bench_request_t *) r;
+
+  finalized++;
+  r->upstream->peer.free(&r->upstream->peer, r->upstream->peer.data, 0);
+  request_recycle(b);
+}
+
+static ngx_http_variable_value_t *
+bench_variable (ngx_http_request_t *r, ngx_uint_t index)
+{
+  return &((bench_request_t *) r)->key;
+}
+
+static void
+arrive (ngx_uint_t key)
+{
+  bench_request_t *b = free_requests;
+
+  if (b == NULL) {
+    b = malloc(sizeof(bench_request_t));
+    if (b == NULL) abort();
+  } else {
+    free_requests = b->next_free;
+  }
+
+  ngx_memzero(b, sizeof(bench_request_t));
+  b->r.connection = &b->c;
+  b->r.upstream = &b->u;
+  b->r.ctx = b->ctx;
+  b->r.main = &b->r;
+  b->r.pool = ngx_create_pool(1024, (ngx_log_t *) ngx_cycle->log);
+  b->c.log = (ngx_log_t *) ngx_cycle->log;
+  b->c.fd = -1;
+  b->u.peer.log = b->c.log;
+  b->active = (ngx_uint_t) -1;
+  b->key.data = b->key_data;
+  b->key.len = ngx_sprintf(b->key_data, "%ui", key) - b->key_data;
+  b->key.valid = 1;
+
+  if (peer_init(&b->r, &uscf) != NGX_BUSY) abort();
+}
+
+/* the backend answered the active request i */
+static void
+complete (ngx_uint_t i)
+{
+  bench_request_t *b = active[i];
+
+  active[i] = active[--nactive];
+  active[i]->active = i;
+
+  b->u.headers_in.status_n = NGX_HTTP_OK;
+  b->u.peer.free(&b->u.peer, b->u.peer.data, 0);
+  request_recycle(b);
+}
+
+static void
+setup (ngx_uint_t nbackends)
+{
+  ngx_uint_t i;
+
+  ngx_memzero(&cf, sizeof(cf));
+  ngx_memzero(&uscf, sizeof(uscf));
+  cf.pool = ngx_create_pool(4096, (ngx_log_t *) ngx_cycle->log);
+  cf.log = (ngx_log_t *) ngx_cycle->log;
+
+  maxconn_cf = max_connections_create_conf(&cf);
+  maxconn_cf->max_connections = BENCH_MAX_CONNECTIONS;
+  maxconn_cf->max_queue_length = 1000000;
+  maxconn_cf->balance = balance;
+  if (nkeys) {
+    maxconn_cf->fair_index = 0;
+    maxconn_cf->fair_flows = FAIR_FLOWS;
+    maxconn_cf->fair_quantum = 1;
+  }
+
+  uscf.srv_conf = ngx_pcalloc(cf.pool, sizeof(void *));
+  uscf.srv_conf[max_connections_module.ctx_index] = maxconn_cf;
+  uscf.host.len = sizeof("bench") - 1;
+  uscf.host.data = (u_char *) "bench";
+  uscf.servers = ngx_array_create(cf.pool, nbackends, sizeof(ngx_http_upstream_server_t));
+
+  for (i = 0; i < nbackends; i++) {
+    ngx_http_upstream_server_t *server = ngx_array_push(uscf.servers);
+    struct sockaddr_in *sin = ngx_pcalloc(cf.pool, sizeof(struct sockaddr_in));
+
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(8001 + i);
+    sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    ngx_memzero(server, sizeof(ngx_http_upstream_server_t));
+    server->naddrs = 1;
+    server->addrs = ngx_pcalloc(cf.pool, sizeof(ngx_peer_addr_t));
+    server->addrs->sockaddr = (struct sockaddr *) sin;
+    server->addrs->socklen = sizeof(struct sockaddr_in);
+    server->addrs->name.data = ngx_palloc(cf.pool, sizeof("127.0.0.1:65535"));
+    server->addrs->name.len =
+      ngx_sprintf(server->addrs->name.data, "127.0.0.1:%ui", 8001 + i)
+      - server->addrs->name.data;
+    server->weight = 1;
+    server->max_fails = fail_every ? (ngx_uint_t) -1 : 1;
+    server->fail_timeout = 10;
+  }
+
+  if (max_connections_init(&cf, &uscf) != NGX_OK) abort();
+
+  active = malloc(nbackends * BENCH_MAX_CONNECTIONS * sizeof(bench_request_t *));
+  nactive = 0;
+}
+
+static void
+teardown (void)
+{
+  while (nactive || maxconn_cf->queue_length) {
+    if (nactive) complete(0);
+    ngx_mock_process_posted();
+    assert((nactive || !maxconn_cf->queue_length) && "queued requests left behind");
+  }
+  ngx_mock_process_posted();
+  assert(ngx_mock_next_timer() == (ngx_msec_t) -1);
+
+  free(active);
+  ngx_destroy_pool(cf.pool);
+}
+
+/* Every slot busy and depth requests queued. Each iteration one request
+ * finishes, which dispatches the next queued one, and one new request
+ * arrives, so the queue stays at depth. */
+static double
+bench_cycle (ngx_uint_t nbackends, ngx_uint_t depth, ngx_uint_t iterations)
+{
+  ngx_uint_t i, slots = nbackends * BENCH_MAX_CONNECTIONS;
+
+  setup(nbackends);
+
+  for (i = 0; i < slots + depth; i++) arrive(nkeys ? ngx_random() % nkeys : 0);
+  assert(nactive == slots);
+  assert(maxconn_cf->queue_length == depth);
+
+  double start = now_ns();
+  for (i = 0; i < iterations; i++) {
+    complete(ngx_random() % nactive);
+    arrive(nkeys ? ngx_random() % nkeys : 0);
+    ngx_mock_process_posted();
+  }
+  double took = now_ns() - start;
+
+  assert(nactive == slots);
+  assert(maxconn_cf->queue_length == depth);
+
+  teardown();
+  return took / iterations;
+}
+
+/* Like bench_cycle() with every fail_every-th connect failing at once.
+ * The failed request's slot goes to the next queued request within the
+ * same dispatch(), and more than dispatch_batch slots can come free at
+ * once, so the posted event takes the rest. New requests keep the queue
+ * at depth. */
+static double
+bench_fail (ngx_uint_t nbackends, ngx_uint_t depth, ngx_uint_t iterations)
+{
+  ngx_uint_t i, slots = nbackends * BENCH_MAX_CONNECTIONS;
+
+  fail_every = 4;
+  connects = 0;
+  setup(nbackends);
+  maxconn_cf->dispatch_batch = 2;
+
+  while (maxconn_cf->queue_length < depth) arrive(0);
+  ngx_mock_process_posted();
+  assert(nactive == slots);
+
+  double start = now_ns();
+  for (i = 0; i < iterations; i++) {
+    complete(ngx_random() % nactive);
+    while (maxconn_cf->queue_length < depth) arrive(0);
+    ngx_mock_process_posted();
+    assert(nactive == slots);
+  }
+  double took = now_ns() - start;
+
+  teardown();
+  fail_every = 0;
+  return took / iterations;
+}
+
+/* Retries take any live backend, scanning for one not tried yet. */
+static double
+bench_retry (ngx_uint_t nbackends, ngx_uint_t iterations)
+{
+  ngx_uint_t i;
+  uintptr_t tried[(512 + TRIED_BITS - 1) / TRIED_BITS] = { 0 };
+  uintptr_t sink = 0;
+
+  setup(nbackends);
+
+  double start = now_ns();
+  for (i = 0; i < iterations; i++) {
+    max_connections_backend_t *backend = find_upstream(maxconn_cf, 1, tried);
+    sink += (uintptr_t) backend;
+  }
+  double took = now_ns() - start;
+
+  teardown();
+  return sink ? took / iterations : 0;
+}
+
+int
+main (int argc, char **argv)
+{
+  ngx_uint_t backends[] = { 1, 8, 64, 512 };
+  ngx_uint_t depths[] = { 0, 100, 10000 };
+  ngx_uint_t iterations = argc > 1 ? (ngx_uint_t) atol(argv[1]) : 1000000;
+  ngx_uint_t i, j;
+
+  ngx_current_msec = 1000; /* 0 means "not set" to some of the module */
+  ngx_mock_connect_handler = bench_connect;
+  ngx_mock_finalize_handler = bench_finalize;
+  ngx_mock_variable_handler = bench_variable;
+  srandom(1);
+
+  printf("request cycle (finish + dispatch + arrive), %d slots per backend\n"
+         "%10s %10s %12s %14s\n"
+         , BENCH_MAX_CONNECTIONS, "backends", "queued", "ns/request", "requests/s");
+
+  for (i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+    for (j = 0; j < sizeof(depths) / sizeof(depths[0]); j++) {
+      double ns = bench_cycle(backends[i], depths[j], iterations);
+      printf("%10lu %10lu %12.1f %14.0f\n"
+            , (unsigned long) backends[i], (unsigned long) depths[j], ns, 1e9 / ns);
+    }
+  }
+
+  printf("\nthe same with max_connections_balance p2c_ewma\n"
+         "%10s %10s %12s %14s\n"
+         , "backends", "queued", "ns/request", "requests/s");
+  balance = BALANCE_P2C_EWMA;
+  for (i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+    double ns = bench_cycle(backends[i], 100, iterations);
+    printf("%10lu %10lu %12.1f %14.0f\n"
+          , (unsigned long) backends[i], 100UL, ns, 1e9 / ns);
+  }
+  balance = BALANCE_LEAST_CONN;
+
+  ngx_uint_t keys[] = { 1, 100, 10000 };
+  printf("\nthe same with max_connections_fair_key, 64 backends\n"
+         "%10s %10s %12s %14s\n"
+         , "keys", "queued", "ns/request", "requests/s");
+  for (i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+    nkeys = keys[i];
+    double ns = bench_cycle(64, 10000, iterations);
+    printf("%10lu %10lu %12.1f %14.0f\n"
+          , (unsigned long) nkeys, 10000UL, ns, 1e9 / ns);
+  }
+  nkeys = 0;
+
+  printf("\nthe same with every fourth connect failing, dispatch_batch 2\n"
+         "%10s %10s %12s %14s\n"
+         , "backends", "queued", "ns/request", "requests/s");
+  for (i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+    double ns = bench_fail(backends[i], 100, iterations);
+    printf("%10lu %10lu %12.1f %14.0f\n"
+          , (unsigned long) backends[i], 100UL, ns, 1e9 / ns);
+  }
+
+  printf("\nfind_upstream() for a retry\n%10s %12s\n", "backends", "ns/call");
+  for (i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+    printf("%10lu %12.1f\n"
+          , (unsigned long) backends[i], bench_retry(backends[i], iterations));
+  }
+
+  if (finalized) printf("\n%lu requests expired, were rejected or failed\n", (unsigned long) finalized);
+  return 0;
+}
@@ -0,0 +1,76 @@
+#!/bin/sh
+# End-to-end benchmark: nginx built with the module (make) in front of
+# stub backends, driven by the load generator. Run from the top directory
+# with "make bench_e2e". Settings can be overridden from the environment:
+#
+#   BACKENDS=4 SLOTS=2 SERVICE_MS=1 CONCURRENCY=2 RATE=10000 CLIENTS=200 \
+#   DURATION=10 make bench_e2e
+#
+# CONCURRENCY is how many requests each backend works on at once; SLOTS
+# is max_connections. With SLOTS <= CONCURRENCY nginx does the queueing.
+
+BACKENDS=${BACKENDS:-4}
+SLOTS=${SLOTS:-2}
+SERVICE_MS=${SERVICE_MS:-1}
+CONCURRENCY=${CONCURRENCY:-2}
+RATE=${RATE:-10000}
+CLIENTS=${CLIENTS:-200}
+DURATION=${DURATION:-10}
+PORT=8000
+
+DIR=$(pwd)
+TMP=$DIR/test/tmp
+CONF=$TMP/bench-nginx.conf
+PIDS=""
+
+cleanup() {
+  [ -f $TMP/bench-nginx.pid ] && kill $(cat $TMP/bench-nginx.pid) 2>/dev/null
+  for pid in $PIDS; do kill $pid 2>/dev/null; done
+  wait 2>/dev/null
+}
+trap cleanup EXIT INT TERM
+
+servers=""
+i=1
+while [ $i -le $BACKENDS ]; do
+  port=$((PORT + i))
+  ./bench/stub_backend -p $port -s $SERVICE_MS -e -c $CONCURRENCY &
+  PIDS="$PIDS $!"
+  servers="$servers    server 127.0.0.1:$port;
+"
+  i=$((i + 1))
+done
+
+cat > $CONF <<CONF
+worker_processes 1;
+error_log $TMP/bench-error.log error;
+pid $TMP/bench-nginx.pid;
+events { worker_connections 16384; }
+
+http {
+  access_log off;
+
+  upstream backend {
+$servers    max_connections $SLOTS;
+    max_connections_queue_timeout 5s;
+  }
+
+  server {
+    listen $PORT;
+    location / { proxy_pass http://backend; }
+    location = /max_connections_status { max_connections_status; }
+  }
+}
+CONF
+
+./.nginx/sbin/nginx -c $CONF || exit 1
+sleep 1
+
+echo "== $BACKENDS backends, $SLOTS slots each, ${SERVICE_MS}ms mean service time"
+echo "== closed loop, $CLIENTS keep-alive clients"
+./bench/loadgen -p $PORT -c $CLIENTS -k -d $DURATION
+echo "== open loop, $RATE requests/s"
+./bench/loadgen -p $PORT -r $RATE -x -d $DURATION
+echo "== queue"
+curl -s http://127.0.0.1:$PORT/max_connections_status 2>/dev/null || true
+echo
@@ -0,0 +1,384 @@
+/* Load generator for end-to-end benchmarks, a single-threaded epoll HTTP
+ * client.
+ *
+ *   ./bench/loadgen [-a addr] [-p port] [-u uri] [-r rate | -c clients]
+ *                   [-d seconds] [-t ms] [-k] [-x]
+ *
+ *   -a  address to connect to (127.0.0.1)
+ *   -p  port (8000)
+ *   -u  request uri (/)
+ *   -r  open loop: start this many requests per second, whatever
+ *       happens to the ones before (default 1000)
+ *   -c  closed loop instead: this many clients, each sending its next
+ *       request when the last one is answered
+ *   -d  how long to send requests for, in seconds (10)
+ *   -t  give up on a request after this many milliseconds (10000)
+ *   -k  with -c, keep connections open (HTTP/1.1) instead of one per
+ *       request
+ *   -x  open loop with exponential (Poisson) gaps instead of even ones
+ *
+ * Latency is measured from when a request was due to start, so a stalled
+ * server is not hidden by requests not being sent (coordinated omission).
+ * At the end it prints throughput, the responses by status class and the
+ * latency distribution.
+ */
+
+#define _GNU_SOURCE /* memmem */
+#include <arpa/inet.h>
+#include <errno.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BUF_SIZE 16384
+
+typedef struct client_s client_t;
+struct client_s {
+  int fd;
+  uint64_t due; /* when the request should have started, microseconds */
+  size_t sent;
+  char buf[BUF_SIZE];
+  size_t len;
+  client_t *prev, *next; /* outstanding requests, oldest first */
+};
+
+static struct sockaddr_in addr;
+static char request[1024];
+static size_t request_len;
+static int keepalive;
+static uint64_t timeout_us = 10000000;
+
+static int epfd;
+static client_t outstanding = { .prev = &outstanding, .next = &outstanding };
+static long noutstanding;
+
+static unsigned long started, completed, timeouts, errors, status[6];
+static uint32_t *latencies; /* microseconds, of completed requests */
+static size_t nlatencies, latencies_alloc;
+
+static uint64_t
+now_us (void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+record_latency (uint64_t us)
+{
+  if (nlatencies == latencies_alloc) {
+    latencies_alloc = latencies_alloc ? 2 * latencies_alloc : 65536;
+    latencies = realloc(latencies, latencies_alloc * sizeof(uint32_t));
+    if (latencies == NULL) abort();
+  }
+  latencies[nlatencies++] = us > UINT32_MAX ? UINT32_MAX : us;
+}
+
+static void
+unlink_outstanding (client_t *c)
+{
+  c->prev->next = c->next;
+  c->next->prev = c->prev;
+  c->prev = c->next = NULL;
+  noutstanding--;
+}
+
+static void
+disconnect (client_t *c)
+{
+  if (c->fd >= 0) close(c->fd);
+  c->fd = -1;
+}
+
+/* Starts the request of c, due at due. Returns -1 if it failed at once. */
+static int
+start (client_t *c, uint64_t due)
+{
+  c->due = due;
+  c->sent = 0;
+  c->len = 0;
+  started++;
+
+  if (c->fd < 0) {
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c->fd < 0) {
+      errors++;
+      return -1;
+    }
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(c->fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+      errors++;
+      disconnect(c);
+      return -1;
+    }
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT, .data.ptr = c };
+    epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+  } else {
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT, .data.ptr = c };
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+  }
+
+  c->next = &outstanding;
+  c->prev = outstanding.prev;
+  outstanding.prev->next = c;
+  outstanding.prev = c;
+  noutstanding++;
+  return 0;
+}
+
+/* Is the whole response in the buffer? Returns its status, 0 if not. */
+static int
+response_done (client_t *c, int eof)
+{
+  char *end = memmem(c->buf, c->len, "\r\n\r\n", 4);
+  if (end == NULL) return 0;
+
+  size_t header_len = end + 4 - c->buf;
+  long content_length = -1;
+  char *line;
+
+  for (line = memchr(c->buf, '\n', header_len) + 1; line < end;
+       line = memchr(line, '\n', end + 2 - line) + 1) {
+    if (strncasecmp(line, "Content-Length:", 15) == 0) content_length = atol(line + 15);
+  }
+
+  if (content_length >= 0 ? c->len < header_len + content_length : !eof) return 0;
+  return c->len > 9 ? atoi(c->buf + 9) : 0;
+}
+
+/* finished with its request: done is 1 if answered, 0 if it failed */
+typedef void (*finish_pt)(client_t *c, int done);
+static finish_pt finish;
+
+static void
+handle (client_t *c, uint32_t events)
+{
+  if (events & EPOLLOUT) {
+    while (c->sent < request_len) {
+      ssize_t n = write(c->fd, request + c->sent, request_len - c->sent);
+      if (n < 0 && errno == EAGAIN) break;
+      if (n <= 0) {
+        errors++;
+        finish(c, 0);
+        return;
+      }
+      c->sent += n;
+    }
+    if (c->sent == request_len) {
+      struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+      epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    }
+  }
+
+  if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR))) return;
+
+  for (;;) {
+    if (c->len == BUF_SIZE) {
+      errors++;
+      finish(c, 0);
+      return;
+    }
+    ssize_t n = read(c->fd, c->buf + c->len, BUF_SIZE - c->len);
+    if (n < 0 && errno == EAGAIN) break;
+    if (n < 0) {
+      errors++;
+      finish(c, 0);
+      return;
+    }
+    if (n == 0) {
+      int s = response_done(c, 1);
+      if (s == 0) errors++;
+      else status[s / 100 < 6 ? s / 100 : 0]++;
+      finish(c, s != 0);
+      return;
+    }
+    c->len += n;
+  }
+
+  int s = response_done(c, 0);
+  if (s) {
+    status[s / 100 < 6 ? s / 100 : 0]++;
+    finish(c, 1);
+  }
+}
+
+static void
+finish_open (client_t *c, int done)
+{
+  uint64_t now = now_us();
+
+  unlink_outstanding(c);
+  if (done) {
+    completed++;
+    record_latency(now - c->due);
+  }
+  disconnect(c);
+  free(c);
+}
+
+static void
+finish_closed (client_t *c, int done)
+{
+  uint64_t now = now_us();
+
+  unlink_outstanding(c);
+  if (done) {
+    completed++;
+    record_latency(now - c->due);
+  }
+  if (!done || !keepalive) disconnect(c);
+  c->due = 0; /* idle: start again in the main loop */
+}
+
+static void
+expire (uint64_t now)
+{
+  while (outstanding.next != &outstanding && now - outstanding.next->due > timeout_us) {
+    timeouts++;
+    finish(outstanding.next, 0);
+  }
+}
+
+static int
+cmp_u32 (const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+static double
+percentile (double p)
+{
+  if (nlatencies == 0) return 0;
+  size_t i = (size_t) (p / 100.0 * (nlatencies - 1) + 0.5);
+  return latencies[i] / 1000.0;
+}
+
+int
+main (int argc, char **argv)
+{
+  const char *host = "127.0.0.1", *uri = "/";
+  int port = 8000, opt, poisson = 0;
+  double rate = 1000, duration = 10;
+  long nclients = 0;
+
+  while ((opt = getopt(argc, argv, "a:p:u:r:c:d:t:kx")) != -1) {
+    switch (opt) {
+      case 'a': host = optarg; break;
+      case 'p': port = atoi(optarg); break;
+      case 'u': uri = optarg; break;
+      case 'r': rate = atof(optarg); break;
+      case 'c': nclients = atol(optarg); break;
+      case 'd': duration = atof(optarg); break;
+      case 't': timeout_us = (uint64_t) (atof(optarg) * 1000); break;
+      case 'k': keepalive = 1; break;
+      case 'x': poisson = 1; break;
+      default:
+        fprintf(stderr, "usage: %s [-a addr] [-p port] [-u uri] [-r rate | -c clients] "
+                        "[-d seconds] [-t ms] [-k] [-x]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+    fprintf(stderr, "loadgen: bad address %s\n", host);
+    return 1;
+  }
+
+  request_len = snprintf(request, sizeof(request),
+                         keepalive ? "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n"
+                                   : "GET %s HTTP/1.0\r\nHost: %s\r\n\r\n",
+                         uri, host);
+
+  /* an open loop at 10k requests per second can have many connections
+   * open */
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+  signal(SIGPIPE, SIG_IGN);
+  srand48(getpid());
+
+  epfd = epoll_create1(0);
+  struct epoll_event events[1024];
+
+  client_t *clients = NULL;
+  long i;
+  if (nclients) {
+    finish = finish_closed;
+    clients = calloc(nclients, sizeof(client_t));
+    if (clients == NULL) abort();
+    for (i = 0; i < nclients; i++) clients[i].fd = -1;
+  } else {
+    finish = finish_open;
+  }
+
+  uint64_t begin = now_us(), end = begin + (uint64_t) (duration * 1e6);
+  uint64_t next_due = begin;
+
+  for (;;) {
+    uint64_t now = now_us();
+
+    if (now < end) {
+      if (nclients) {
+        for (i = 0; i < nclients; i++) {
+          if (clients[i].prev == NULL) start(&clients[i], now);
+        }
+      } else {
+        while (next_due <= now) {
+          client_t *c = calloc(1, sizeof(client_t));
+          if (c == NULL) abort();
+          c->fd = -1;
+          if (start(c, next_due) < 0) free(c);
+
+          double gap = 1e6 / rate;
+          if (poisson) gap = -gap * log(1.0 - drand48());
+          next_due += (uint64_t) gap;
+        }
+      }
+    } else if (noutstanding == 0) {
+      break;
+    }
+
+    int wait_ms = 1;
+    if (now >= end) wait_ms = 10;
+    int n = epoll_wait(epfd, events, 1024, wait_ms), k;
+    for (k = 0; k < n; k++) handle(events[k].data.ptr, events[k].events);
+
+    expire(now_us());
+  }
+
+  double took = (now_us() - begin) / 1e6;
+
+  qsort(latencies, nlatencies, sizeof(uint32_t), cmp_u32);
+  double sum = 0;
+  size_t j;
+  for (j = 0; j < nlatencies; j++) sum += latencies[j];
+
+  printf("requests    %lu started, %lu answered, %lu timed out, %lu errors in %.2fs\n",
+         started, completed, timeouts, errors, took);
+  printf("throughput  %.0f answers/s\n", completed / took);
+  printf("status      1xx=%lu 2xx=%lu 3xx=%lu 4xx=%lu 5xx=%lu\n",
+         status[1], status[2], status[3], status[4], status[5]);
+  printf("latency ms  mean %.2f p50 %.2f p90 %.2f p99 %.2f p99.9 %.2f max %.2f\n",
+         nlatencies ? sum / nlatencies / 1000.0 : 0, percentile(50), percentile(90),
+         percentile(99), percentile(99.9), percentile(100));
+
+  return 0;
+}
@@ -0,0 +1 @@
+#include "ngx_mock.h"
@@ -0,0 +1,702 @@
+/* Minimal stand-ins for the nginx 0.6 API used by max_connections_module.c,
+ * so that the module can be compiled and benchmarked without nginx. Only
+ * what the module touches is here; ngx_mock.c implements it. */
+#ifndef NGX_MOCK_H
+#define NGX_MOCK_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+typedef intptr_t  ngx_int_t;
+typedef uintptr_t ngx_uint_t;
+typedef intptr_t  ngx_flag_t;
+typedef ngx_uint_t ngx_msec_t;
+typedef ngx_int_t ngx_msec_int_t;
+typedef int ngx_err_t;
+typedef int ngx_socket_t;
+typedef int ngx_fd_t;
+typedef uint32_t ngx_uint32_t;
+typedef volatile ngx_uint_t ngx_atomic_t;
+typedef ngx_uint_t ngx_atomic_uint_t;
+typedef ngx_int_t ngx_atomic_int_t;
+typedef unsigned char u_char;
+
+#define NGX_OK          0
+#define NGX_ERROR      -1
+#define NGX_AGAIN      -2
+#define NGX_BUSY       -3
+#define NGX_DONE       -4
+#define NGX_DECLINED   -5
+#define NGX_ABORT      -6
+
+#define NGX_INT_T_LEN  20
+#define NGX_ATOMIC_T_LEN 20
+#define NGX_TIME_T_LEN 20
+#define NGX_OFF_T_LEN  20
+
+#define ngx_min(a, b) ((a < b) ? (a) : (b))
+#define ngx_max(a, b) ((a < b) ? (b) : (a))
+#define ngx_align(d, a) (((d) + (a - 1)) & ~(a - 1))
+
+#define NGX_LOG_STDERR 0
+#define NGX_LOG_EMERG  1
+#define NGX_LOG_ALERT  2
+#define NGX_LOG_CRIT   3
+#define NGX_LOG_ERR    4
+#define NGX_LOG_WARN   5
+#define NGX_LOG_NOTICE 6
+#define NGX_LOG_INFO   7
+#define NGX_LOG_DEBUG  8
+#define NGX_LOG_DEBUG_HTTP 0x100
+#define NGX_LOG_DEBUG_EVENT 0x080
+
+#define NGX_ERROR_ALERT 0
+#define NGX_ERROR_ERR 1
+#define NGX_ERROR_INFO 2
+#define ngx_errno errno
+#define ngx_socket_errno errno
+#define NGX_EAGAIN EAGAIN
+#define NGX_EINTR EINTR
+#define NGX_EINPROGRESS EINPROGRESS
+#define LF (u_char) 10
+#define CR (u_char) 13
+#define CRLF "\x0d\x0a"
+
+#ifndef NGX_DEBUG
+#define NGX_DEBUG 0
+#endif
+
+typedef struct {
+  size_t len;
+  u_char *data;
+} ngx_str_t;
+
+#define ngx_string(str) { sizeof(str) - 1, (u_char *) str }
+#define ngx_null_string { 0, NULL }
+
+#define ngx_strncmp(s1, s2, n) strncmp((const char *) s1, (const char *) s2, n)
+#define ngx_strcmp(s1, s2) strcmp((const char *) s1, (const char *) s2)
+#define ngx_strlen(s) strlen((const char *) s)
+#define ngx_strlchr(p, last, c) ((u_char *) memchr(p, c, last - p))
+#define ngx_memzero(buf, n) (void) memset(buf, 0, n)
+#define ngx_memcpy(dst, src, n) (void) memcpy(dst, src, n)
+#define ngx_cpymem(dst, src, n) (((u_char *) memcpy(dst, src, n)) + (n))
+#define ngx_memcmp(s1, s2, n) memcmp((const char *) s1, (const char *) s2, n)
+#define ngx_tolower(c) (u_char) ((c >= 'A' && c <= 'Z') ? (c | 0x20) : c)
+ngx_int_t ngx_strncasecmp(u_char *s1, u_char *s2, size_t n);
+ngx_int_t ngx_atoi(u_char *line, size_t n);
+ngx_int_t ngx_parse_time(ngx_str_t *line, ngx_int_t sec);
+ssize_t ngx_parse_size(ngx_str_t *line);
+#define NGX_PARSE_LARGE_TIME -2
+u_char *ngx_sprintf(u_char *buf, const char *fmt, ...);
+u_char *ngx_snprintf(u_char *buf, size_t max, const char *fmt, ...);
+u_char *ngx_slprintf(u_char *buf, u_char *last, const char *fmt, ...);
+uint32_t ngx_crc32_short(u_char *p, size_t len);
+uint32_t ngx_crc32_long(u_char *p, size_t len);
+#define ngx_qsort qsort
+uint32_t ngx_hash_key(u_char *data, size_t len);
+
+/* logging */
+typedef struct ngx_log_s ngx_log_t;
+struct ngx_log_s {
+  ngx_uint_t log_level;
+  void *file;
+  void *data;
+};
+void ngx_log_error_core(ngx_uint_t level, ngx_log_t *log, ngx_err_t err, const char *fmt, ...);
+#define ngx_log_error(level, log, ...) \
+  if ((log)->log_level >= level) ngx_log_error_core(level, log, __VA_ARGS__)
+#if (NGX_DEBUG)
+#define ngx_log_debug0(level, log, err, fmt) \
+  if ((log)->log_level & level) ngx_log_error_core(NGX_LOG_DEBUG, log, err, fmt)
+#define ngx_log_debug1(level, log, err, fmt, a1) \
+  if ((log)->log_level & level) ngx_log_error_core(NGX_LOG_DEBUG, log, err, fmt, a1)
+#define ngx_log_debug2(level, log, err, fmt, a1, a2) \
+  if ((log)->log_level & level) ngx_log_error_core(NGX_LOG_DEBUG, log, err, fmt, a1, a2)
+#define ngx_log_debug3(level, log, err, fmt, a1, a2, a3) \
+  if ((log)->log_level & level) ngx_log_error_core(NGX_LOG_DEBUG, log, err, fmt, a1, a2, a3)
+#define ngx_log_debug4(level, log, err, fmt, a1, a2, a3, a4) \
+  if ((log)->log_level & level) ngx_log_error_core(NGX_LOG_DEBUG, log, err, fmt, a1, a2, a3, a4)
+#define ngx_log_debug5(level, log, err, fmt, a1, a2, a3, a4, a5) \
+  if ((log)->log_level & level) ngx_log_error_core(NGX_LOG_DEBUG, log, err, fmt, a1, a2, a3, a4, a5)
+#else
+#define ngx_log_debug0(level, log, err, fmt)
+#define ngx_log_debug1(level, log, err, fmt, a1)
+#define ngx_log_debug2(level, log, err, fmt, a1, a2)
+#define ngx_log_debug3(level, log, err, fmt, a1, a2, a3)
+#define ngx_log_debug4(level, log, err, fmt, a1, a2, a3, a4)
+#define ngx_log_debug5(level, log, err, fmt, a1, a2, a3, a4, a5)
+#endif
+
+/* memory */
+typedef struct ngx_pool_s ngx_pool_t;
+struct ngx_pool_s {
+  ngx_log_t *log;
+  void *allocs; /* everything allocated from the pool, for destroying it */
+};
+void *ngx_alloc(size_t size, ngx_log_t *log);
+#define ngx_free free
+void *ngx_palloc(ngx_pool_t *pool, size_t size);
+void *ngx_pcalloc(ngx_pool_t *pool, size_t size);
+ngx_pool_t *ngx_create_pool(size_t size, ngx_log_t *log);
+void ngx_destroy_pool(ngx_pool_t *pool);
+
+typedef struct {
+  void *elts;
+  ngx_uint_t nelts;
+  size_t size;
+  ngx_uint_t nalloc;
+  ngx_pool_t *pool;
+} ngx_array_t;
+ngx_array_t *ngx_array_create(ngx_pool_t *p, ngx_uint_t n, size_t size);
+void *ngx_array_push(ngx_array_t *a);
+static inline ngx_int_t
+ngx_array_init(ngx_array_t *array, ngx_pool_t *pool, ngx_uint_t n, size_t size)
+{
+  array->nelts = 0; array->size = size; array->nalloc = n; array->pool = pool;
+  array->elts = ngx_palloc(pool, n * size);
+  return array->elts == NULL ? NGX_ERROR : NGX_OK;
+}
+
+typedef struct ngx_list_part_s ngx_list_part_t;
+struct ngx_list_part_s {
+  void *elts;
+  ngx_uint_t nelts;
+  ngx_list_part_t *next;
+};
+typedef struct {
+  ngx_list_part_t *last;
+  ngx_list_part_t part;
+  size_t size;
+  ngx_uint_t nalloc;
+  ngx_pool_t *pool;
+} ngx_list_t;
+void *ngx_list_push(ngx_list_t *list);
+
+typedef struct {
+  ngx_uint_t hash;
+  ngx_str_t key;
+  ngx_str_t value;
+} ngx_table_elt_t;
+
+/* queue (verbatim semantics of ngx_queue.h) */
+typedef struct ngx_queue_s ngx_queue_t;
+struct ngx_queue_s {
+  ngx_queue_t *prev;
+  ngx_queue_t *next;
+};
+#define ngx_queue_init(q) (q)->prev = q; (q)->next = q
+#define ngx_queue_empty(h) (h == (h)->prev)
+#define ngx_queue_insert_head(h, x) \
+  (x)->next = (h)->next; (x)->next->prev = x; (x)->prev = h; (h)->next = x
+#define ngx_queue_insert_tail(h, x) \
+  (x)->prev = (h)->prev; (x)->prev->next = x; (x)->next = h; (h)->prev = x
+#define ngx_queue_head(h) (h)->next
+#define ngx_queue_last(h) (h)->prev
+#define ngx_queue_sentinel(h) (h)
+#define ngx_queue_next(q) (q)->next
+#define ngx_queue_prev(q) (q)->prev
+#define ngx_queue_remove(x) \
+  (x)->next->prev = (x)->prev; (x)->prev->next = (x)->next
+#define ngx_queue_data(q, type, link) \
+  (type *) ((u_char *) q - offsetof(type, link))
+
+/* time */
+extern volatile ngx_msec_t ngx_current_msec;
+extern volatile time_t ngx_mock_time;
+#define ngx_time() ngx_mock_time
+#define ngx_random random
+typedef struct {
+  time_t sec;
+  ngx_uint_t msec;
+  ngx_int_t gmtoff;
+} ngx_time_t;
+extern volatile ngx_time_t *ngx_cached_time;
+#define ngx_timeofday() (ngx_time_t *) ngx_cached_time
+
+/* atomics */
+#define ngx_atomic_cmp_set(lock, old, set) \
+  __sync_bool_compare_and_swap(lock, old, set)
+#define ngx_atomic_fetch_add(value, add) \
+  __sync_fetch_and_add(value, add)
+#define ngx_memory_barrier() __sync_synchronize()
+
+/* shared memory */
+typedef struct {
+  u_char *addr;
+  size_t size;
+  ngx_str_t name;
+  ngx_log_t *log;
+} ngx_shm_t;
+typedef struct ngx_shm_zone_s ngx_shm_zone_t;
+typedef ngx_int_t (*ngx_shm_zone_init_pt) (ngx_shm_zone_t *zone, void *data);
+struct ngx_shm_zone_s {
+  void *data;
+  ngx_shm_t shm;
+  ngx_shm_zone_init_pt init;
+  void *tag;
+};
+typedef struct {
+  ngx_atomic_t lock;
+  u_char *start;
+  u_char *end;
+} ngx_slab_pool_t;
+void *ngx_slab_alloc(ngx_slab_pool_t *pool, size_t size);
+void ngx_slab_free(ngx_slab_pool_t *pool, void *p);
+extern ngx_uint_t ngx_pagesize;
+
+/* buffers */
+typedef struct ngx_buf_s ngx_buf_t;
+struct ngx_buf_s {
+  u_char *pos;
+  u_char *last;
+  off_t file_pos;
+  off_t file_last;
+  u_char *start;
+  u_char *end;
+  unsigned temporary:1;
+  unsigned memory:1;
+  unsigned in_file:1;
+  unsigned flush:1;
+  unsigned last_buf:1;
+};
+typedef struct ngx_chain_s ngx_chain_t;
+struct ngx_chain_s {
+  ngx_buf_t *buf;
+  ngx_chain_t *next;
+};
+ngx_buf_t *ngx_create_temp_buf(ngx_pool_t *pool, size_t size);
+#define ngx_calloc_buf(pool) ngx_pcalloc(pool, sizeof(ngx_buf_t))
+#define ngx_alloc_chain_link(pool) ngx_palloc(pool, sizeof(ngx_chain_t))
+#define ngx_buf_in_memory(b) (b->temporary || b->memory)
+#define ngx_buf_size(b) (b->last - b->pos)
+
+/* events */
+typedef struct ngx_event_s ngx_event_t;
+typedef void (*ngx_event_handler_pt)(ngx_event_t *ev);
+struct ngx_event_s {
+  void *data;
+  unsigned write:1;
+  unsigned active:1;
+  unsigned ready:1;
+  unsigned eof:1;
+  unsigned error:1;
+  unsigned timedout:1;
+  unsigned timer_set:1;
+  unsigned delayed:1;
+  ngx_event_handler_pt handler;
+  ngx_log_t *log;
+  ngx_msec_t timer_key;
+  ngx_event_t *next;
+  ngx_event_t **prev;
+  /* nginx keeps timers in a red-black tree, the mock in a sorted list */
+  ngx_event_t *timer_next;
+  ngx_event_t *timer_prev;
+};
+void ngx_add_timer(ngx_event_t *ev, ngx_msec_t timer);
+void ngx_del_timer(ngx_event_t *ev);
+extern volatile ngx_event_t *ngx_posted_events;
+void ngx_post_event(ngx_event_t *ev, volatile ngx_event_t **queue);
+void ngx_delete_posted_event(ngx_event_t *ev);
+ngx_int_t ngx_handle_read_event(ngx_event_t *rev, ngx_uint_t flags);
+ngx_int_t ngx_handle_write_event(ngx_event_t *wev, size_t lowat);
+
+typedef struct ngx_connection_s ngx_connection_t;
+typedef ssize_t (*ngx_recv_pt)(ngx_connection_t *c, u_char *buf, size_t size);
+typedef ssize_t (*ngx_send_pt)(ngx_connection_t *c, u_char *buf, size_t size);
+struct ngx_connection_s {
+  void *data;
+  ngx_event_t *read;
+  ngx_event_t *write;
+  ngx_socket_t fd;
+  ngx_recv_pt recv;
+  ngx_send_pt send;
+  ngx_log_t *log;
+  ngx_pool_t *pool;
+  struct sockaddr *sockaddr;
+  socklen_t socklen;
+  ngx_str_t addr_text;
+  unsigned destroyed:1;
+  unsigned error:1;
+  unsigned idle:1;
+};
+void ngx_close_connection(ngx_connection_t *c);
+
+typedef struct {
+  struct sockaddr *sockaddr;
+  socklen_t socklen;
+  ngx_str_t name;
+} ngx_peer_addr_t;
+
+typedef struct ngx_peer_connection_s ngx_peer_connection_t;
+typedef ngx_int_t (*ngx_event_get_peer_pt)(ngx_peer_connection_t *pc, void *data);
+typedef void (*ngx_event_free_peer_pt)(ngx_peer_connection_t *pc, void *data, ngx_uint_t state);
+#define NGX_PEER_KEEPALIVE 1
+#define NGX_PEER_NEXT 2
+#define NGX_PEER_FAILED 4
+struct ngx_peer_connection_s {
+  ngx_connection_t *connection;
+  struct sockaddr *sockaddr;
+  socklen_t socklen;
+  ngx_str_t *name;
+  ngx_uint_t tries;
+  ngx_event_get_peer_pt get;
+  ngx_event_free_peer_pt free;
+  void *data;
+  ngx_log_t *log;
+  unsigned cached:1;
+  unsigned log_error:2;
+};
+ngx_int_t ngx_event_connect_peer(ngx_peer_connection_t *pc);
+ngx_int_t ngx_event_get_peer(ngx_peer_connection_t *pc, void *data);
+
+/* url */
+typedef struct {
+  ngx_str_t url;
+  ngx_str_t host;
+  ngx_str_t port_text;
+  ngx_str_t uri;
+  in_port_t port;
+  in_port_t default_port;
+  unsigned listen:1;
+  unsigned uri_part:1;
+  unsigned no_resolve:1;
+  unsigned one_addr:1;
+  unsigned no_port:1;
+  ngx_peer_addr_t *addrs;
+  ngx_uint_t naddrs;
+  char *err;
+} ngx_url_t;
+struct ngx_conf_s;
+ngx_int_t ngx_parse_url(struct ngx_conf_s *cf, ngx_url_t *u);
+
+/* configuration */
+typedef struct ngx_conf_s ngx_conf_t;
+typedef struct ngx_command_s ngx_command_t;
+typedef struct ngx_module_s ngx_module_t;
+typedef struct ngx_cycle_s ngx_cycle_t;
+struct ngx_cycle_s {
+  void ****conf_ctx;
+  ngx_pool_t *pool;
+  ngx_log_t *log;
+};
+extern volatile ngx_cycle_t *ngx_cycle;
+struct ngx_conf_s {
+  char *name;
+  ngx_array_t *args;
+  ngx_cycle_t *cycle;
+  ngx_pool_t *pool;
+  ngx_log_t *log;
+  void *ctx;
+};
+struct ngx_command_s {
+  ngx_str_t name;
+  ngx_uint_t type;
+  char *(*set)(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+  ngx_uint_t conf;
+  ngx_uint_t offset;
+  void *post;
+};
+#define ngx_null_command { ngx_null_string, 0, NULL, 0, 0, NULL }
+typedef struct {
+  ngx_str_t name;
+  ngx_uint_t mask;
+} ngx_conf_bitmask_t;
+#define NGX_CONF_OK NULL
+#define NGX_CONF_ERROR (void *) -1
+#define NGX_CONF_NOARGS 0x00000001
+#define NGX_CONF_TAKE1 0x00000002
+#define NGX_CONF_TAKE2 0x00000004
+#define NGX_CONF_TAKE3 0x00000008
+#define NGX_CONF_TAKE4 0x00000010
+#define NGX_CONF_TAKE12 (NGX_CONF_TAKE1|NGX_CONF_TAKE2)
+#define NGX_CONF_TAKE13 (NGX_CONF_TAKE1|NGX_CONF_TAKE3)
+#define NGX_CONF_TAKE23 (NGX_CONF_TAKE2|NGX_CONF_TAKE3)
+#define NGX_CONF_TAKE123 (NGX_CONF_TAKE1|NGX_CONF_TAKE2|NGX_CONF_TAKE3)
+#define NGX_CONF_TAKE1234 (NGX_CONF_TAKE1|NGX_CONF_TAKE2|NGX_CONF_TAKE3|NGX_CONF_TAKE4)
+#define NGX_CONF_1MORE 0x00000800
+#define NGX_CONF_ANY 0x00000400
+#define NGX_CONF_2MORE 0x00001000
+#define NGX_CONF_UNSET -1
+#define NGX_CONF_UNSET_UINT (ngx_uint_t) -1
+#define NGX_CONF_UNSET_MSEC (ngx_msec_t) -1
+void ngx_conf_log_error(ngx_uint_t level, ngx_conf_t *cf, ngx_err_t err, const char *fmt, ...);
+ngx_shm_zone_t *ngx_shared_memory_add(ngx_conf_t *cf, ngx_str_t *name, size_t size, void *tag);
+
+struct ngx_module_s {
+  ngx_uint_t ctx_index;
+  ngx_uint_t index;
+  ngx_uint_t spare0, spare1, spare2, spare3;
+  ngx_uint_t version;
+  void *ctx;
+  ngx_command_t *commands;
+  ngx_uint_t type;
+  ngx_int_t (*init_master)(ngx_log_t *log);
+  ngx_int_t (*init_module)(ngx_cycle_t *cycle);
+  ngx_int_t (*init_process)(ngx_cycle_t *cycle);
+  ngx_int_t (*init_thread)(ngx_cycle_t *cycle);
+  void (*exit_thread)(ngx_cycle_t *cycle);
+  void (*exit_process)(ngx_cycle_t *cycle);
+  void (*exit_master)(ngx_cycle_t *cycle);
+  uintptr_t spare_hook0, spare_hook1, spare_hook2, spare_hook3,
+            spare_hook4, spare_hook5, spare_hook6, spare_hook7;
+};
+#define NGX_MODULE_V1 0, 0, 0, 0, 0, 0, 1
+#define NGX_MODULE_V1_PADDING 0, 0, 0, 0, 0, 0, 0, 0
+#define NGX_HTTP_MODULE 0x50545448
+extern ngx_uint_t ngx_process;
+#define NGX_PROCESS_SINGLE 0
+#define NGX_PROCESS_WORKER 3
+extern ngx_int_t ngx_process_slot;
+typedef pid_t ngx_pid_t;
+extern ngx_pid_t ngx_pid;
+extern ngx_uint_t ngx_test_config;
+extern ngx_uint_t ngx_exiting;
+
+/* http */
+typedef struct ngx_http_request_s ngx_http_request_t;
+typedef struct ngx_http_upstream_s ngx_http_upstream_t;
+typedef struct ngx_http_upstream_srv_conf_s ngx_http_upstream_srv_conf_t;
+typedef ngx_int_t (*ngx_http_handler_pt)(ngx_http_request_t *r);
+typedef struct {
+  void **main_conf;
+  void **srv_conf;
+  void **loc_conf;
+} ngx_http_conf_ctx_t;
+
+typedef struct {
+  ngx_int_t (*preconfiguration)(ngx_conf_t *cf);
+  ngx_int_t (*postconfiguration)(ngx_conf_t *cf);
+  void *(*create_main_conf)(ngx_conf_t *cf);
+  char *(*init_main_conf)(ngx_conf_t *cf, void *conf);
+  void *(*create_srv_conf)(ngx_conf_t *cf);
+  char *(*merge_srv_conf)(ngx_conf_t *cf, void *prev, void *conf);
+  void *(*create_loc_conf)(ngx_conf_t *cf);
+  char *(*merge_loc_conf)(ngx_conf_t *cf, void *prev, void *conf);
+} ngx_http_module_t;
+
+#define NGX_HTTP_MAIN_CONF 0x02000000
+#define NGX_HTTP_SRV_CONF 0x04000000
+#define NGX_HTTP_LOC_CONF 0x08000000
+#define NGX_HTTP_UPS_CONF 0x10000000
+#define NGX_HTTP_SIF_CONF 0x20000000
+#define NGX_HTTP_LIF_CONF 0x40000000
+#define NGX_HTTP_MAIN_CONF_OFFSET offsetof(ngx_http_conf_ctx_t, main_conf)
+#define NGX_HTTP_SRV_CONF_OFFSET offsetof(ngx_http_conf_ctx_t, srv_conf)
+#define NGX_HTTP_LOC_CONF_OFFSET offsetof(ngx_http_conf_ctx_t, loc_conf)
+
+typedef struct {
+  ngx_str_t name;
+  ngx_str_t value;
+} ngx_keyval_t;
+
+typedef struct {
+  unsigned len:28;
+  unsigned valid:1;
+  unsigned no_cachable:1;
+  unsigned not_found:1;
+  u_char *data;
+} ngx_variable_value_t;
+typedef ngx_variable_value_t ngx_http_variable_value_t;
+typedef struct ngx_http_variable_s ngx_http_variable_t;
+typedef ngx_int_t (*ngx_http_get_variable_pt)(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data);
+typedef void (*ngx_http_set_variable_pt)(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data);
+#define NGX_HTTP_VAR_CHANGABLE 1
+#define NGX_HTTP_VAR_NOCACHABLE 2
+#define NGX_HTTP_VAR_INDEXED 4
+#define NGX_HTTP_VAR_NOHASH 8
+struct ngx_http_variable_s {
+  ngx_str_t name;
+  ngx_http_set_variable_pt set_handler;
+  ngx_http_get_variable_pt get_handler;
+  uintptr_t data;
+  ngx_uint_t flags;
+  ngx_uint_t index;
+};
+ngx_http_variable_t *ngx_http_add_variable(ngx_conf_t *cf, ngx_str_t *name, ngx_uint_t flags);
+ngx_int_t ngx_http_get_variable_index(ngx_conf_t *cf, ngx_str_t *name);
+ngx_http_variable_value_t *ngx_http_get_indexed_variable(ngx_http_request_t *r, ngx_uint_t index);
+ngx_http_variable_value_t *ngx_http_get_flushed_variable(ngx_http_request_t *r, ngx_uint_t index);
+extern ngx_http_variable_value_t ngx_http_variable_null_value;
+
+typedef struct {
+  ngx_list_t headers;
+  ngx_table_elt_t *host;
+  ngx_table_elt_t *cookie_dummy;
+} ngx_http_headers_in_t;
+
+typedef struct {
+  ngx_list_t headers;
+  ngx_uint_t status;
+  ngx_str_t status_line;
+  ngx_str_t content_type;
+  off_t content_length_n;
+  time_t last_modified_time;
+} ngx_http_headers_out_t;
+
+typedef struct {
+  ngx_uint_t status_n;
+  ngx_list_t headers;
+} ngx_http_upstream_headers_in_t;
+
+typedef struct {
+  ngx_http_upstream_srv_conf_t *upstream;
+  ngx_msec_t connect_timeout;
+  ngx_msec_t send_timeout;
+  ngx_msec_t read_timeout;
+} ngx_http_upstream_conf_t;
+
+struct ngx_http_upstream_s {
+  ngx_peer_connection_t peer;
+  ngx_http_upstream_conf_t *conf;
+  ngx_http_upstream_headers_in_t headers_in;
+  ngx_chain_t *request_bufs;
+  ngx_buf_t buffer;
+  off_t length;
+  ngx_int_t (*create_request)(ngx_http_request_t *r);
+  unsigned request_sent:1;
+  unsigned header_sent:1;
+};
+
+typedef struct {
+  ngx_str_t name;
+  ngx_uint_t offset;
+} ngx_http_method_name_t;
+
+#define NGX_HTTP_UNKNOWN 0x0001
+#define NGX_HTTP_GET 0x0002
+#define NGX_HTTP_HEAD 0x0004
+#define NGX_HTTP_POST 0x0008
+#define NGX_HTTP_PUT 0x0010
+#define NGX_HTTP_DELETE 0x0020
+#define NGX_HTTP_MKCOL 0x0040
+#define NGX_HTTP_COPY 0x0080
+#define NGX_HTTP_MOVE 0x0100
+#define NGX_HTTP_OPTIONS 0x0200
+#define NGX_HTTP_PROPFIND 0x0400
+#define NGX_HTTP_PROPPATCH 0x0800
+#define NGX_HTTP_LOCK 0x1000
+#define NGX_HTTP_UNLOCK 0x2000
+#define NGX_HTTP_TRACE 0x4000
+
+struct ngx_http_request_s {
+  ngx_connection_t *connection;
+  void **ctx;
+  void **main_conf;
+  void **srv_conf;
+  void **loc_conf;
+  ngx_http_upstream_t *upstream;
+  ngx_pool_t *pool;
+  ngx_http_headers_in_t headers_in;
+  ngx_http_headers_out_t headers_out;
+  ngx_uint_t method;
+  ngx_str_t args;
+  ngx_http_request_t *main;
+  unsigned header_only:1;
+};
+
+#define NGX_HTTP_OK 200
+#define NGX_HTTP_SPECIAL_RESPONSE 300
+#define NGX_HTTP_BAD_REQUEST 400
+#define NGX_HTTP_NOT_FOUND 404
+#define NGX_HTTP_NOT_ALLOWED 405
+#define NGX_HTTP_REQUEST_TIME_OUT 408
+#define NGX_HTTP_INTERNAL_SERVER_ERROR 500
+#define NGX_HTTP_BAD_GATEWAY 502
+#define NGX_HTTP_SERVICE_UNAVAILABLE 503
+#define NGX_HTTP_GATEWAY_TIME_OUT 504
+#define NGX_HTTP_QUEUE_EXPIRATION 555
+
+typedef struct {
+  ngx_http_handler_pt handler;
+} ngx_http_core_loc_conf_t;
+extern ngx_module_t ngx_http_core_module;
+extern ngx_module_t ngx_http_upstream_module;
+
+void ngx_http_finalize_request(ngx_http_request_t *r, ngx_int_t rc);
+ngx_int_t ngx_http_send_header(ngx_http_request_t *r);
+ngx_int_t ngx_http_output_filter(ngx_http_request_t *r, ngx_chain_t *chain);
+ngx_int_t ngx_http_discard_request_body(ngx_http_request_t *r);
+ngx_int_t ngx_http_arg(ngx_http_request_t *r, u_char *name, size_t len, ngx_str_t *value);
+
+#define ngx_http_get_module_ctx(r, module) (r)->ctx[module.ctx_index]
+#define ngx_http_set_ctx(r, c, module) r->ctx[module.ctx_index] = c;
+#define ngx_http_get_module_main_conf(r, module) (r)->main_conf[module.ctx_index]
+#define ngx_http_get_module_loc_conf(r, module) (r)->loc_conf[module.ctx_index]
+#define ngx_http_conf_get_module_main_conf(cf, module) \
+  ((ngx_http_conf_ctx_t *) cf->ctx)->main_conf[module.ctx_index]
+#define ngx_http_conf_get_module_srv_conf(cf, module) \
+  ((ngx_http_conf_ctx_t *) cf->ctx)->srv_conf[module.ctx_index]
+#define ngx_http_conf_get_module_loc_conf(cf, module) \
+  ((ngx_http_conf_ctx_t *) cf->ctx)->loc_conf[module.ctx_index]
+#define ngx_http_cycle_get_module_main_conf(cycle, module) \
+  (cycle->conf_ctx[ngx_http_module.index] ? \
+   ((ngx_http_conf_ctx_t *) cycle->conf_ctx[ngx_http_module.index])->main_conf[module.ctx_index] : NULL)
+extern ngx_module_t ngx_http_module;
+
+/* upstream */
+typedef ngx_int_t (*ngx_http_upstream_init_pt)(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us);
+typedef ngx_int_t (*ngx_http_upstream_init_peer_pt)(ngx_http_request_t *r, ngx_http_upstream_srv_conf_t *us);
+typedef struct {
+  ngx_http_upstream_init_pt init_upstream;
+  ngx_http_upstream_init_peer_pt init;
+  void *data;
+} ngx_http_upstream_peer_t;
+
+typedef struct {
+  ngx_peer_addr_t *addrs;
+  ngx_uint_t naddrs;
+  ngx_uint_t weight;
+  ngx_uint_t max_fails;
+  time_t fail_timeout;
+  unsigned down:1;
+  unsigned backup:1;
+} ngx_http_upstream_server_t;
+
+#define NGX_HTTP_UPSTREAM_CREATE 0x0001
+#define NGX_HTTP_UPSTREAM_WEIGHT 0x0002
+#define NGX_HTTP_UPSTREAM_MAX_FAILS 0x0004
+#define NGX_HTTP_UPSTREAM_FAIL_TIMEOUT 0x0008
+#define NGX_HTTP_UPSTREAM_DOWN 0x0010
+#define NGX_HTTP_UPSTREAM_BACKUP 0x0020
+
+struct ngx_http_upstream_srv_conf_s {
+  ngx_http_upstream_peer_t peer;
+  void **srv_conf;
+  ngx_array_t *servers;
+  ngx_uint_t flags;
+  ngx_str_t host;
+  u_char *file_name;
+  ngx_uint_t line;
+  in_port_t port;
+  in_port_t default_port;
+};
+
+typedef struct {
+  ngx_array_t upstreams; /* ngx_http_upstream_srv_conf_t * */
+} ngx_http_upstream_main_conf_t;
+
+#define ngx_http_conf_upstream_srv_conf(uscf, module) \
+  uscf->srv_conf[module.ctx_index]
+
+void ngx_http_upstream_connect(ngx_http_request_t *r, ngx_http_upstream_t *u);
+
+/* for the benchmark: called instead of connecting to the backend and
+ * instead of sending the response */
+extern void (*ngx_mock_connect_handler)(ngx_http_request_t *r);
+extern void (*ngx_mock_finalize_handler)(ngx_http_request_t *r, ngx_int_t rc);
+/* for the benchmark: the value of variables, not found if NULL */
+extern ngx_http_variable_value_t *(*ngx_mock_variable_handler)(ngx_http_request_t *r, ngx_uint_t index);
+void ngx_mock_expire_timers(void);
+void ngx_mock_process_posted(void);
+ngx_msec_t ngx_mock_next_timer(void); /* (ngx_msec_t) -1 if none */
+
+#endif
@@ -0,0 +1,567 @@
+/* The parts of nginx that max_connections_module.c calls, implemented just
+ * well enough to run the module's queue and dispatch code in one process.
+ * Nothing here talks to the network: connecting to a backend and sending
+ * a response go to the ngx_mock_*_handler hooks instead. */
+
+#include "ngx_mock.h"
+#include <stdio.h>
+#include <strings.h>
+#include <unistd.h>
+
+volatile ngx_msec_t ngx_current_msec;
+volatile time_t ngx_mock_time;
+static ngx_time_t cached_time;
+volatile ngx_time_t *ngx_cached_time = &cached_time;
+
+static ngx_log_t mock_log = { NGX_LOG_ERR, NULL, NULL };
+static ngx_cycle_t mock_cycle = { NULL, NULL, &mock_log };
+volatile ngx_cycle_t *ngx_cycle = &mock_cycle;
+
+ngx_uint_t ngx_process = NGX_PROCESS_SINGLE;
+ngx_int_t ngx_process_slot;
+ngx_pid_t ngx_pid;
+ngx_uint_t ngx_test_config;
+ngx_uint_t ngx_exiting;
+ngx_uint_t ngx_pagesize = 4096;
+
+ngx_module_t ngx_http_module;
+ngx_module_t ngx_http_core_module;
+ngx_module_t ngx_http_upstream_module;
+
+ngx_http_variable_value_t ngx_http_variable_null_value = { 0, 1, 0, 0, (u_char *) "" };
+
+void (*ngx_mock_connect_handler)(ngx_http_request_t *r);
+void (*ngx_mock_finalize_handler)(ngx_http_request_t *r, ngx_int_t rc);
+ngx_http_variable_value_t *(*ngx_mock_variable_handler)(ngx_http_request_t *r, ngx_uint_t index);
+
+/* strings */
+
+ngx_int_t
+ngx_strncasecmp(u_char *s1, u_char *s2, size_t n)
+{
+  return strncasecmp((const char *) s1, (const char *) s2, n);
+}
+
+ngx_int_t
+ngx_atoi(u_char *line, size_t n)
+{
+  ngx_int_t value = 0;
+
+  if (n == 0) return NGX_ERROR;
+  for ( ; n--; line++) {
+    if (*line < '0' || *line > '9') return NGX_ERROR;
+    value = value * 10 + (*line - '0');
+  }
+  return value;
+}
+
+/* "500ms", "2s", "1m", ... ; sec says whether the result is in seconds */
+ngx_int_t
+ngx_parse_time(ngx_str_t *line, ngx_int_t sec)
+{
+  u_char *p = line->data, *last = p + line->len;
+  ngx_int_t total = 0, value, scale;
+
+  if (p == last) return NGX_ERROR;
+
+  while (p < last) {
+    if (*p < '0' || *p > '9') return NGX_ERROR;
+    for (value = 0; p < last && *p >= '0' && *p <= '9'; p++) {
+      value = value * 10 + (*p - '0');
+    }
+
+    if (p == last) {
+      scale = sec ? 1 : 1000;
+    } else if (last - p >= 2 && p[0] == 'm' && p[1] == 's') {
+      if (sec) return NGX_ERROR;
+      scale = 1; p += 2;
+    } else {
+      switch (*p++) {
+        case 's': scale = 1; break;
+        case 'm': scale = 60; break;
+        case 'h': scale = 3600; break;
+        case 'd': scale = 86400; break;
+        default: return NGX_ERROR;
+      }
+      if (!sec) scale *= 1000;
+    }
+    total += value * scale;
+  }
+
+  return total;
+}
+
+ssize_t
+ngx_parse_size(ngx_str_t *line)
+{
+  ssize_t scale = 1, n;
+  size_t len = line->len;
+
+  if (len == 0) return NGX_ERROR;
+  switch (line->data[len - 1]) {
+    case 'k': case 'K': scale = 1024; len--; break;
+    case 'm': case 'M': scale = 1024 * 1024; len--; break;
+  }
+  n = ngx_atoi(line->data, len);
+  return n == NGX_ERROR ? NGX_ERROR : n * scale;
+}
+
+/* The formats of ngx_sprintf() the module uses: %V %s %d %i %T %P %M and
+ * %[0width]ui / %uA. */
+static u_char *
+mock_vslprintf(u_char *buf, u_char *last, const char *fmt, va_list args)
+{
+  char num[NGX_INT_T_LEN + 1];
+
+  while (*fmt && buf < last) {
+    if (*fmt != '%') {
+      *buf++ = *fmt++;
+      continue;
+    }
+    fmt++;
+
+    char pad = ' ';
+    int width = 0, is_unsigned = 0;
+    uintmax_t u = 0;
+    intmax_t i = 0;
+    const char *s = NULL;
+    size_t len = 0;
+
+    if (*fmt == '0') pad = '0';
+    while (*fmt >= '0' && *fmt <= '9') width = width * 10 + (*fmt++ - '0');
+    if (*fmt == 'u') { is_unsigned = 1; fmt++; }
+
+    switch (*fmt++) {
+      case 'V': {
+        ngx_str_t *v = va_arg(args, ngx_str_t *);
+        len = ngx_min(v->len, (size_t) (last - buf));
+        buf = ngx_cpymem(buf, v->data, len);
+        continue;
+      }
+      case 's':
+        s = va_arg(args, char *);
+        len = ngx_min(strlen(s), (size_t) (last - buf));
+        buf = ngx_cpymem(buf, s, len);
+        continue;
+      case 'd': i = va_arg(args, int); break;
+      case 'i': i = va_arg(args, ngx_int_t); u = (ngx_uint_t) i; break;
+      case 'A': i = va_arg(args, ngx_atomic_int_t); u = (ngx_atomic_uint_t) i; break;
+      case 'T': i = va_arg(args, time_t); break;
+      case 'P': i = va_arg(args, ngx_pid_t); break;
+      case 'M': u = va_arg(args, ngx_msec_t); is_unsigned = 1; break;
+      case '%': *buf++ = '%'; continue;
+      default: abort(); /* not used by the module */
+    }
+
+    if (is_unsigned) {
+      len = snprintf(num, sizeof(num), "%*ju", width, u);
+    } else {
+      len = snprintf(num, sizeof(num), "%*jd", width, i);
+    }
+    if (pad == '0') {
+      size_t k;
+      for (k = 0; k < len && num[k] == ' '; k++) num[k] = '0';
+    }
+    len = ngx_min(len, (size_t) (last - buf));
+    buf = ngx_cpymem(buf, num, len);
+  }
+
+  return buf;
+}
+
+u_char *
+ngx_sprintf(u_char *buf, const char *fmt, ...)
+{
+  va_list args;
+  va_start(args, fmt);
+  buf = mock_vslprintf(buf, (u_char *) -1, fmt, args);
+  va_end(args);
+  return buf;
+}
+
+u_char *
+ngx_snprintf(u_char *buf, size_t max, const char *fmt, ...)
+{
+  va_list args;
+  va_start(args, fmt);
+  buf = mock_vslprintf(buf, buf + max, fmt, args);
+  va_end(args);
+  return buf;
+}
+
+u_char *
+ngx_slprintf(u_char *buf, u_char *last, const char *fmt, ...)
+{
+  va_list args;
+  va_start(args, fmt);
+  buf = mock_vslprintf(buf, last, fmt, args);
+  va_end(args);
+  return buf;
+}
+
+uint32_t
+ngx_crc32_long(u_char *p, size_t len)
+{
+  uint32_t crc = 0xffffffff;
+  int k;
+
+  while (len--) {
+    crc ^= *p++;
+    for (k = 0; k < 8; k++) crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+  }
+  return crc ^ 0xffffffff;
+}
+
+uint32_t
+ngx_crc32_short(u_char *p, size_t len)
+{
+  return ngx_crc32_long(p, len);
+}
+
+uint32_t
+ngx_hash_key(u_char *data, size_t len)
+{
+  uint32_t key = 0;
+  while (len--) key = key * 31 + *data++;
+  return key;
+}
+
+/* logging */
+
+void
+ngx_log_error_core(ngx_uint_t level, ngx_log_t *log, ngx_err_t err, const char *fmt, ...)
+{
+  u_char line[2048], *p;
+  va_list args;
+
+  va_start(args, fmt);
+  p = mock_vslprintf(line, line + sizeof(line) - 1, fmt, args);
+  va_end(args);
+  *p = '\0';
+  fprintf(stderr, "[%d] %s\n", (int) level, line);
+}
+
+void
+ngx_conf_log_error(ngx_uint_t level, ngx_conf_t *cf, ngx_err_t err, const char *fmt, ...)
+{
+  u_char line[2048], *p;
+  va_list args;
+
+  va_start(args, fmt);
+  p = mock_vslprintf(line, line + sizeof(line) - 1, fmt, args);
+  va_end(args);
+  *p = '\0';
+  fprintf(stderr, "[conf] %s\n", line);
+}
+
+/* memory: a pool is a list of malloc()ed blocks freed all at once */
+
+typedef struct mock_alloc_s {
+  struct mock_alloc_s *next;
+  long double align;
+} mock_alloc_t;
+
+void *
+ngx_alloc(size_t size, ngx_log_t *log)
+{
+  return malloc(size);
+}
+
+void *
+ngx_palloc(ngx_pool_t *pool, size_t size)
+{
+  mock_alloc_t *a = malloc(offsetof(mock_alloc_t, align) + size);
+  if (a == NULL) return NULL;
+  a->next = pool->allocs;
+  pool->allocs = a;
+  return &a->align;
+}
+
+void *
+ngx_pcalloc(ngx_pool_t *pool, size_t size)
+{
+  void *p = ngx_palloc(pool, size);
+  if (p) ngx_memzero(p, size);
+  return p;
+}
+
+ngx_pool_t *
+ngx_create_pool(size_t size, ngx_log_t *log)
+{
+  ngx_pool_t *pool = malloc(sizeof(ngx_pool_t));
+  if (pool == NULL) return NULL;
+  pool->log = log;
+  pool->allocs = NULL;
+  return pool;
+}
+
+void
+ngx_destroy_pool(ngx_pool_t *pool)
+{
+  mock_alloc_t *a = pool->allocs, *next;
+  for ( ; a; a = next) {
+    next = a->next;
+    free(a);
+  }
+  free(pool);
+}
+
+ngx_array_t *
+ngx_array_create(ngx_pool_t *p, ngx_uint_t n, size_t size)
+{
+  ngx_array_t *a = ngx_palloc(p, sizeof(ngx_array_t));
+  if (a == NULL || ngx_array_init(a, p, n, size) != NGX_OK) return NULL;
+  return a;
+}
+
+void *
+ngx_array_push(ngx_array_t *a)
+{
+  if (a->nelts == a->nalloc) {
+    ngx_uint_t nalloc = a->nalloc ? 2 * a->nalloc : 4;
+    void *elts = ngx_palloc(a->pool, nalloc * a->size);
+    if (elts == NULL) return NULL;
+    ngx_memcpy(elts, a->elts, a->nelts * a->size);
+    a->elts = elts;
+    a->nalloc = nalloc;
+  }
+  return (u_char *) a->elts + a->size * a->nelts++;
+}
+
+void *
+ngx_list_push(ngx_list_t *list)
+{
+  ngx_list_part_t *last = list->last;
+
+  if (last->nelts == list->nalloc) {
+    last = ngx_palloc(list->pool, sizeof(ngx_list_part_t));
+    if (last == NULL) return NULL;
+    last->elts = ngx_palloc(list->pool, list->nalloc * list->size);
+    if (last->elts == NULL) return NULL;
+    last->nelts = 0;
+    last->next = NULL;
+    list->last->next = last;
+    list->last = last;
+  }
+  return (u_char *) last->elts + list->size * last->nelts++;
+}
+
+ngx_buf_t *
+ngx_create_temp_buf(ngx_pool_t *pool, size_t size)
+{
+  ngx_buf_t *b = ngx_pcalloc(pool, sizeof(ngx_buf_t));
+  if (b == NULL) return NULL;
+  b->start = ngx_palloc(pool, size);
+  if (b->start == NULL) return NULL;
+  b->pos = b->last = b->start;
+  b->end = b->start + size;
+  b->temporary = 1;
+  return b;
+}
+
+void *
+ngx_slab_alloc(ngx_slab_pool_t *pool, size_t size)
+{
+  return calloc(1, size);
+}
+
+void
+ngx_slab_free(ngx_slab_pool_t *pool, void *p)
+{
+  free(p);
+}
+
+ngx_shm_zone_t *
+ngx_shared_memory_add(ngx_conf_t *cf, ngx_str_t *name, size_t size, void *tag)
+{
+  return NULL; /* the benchmark runs in a single process */
+}
+
+/* timers, in a list sorted by timer_key. The module's timers mostly have
+ * the same timeout, so inserting from the tail is O(1) in practice. */
+
+static ngx_event_t *timers_head, *timers_tail;
+
+void
+ngx_add_timer(ngx_event_t *ev, ngx_msec_t timer)
+{
+  ngx_event_t *t;
+
+  if (ev->timer_set) ngx_del_timer(ev);
+
+  ev->timer_key = ngx_current_msec + timer;
+  for (t = timers_tail; t && t->timer_key > ev->timer_key; t = t->timer_prev) ;
+
+  ev->timer_prev = t;
+  ev->timer_next = t ? t->timer_next : timers_head;
+  if (ev->timer_next) ev->timer_next->timer_prev = ev; else timers_tail = ev;
+  if (t) t->timer_next = ev; else timers_head = ev;
+  ev->timer_set = 1;
+}
+
+void
+ngx_del_timer(ngx_event_t *ev)
+{
+  if (ev->timer_prev) ev->timer_prev->timer_next = ev->timer_next;
+  else timers_head = ev->timer_next;
+  if (ev->timer_next) ev->timer_next->timer_prev = ev->timer_prev;
+  else timers_tail = ev->timer_prev;
+  ev->timer_prev = ev->timer_next = NULL;
+  ev->timer_set = 0;
+}
+
+ngx_msec_t
+ngx_mock_next_timer(void)
+{
+  return timers_head ? timers_head->timer_key : (ngx_msec_t) -1;
+}
+
+void
+ngx_mock_expire_timers(void)
+{
+  while (timers_head && timers_head->timer_key <= ngx_current_msec) {
+    ngx_event_t *ev = timers_head;
+    ngx_del_timer(ev);
+    ev->timedout = 1;
+    ev->handler(ev);
+  }
+}
+
+/* posted events, as in nginx 0.6 */
+
+volatile ngx_event_t *ngx_posted_events;
+
+void
+ngx_post_event(ngx_event_t *ev, volatile ngx_event_t **queue)
+{
+  if (ev->prev) return;
+  ev->next = (ngx_event_t *) *queue;
+  ev->prev = (ngx_event_t **) queue;
+  *queue = ev;
+  if (ev->next) ev->next->prev = &ev->next;
+}
+
+void
+ngx_delete_posted_event(ngx_event_t *ev)
+{
+  *(ev->prev) = ev->next;
+  if (ev->next) ev->next->prev = ev->prev;
+  ev->prev = NULL;
+}
+
+void
+ngx_mock_process_posted(void)
+{
+  while (ngx_posted_events) {
+    ngx_event_t *ev = (ngx_event_t *) ngx_posted_events;
+    ngx_delete_posted_event(ev);
+    ev->handler(ev);
+  }
+}
+
+ngx_int_t
+ngx_handle_read_event(ngx_event_t *rev, ngx_uint_t flags)
+{
+  return NGX_OK;
+}
+
+ngx_int_t
+ngx_handle_write_event(ngx_event_t *wev, size_t lowat)
+{
+  return NGX_OK;
+}
+
+void
+ngx_close_connection(ngx_connection_t *c)
+{
+  if (c->read->timer_set) ngx_del_timer(c->read);
+  if (c->write->timer_set) ngx_del_timer(c->write);
+  if (c->fd != -1) close(c->fd);
+  c->fd = -1;
+}
+
+ngx_int_t
+ngx_event_connect_peer(ngx_peer_connection_t *pc)
+{
+  return NGX_DECLINED; /* health checks fail: there is no network */
+}
+
+ngx_int_t
+ngx_event_get_peer(ngx_peer_connection_t *pc, void *data)
+{
+  return NGX_OK;
+}
+
+ngx_int_t
+ngx_parse_url(ngx_conf_t *cf, ngx_url_t *u)
+{
+  u->err = "not supported by the mock";
+  return NGX_ERROR;
+}
+
+/* http */
+
+ngx_http_variable_t *
+ngx_http_add_variable(ngx_conf_t *cf, ngx_str_t *name, ngx_uint_t flags)
+{
+  ngx_http_variable_t *v = ngx_pcalloc(cf->pool, sizeof(ngx_http_variable_t));
+  if (v) v->name = *name;
+  return v;
+}
+
+ngx_int_t
+ngx_http_get_variable_index(ngx_conf_t *cf, ngx_str_t *name)
+{
+  return NGX_ERROR;
+}
+
+ngx_http_variable_value_t *
+ngx_http_get_indexed_variable(ngx_http_request_t *r, ngx_uint_t index)
+{
+  if (ngx_mock_variable_handler) return ngx_mock_variable_handler(r, index);
+  return &ngx_http_variable_null_value;
+}
+
+ngx_http_variable_value_t *
+ngx_http_get_flushed_variable(ngx_http_request_t *r, ngx_uint_t index)
+{
+  return &ngx_http_variable_null_value;
+}
+
+void
+ngx_http_upstream_connect(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+  ngx_int_t rc = u->peer.get(&u->peer, u->peer.data);
+  if (rc != NGX_OK && rc != NGX_DONE) abort();
+  if (ngx_mock_connect_handler) ngx_mock_connect_handler(r);
+}
+
+void
+ngx_http_finalize_request(ngx_http_request_t *r, ngx_int_t rc)
+{
+  if (ngx_mock_finalize_handler) ngx_mock_finalize_handler(r, rc);
+}
+
+ngx_int_t
+ngx_http_send_header(ngx_http_request_t *r)
+{
+  return NGX_OK;
+}
+
+ngx_int_t
+ngx_http_output_filter(ngx_http_request_t *r, ngx_chain_t *chain)
+{
+  return NGX_OK;
+}
+
+ngx_int_t
+ngx_http_discard_request_body(ngx_http_request_t *r)
+{
+  return NGX_OK;
+}
+
+ngx_int_t
+ngx_http_arg(ngx_http_request_t *r, u_char *name, size_t len, ngx_str_t *value)
+{
+  return NGX_DECLINED;
+}
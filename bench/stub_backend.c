@@ -0,0 +1,388 @@
+/* A backend for end-to-end benchmarks: a single-threaded epoll HTTP server
+ * that answers every request with a short 200 after a service time. With
+ * -c it works on only that many requests at once and makes the rest wait,
+ * as a Mongrel does, so that nginx's queue is what is being measured.
+ *
+ *   ./bench/stub_backend [-p port] [-s ms] [-e] [-c concurrency]
+ *
+ *   -p  port to listen on (8001)
+ *   -s  service time in milliseconds, fractions allowed (0)
+ *   -e  exponentially distributed service times with -s as the mean
+ *   -c  requests worked on at once, 0 for no limit (0)
+ *
+ * Responses are HTTP/1.0 with "Connection: close" unless the request was
+ * HTTP/1.1 without "Connection: close". On SIGINT or SIGTERM it prints how
+ * many requests it served and the most it worked on at once.
+ */
+
+#define _GNU_SOURCE /* memmem, accept4 */
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BUF_SIZE 8192
+
+enum { READING, WAITING, SERVING, WRITING };
+
+typedef struct conn_s conn_t;
+struct conn_s {
+  int fd;
+  int state;
+  int keepalive;
+  char buf[BUF_SIZE];
+  size_t len; /* bytes in buf */
+  size_t request_len; /* header and body of the current request */
+  const char *out;
+  size_t out_len;
+  uint64_t due; /* when SERVING is over, microseconds */
+  size_t heap_index;
+  conn_t *next_waiting;
+};
+
+static double service_ms;
+static int exponential;
+static long concurrency;
+
+static long serving; /* requests in SERVING */
+static long max_serving;
+static unsigned long served;
+
+static conn_t **heap; /* SERVING connections by due time */
+static size_t heap_size, heap_alloc;
+static conn_t *waiting_head, *waiting_tail;
+
+static int epfd;
+static int tfd; /* fires at the due time of heap[0] */
+static conn_t timer_conn; /* marks tfd in epoll */
+static volatile sig_atomic_t stop;
+
+static const char response_close[] =
+  "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\n"
+  "Content-Length: 3\r\nConnection: close\r\n\r\nok\n";
+static const char response_keepalive[] =
+  "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n"
+  "Content-Length: 3\r\n\r\nok\n";
+
+static uint64_t
+now_us (void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+heap_swap (size_t i, size_t j)
+{
+  conn_t *t = heap[i];
+  heap[i] = heap[j];
+  heap[j] = t;
+  heap[i]->heap_index = i;
+  heap[j]->heap_index = j;
+}
+
+static void
+heap_push (conn_t *c)
+{
+  size_t i = heap_size++;
+
+  if (heap_size > heap_alloc) {
+    heap_alloc = heap_alloc ? 2 * heap_alloc : 1024;
+    heap = realloc(heap, heap_alloc * sizeof(conn_t *));
+    if (heap == NULL) abort();
+  }
+  heap[i] = c;
+  c->heap_index = i;
+  while (i > 0 && heap[(i - 1) / 2]->due > heap[i]->due) {
+    heap_swap(i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
+
+static conn_t *
+heap_pop (void)
+{
+  conn_t *top = heap[0];
+  size_t i = 0;
+
+  heap[0] = heap[--heap_size];
+  heap[0]->heap_index = 0;
+  for (;;) {
+    size_t l = 2 * i + 1, r = l + 1, m = i;
+    if (l < heap_size && heap[l]->due < heap[m]->due) m = l;
+    if (r < heap_size && heap[r]->due < heap[m]->due) m = r;
+    if (m == i) break;
+    heap_swap(i, m);
+    i = m;
+  }
+  return top;
+}
+
+static void
+conn_close (conn_t *c)
+{
+  close(c->fd);
+  free(c);
+}
+
+static void
+watch (conn_t *c, uint32_t events)
+{
+  struct epoll_event ev = { .events = events, .data.ptr = c };
+  epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+static uint64_t
+service_time_us (void)
+{
+  double ms = service_ms;
+  if (exponential && ms > 0) ms = -ms * log(1.0 - drand48());
+  return (uint64_t) (ms * 1000);
+}
+
+static void conn_read (conn_t *c);
+
+static void
+start_serving (conn_t *c)
+{
+  c->state = SERVING;
+  c->due = now_us() + service_time_us();
+  heap_push(c);
+  if (++serving > max_serving) max_serving = serving;
+}
+
+/* A complete request is in the buffer. */
+static void
+request_ready (conn_t *c)
+{
+  if (concurrency && serving >= concurrency) {
+    c->state = WAITING;
+    c->next_waiting = NULL;
+    if (waiting_tail) waiting_tail->next_waiting = c; else waiting_head = c;
+    waiting_tail = c;
+  } else {
+    start_serving(c);
+  }
+  watch(c, 0); /* like most backends we do not notice the client leaving */
+}
+
+static void
+response_sent (conn_t *c)
+{
+  served++;
+
+  if (!c->keepalive) {
+    conn_close(c);
+    return;
+  }
+
+  /* anything pipelined after the request */
+  memmove(c->buf, c->buf + c->request_len, c->len - c->request_len);
+  c->len -= c->request_len;
+  c->state = READING;
+  watch(c, EPOLLIN);
+  conn_read(c);
+}
+
+static void
+conn_write (conn_t *c)
+{
+  while (c->out_len) {
+    ssize_t n = write(c->fd, c->out, c->out_len);
+    if (n < 0 && errno == EAGAIN) {
+      watch(c, EPOLLOUT);
+      return;
+    }
+    if (n <= 0) {
+      conn_close(c);
+      return;
+    }
+    c->out += n;
+    c->out_len -= n;
+  }
+  response_sent(c);
+}
+
+static void
+done_serving (conn_t *c)
+{
+  serving--;
+
+  if (waiting_head) {
+    conn_t *next = waiting_head;
+    waiting_head = next->next_waiting;
+    if (waiting_head == NULL) waiting_tail = NULL;
+    start_serving(next);
+  }
+
+  c->state = WRITING;
+  if (c->keepalive) {
+    c->out = response_keepalive;
+    c->out_len = sizeof(response_keepalive) - 1;
+  } else {
+    c->out = response_close;
+    c->out_len = sizeof(response_close) - 1;
+  }
+  conn_write(c);
+}
+
+/* Returns the length of the request at the start of the buffer, or 0 if it
+ * is not all there yet. Sets keepalive. */
+static size_t
+parse_request (conn_t *c)
+{
+  char *end = memmem(c->buf, c->len, "\r\n\r\n", 4);
+  if (end == NULL) return 0;
+
+  size_t header_len = end + 4 - c->buf;
+  long content_length = 0;
+  char *line = memchr(c->buf, '\n', header_len);
+
+  c->keepalive = memmem(c->buf, line - c->buf, "HTTP/1.1", 8) != NULL;
+
+  for (line++; line < end; line = memchr(line, '\n', end + 2 - line) + 1) {
+    if (strncasecmp(line, "Content-Length:", 15) == 0) {
+      content_length = atol(line + 15);
+    } else if (strncasecmp(line, "Connection:", 11) == 0) {
+      char *v = line + 11;
+      while (*v == ' ') v++;
+      if (strncasecmp(v, "close", 5) == 0) c->keepalive = 0;
+      if (strncasecmp(v, "keep-alive", 10) == 0) c->keepalive = 1;
+    }
+  }
+
+  if (c->len < header_len + content_length) return 0;
+  return header_len + content_length;
+}
+
+static void
+conn_read (conn_t *c)
+{
+  for (;;) {
+    if ((c->request_len = parse_request(c))) {
+      request_ready(c);
+      return;
+    }
+    if (c->len == BUF_SIZE) { /* too big for us */
+      conn_close(c);
+      return;
+    }
+
+    ssize_t n = read(c->fd, c->buf + c->len, BUF_SIZE - c->len);
+    if (n < 0 && errno == EAGAIN) return;
+    if (n <= 0) {
+      conn_close(c);
+      return;
+    }
+    c->len += n;
+  }
+}
+
+static void
+on_signal (int sig)
+{
+  stop = 1;
+}
+
+int
+main (int argc, char **argv)
+{
+  int port = 8001, opt;
+
+  while ((opt = getopt(argc, argv, "p:s:ec:")) != -1) {
+    switch (opt) {
+      case 'p': port = atoi(optarg); break;
+      case 's': service_ms = atof(optarg); break;
+      case 'e': exponential = 1; break;
+      case 'c': concurrency = atol(optarg); break;
+      default:
+        fprintf(stderr, "usage: %s [-p port] [-s ms] [-e] [-c concurrency]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+  srand48(getpid());
+
+  int lfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  int one = 1;
+  setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  struct sockaddr_in sin = { .sin_family = AF_INET, .sin_port = htons(port) };
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(lfd, (struct sockaddr *) &sin, sizeof(sin)) < 0 || listen(lfd, 4096) < 0) {
+    perror("stub_backend: listen");
+    return 1;
+  }
+
+  epfd = epoll_create1(0);
+  struct epoll_event lev = { .events = EPOLLIN, .data.ptr = NULL };
+  epoll_ctl(epfd, EPOLL_CTL_ADD, lfd, &lev);
+
+  /* epoll_wait() only waits whole milliseconds */
+  tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+  struct epoll_event tev = { .events = EPOLLIN, .data.ptr = &timer_conn };
+  epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &tev);
+
+  struct epoll_event events[256];
+
+  while (!stop) {
+    if (heap_size) {
+      struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+      its.it_value.tv_sec = heap[0]->due / 1000000;
+      its.it_value.tv_nsec = heap[0]->due % 1000000 * 1000 + 1;
+      timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL);
+    }
+
+    int n = epoll_wait(epfd, events, 256, -1), i;
+
+    for (i = 0; i < n; i++) {
+      conn_t *c = events[i].data.ptr;
+
+      if (c == &timer_conn) {
+        uint64_t expirations;
+        ssize_t r = read(tfd, &expirations, sizeof(expirations));
+        (void) r;
+        continue;
+      }
+
+      if (c == NULL) {
+        int fd;
+        while ((fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+          setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+          c = calloc(1, sizeof(conn_t));
+          if (c == NULL) abort();
+          c->fd = fd;
+          c->state = READING;
+          struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+          epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+        }
+        continue;
+      }
+
+      if (c->state == READING) conn_read(c);
+      else if (c->state == WRITING) conn_write(c);
+    }
+
+    uint64_t now = now_us();
+    while (heap_size && heap[0]->due <= now) done_serving(heap_pop());
+  }
+
+  fprintf(stderr, "stub_backend: served %lu, at most %ld at once\n", served, max_serving);
+  return 0;
+}
@@ -10,45 +10,344 @@
 #include <ngx_http_upstream.h>
 #include <assert.h>
 
-/* 0.5 seconds until a backend SLOT is reset after client half-close */
+/* What happens to the backend slot of a request whose client went away,
+ * see max_connections_client_closure. By default the slot is held for 0.5
+ * seconds; drained connections are given up after a minute. */
+#define CLOSURE_HOLD    0
+#define CLOSURE_DRAIN   1
+#define CLOSURE_RELEASE 2
 #define CLIENT_CLOSURE_SLEEP ((ngx_msec_t)500)  
+#define CLIENT_CLOSURE_DRAIN ((ngx_msec_t)60000)
 
+/* how often a worker with queued requests looks at the shared zone for
+ * slots released by other workers */
+#define ZONE_POLL_INTERVAL ((ngx_msec_t)10)
+
+/* "max_connections adaptive": limits are fixed point with ADAPTIVE_ONE
+ * being one slot. A response slower than ADAPTIVE_TOLERANCE times the
+ * fastest recent one (plus ADAPTIVE_SLACK ms of jitter) means the backend
+ * is queueing. The fastest response is re-measured every
+ * ADAPTIVE_RTT_WINDOW responses so the baseline can move up. */
+#define ADAPTIVE_ONE        1024
+#define ADAPTIVE_TOLERANCE  2
+#define ADAPTIVE_SLACK      ((ngx_msec_t)2)
+#define ADAPTIVE_RTT_WINDOW 256
+
+/* Slot counters for one backend. These normally point into process memory
+ * but when the upstream has a max_connections_zone they are moved into
+ * shared memory so that the limit holds across all workers. */
+typedef struct {
+  ngx_atomic_t connections;
+  ngx_atomic_t limit; /* adaptive limit, fixed point. see backend_adapt() */
+  ngx_atomic_t requests; /* completed */
+  ngx_atomic_t failures;
+} max_connections_slots_t;
+
+/* Responses seen by the circuit breaker in one window. */
+typedef struct {
+  ngx_uint_t requests;
+  ngx_uint_t errors; /* failed or 5xx */
+  ngx_uint_t slow; /* slower than circuit_latency */
+} max_connections_window_t;
+
+/* upper bounds in ms of the queue wait histogram, plus one for the rest */
+static ngx_msec_t max_connections_wait_buckets[] = 
+  { 1, 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000 };
+#define WAIT_BUCKETS \
+  (sizeof(max_connections_wait_buckets) / sizeof(ngx_msec_t) + 1)
+
+/* per upstream state that lives next to the slots */
+typedef struct {
+  ngx_atomic_t releases; /* incremented every time a slot is freed */
+
+  /* statistics for max_connections_status */
+  ngx_atomic_t enqueued;
+  ngx_atomic_t dispatched;
+  ngx_atomic_t expired;
+  ngx_atomic_t rejected; /* turned away, see queue_reject() */
+  ngx_atomic_t hedged; /* sent to a second backend, see hedge_handler() */
+  ngx_atomic_t overflowed; /* handed to max_connections_overflow */
+  ngx_atomic_t wait_sum; /* ms */
+  ngx_atomic_t wait[WAIT_BUCKETS];
+} max_connections_shared_t;
+
+/* layout of a max_connections_zone. One block is allocated from the slab
+ * holding a max_connections_shared_t for every upstream using the zone
+ * followed by the slots of all their backends. */
+typedef struct {
+  ngx_uint_t nupstreams;
+  ngx_uint_t nslots;
+  max_connections_shared_t *upstreams;
+  max_connections_slots_t *slots;
+} max_connections_shm_t;
+
+typedef struct {
+  ngx_shm_zone_t *shm_zone;
+  ngx_array_t *upstreams; /* max_connections_srv_conf_t * */
+  max_connections_shm_t *sh;
+} max_connections_zone_t;
+
+typedef struct max_connections_backend_s max_connections_backend_t;
+typedef struct max_connections_srv_conf_s max_connections_srv_conf_t;
+
+/* a point on the consistent hash ring, see hash_backend() */
+typedef struct {
+  uint32_t hash;
+  max_connections_backend_t *backend;
+} max_connections_point_t;
+
+#define HASH_POINTS 160 /* per unit of weight */
+#define HASH_ONE    100 /* bounded= is kept in hundredths */
+
+#define QUEUE_POLICY_STRICT   0
+#define QUEUE_POLICY_WEIGHTED 1
+
+#define QUEUE_MODE_FIFO     0
+#define QUEUE_MODE_LIFO     1
+#define QUEUE_MODE_ADAPTIVE 2
+
+#define BALANCE_LEAST_CONN 0
+#define BALANCE_P2C_EWMA   1
+#define EWMA_ONE   1024 /* response times are kept in 1/1024 ms */
+#define EWMA_SHIFT 3    /* each response counts for 1/8 of the average */
+
+#define HEDGE_COST   100  /* budget tokens per hedge; a request adds budget% */
+#define HEDGE_BURST  10   /* hedges the budget can save up */
+#define HEDGE_WINDOW 1024 /* responses after which the histogram is halved */
+#define HEDGE_MIN    20   /* responses needed before a percentile is used */
+
+#define FAIR_FLOWS 1024 /* default number of max_connections_fair_key flows */
+
+/* A flow of max_connections_fair_key within one class: the queued requests
+ * of the keys that hash to it. The class serves the flows in its
+ * active_flows list in turns. A flow is in that list while it has requests
+ * queued and is under fair_max_inflight. */
+typedef struct {
+  ngx_queue_t waiting_requests; /* newest first, as in the class */
+  ngx_queue_t active; /* link in queue->active_flows, next NULL when out */
+  ngx_uint_t deficit; /* requests left in its current turn */
+} max_connections_flow_t;
+
+/* A priority class. Each has its own list of waiting requests, length
+ * limit and timeout. Classes are kept in maxconn_cf->queues in order of
+ * priority, highest first. */
 typedef struct {
-  ngx_uint_t max_connections;
+  ngx_str_t name;
   ngx_uint_t max_queue_length;
   ngx_uint_t queue_length;
-  ngx_queue_t waiting_requests;
-  ngx_array_t *backends; /* backend servers */
-  ngx_event_t queue_check_event;
   ngx_msec_t queue_timeout;
-} max_connections_srv_conf_t;
+  ngx_uint_t weight; /* share under max_connections_queue_policy weighted */
+  ngx_int_t current_weight;
+  ngx_queue_t waiting_requests;
+  max_connections_flow_t *flows; /* fair_flows of them, NULL when off */
+  ngx_queue_t active_flows;
+  max_connections_srv_conf_t *maxconn_cf;
+} max_connections_queue_t;
 
+/* max_connections_server: settings for the backends at one address */
 typedef struct {
+  ngx_str_t name;
+  ngx_peer_addr_t *addrs;
+  ngx_uint_t naddrs;
+  ngx_uint_t max_connections; /* 0 means the upstream's max_connections */
+  ngx_msec_t slow_start; /* 0 means none */
+} max_connections_server_conf_t;
+
+struct max_connections_srv_conf_s {
+  ngx_uint_t max_connections; /* the maximum when adaptive */
+  ngx_uint_t adaptive_min;
+  ngx_uint_t adaptive:1;
+  ngx_uint_t max_queue_length; /* of the default class */
+  ngx_uint_t queue_length; /* total over all classes */
+  ngx_array_t *backends; /* backend servers */
+  ngx_array_t *servers; /* max_connections_server_conf_t */
+  ngx_msec_t queue_timeout; /* of the default class */
+
+  ngx_array_t *queues; /* max_connections_queue_t, highest priority first */
+  ngx_uint_t queue_policy;
+  ngx_uint_t queue_mode; /* which end of a class requests are taken from */
+  ngx_msec_t lifo_after; /* under adaptive, the wait that switches to LIFO */
+  ngx_int_t priority_index; /* variable naming the class, or NGX_ERROR */
+  ngx_int_t timeout_index; /* variable with a shorter timeout, or NGX_ERROR */
+
+  /* max_connections_fair_key; fair_index is NGX_ERROR when off */
+  ngx_int_t fair_index;
+  ngx_uint_t fair_flows;
+  ngx_uint_t fair_quantum; /* requests a flow sends per turn */
+  ngx_uint_t fair_max_inflight; /* per flow, 0 for no limit */
+  ngx_uint_t *fair_inflight; /* per flow, requests sent and not yet done */
+  ngx_uint_t active_flows; /* in the active_flows of all classes */
+
+  /* turning requests away, see queue_admit() and queue_reject() */
+  ngx_uint_t admission; /* ADMISSION_OFF, ADMISSION_PREDICT or ADMISSION_CODEL */
+  ngx_uint_t reject_status;
+  time_t retry_after; /* seconds, 0 for no Retry-After header */
+  ngx_uint_t expire_status; /* for requests that waited out their timeout */
+  ngx_str_t overflow_name; /* max_connections_overflow, empty when off */
+  ngx_http_upstream_srv_conf_t *overflow;
+  ngx_msec_t overflow_wait; /* predicted wait that overflows, 0 for none */
+  ngx_uint_t dispatch_gap; /* average ms between dispatches while backlogged */
+  ngx_msec_t backlog_since; /* last dispatch, or when the queue filled */
+  ngx_msec_t codel_target;
+  ngx_msec_t codel_interval;
+  ngx_msec_t codel_first_above; /* 0 while below target */
+  ngx_msec_t codel_drop_next;
+  ngx_uint_t codel_count;
+  ngx_uint_t codel_dropping:1;
+  max_connections_queue_t *default_queue;
+
+  /* Backends that can take a request right now, in a binary min-heap
+   * ordered by connections. The root is what find_upstream() returns. */
+  max_connections_backend_t **heap;
+  ngx_uint_t heap_size;
+  ngx_uint_t nalive; /* backends neither down nor failed */
+  ngx_uint_t balance; /* BALANCE_LEAST_CONN or BALANCE_P2C_EWMA */
+  ngx_uint_t connections; /* slots held by this worker, over all backends */
+
+  /* max_connections_hash; hash_index is NGX_ERROR when off */
+  ngx_int_t hash_index;
+  ngx_uint_t hash_bound; /* HASH_ONE times the bound, 0 for none */
+  max_connections_point_t *points; /* the ring, sorted by hash */
+  ngx_uint_t npoints;
+  ngx_queue_t saturated; /* backends filled up by other workers */
+
+  max_connections_zone_t *zone; /* NULL unless max_connections_zone is set */
+  max_connections_shared_t *shared;
+  max_connections_shared_t local_shared;
+  ngx_atomic_uint_t releases_seen; /* of releases_of(maxconn_cf) */
+  ngx_event_t zone_poll_event;
+
+  /* max_connections_pool. Backends at the same address in all upstreams
+   * of a pool share their slots. The first upstream of the pool keeps the
+   * list of members and its release counter is used by all of them. */
+  ngx_str_t pool; /* empty unless in a pool */
+  max_connections_srv_conf_t *pool_first; /* this one if not in a pool */
+  ngx_array_t *pool_members; /* max_connections_srv_conf_t *, first only */
+
+  ngx_uint_t dispatch_batch; /* requests dispatched per call, 0 for all */
+
+  /* max_connections_hedge; hedge_after and hedge_percentile are 0 when
+   * off */
+  ngx_msec_t hedge_after;
+  ngx_uint_t hedge_percentile;
+  ngx_uint_t hedge_methods;
+  ngx_uint_t hedge_max; /* hedges per request */
+  ngx_uint_t hedge_budget; /* percent of requests */
+  ngx_uint_t hedge_tokens;
+  ngx_uint_t hedge_histogram[WAIT_BUCKETS]; /* recent response times */
+  ngx_uint_t hedge_samples;
+
+  /* max_connections_deadline_headers; empty names are not sent */
+  ngx_str_t deadline_start;
+  ngx_str_t deadline_remaining;
+
+  ngx_uint_t client_closure; /* CLOSURE_HOLD, CLOSURE_DRAIN or CLOSURE_RELEASE */
+  ngx_msec_t closure_timeout; /* how long to hold, or to drain at most */
+
+  /* max_connections_health_check; check_interval is 0 when off */
+  ngx_msec_t check_interval;
+  ngx_msec_t check_timeout;
+  ngx_str_t check_path;
+  ngx_uint_t check_fall;
+  ngx_uint_t check_rise;
+  ngx_buf_t *check_request;
+
+  /* max_connections_circuit_breaker; circuit_window is 0 when off */
+  ngx_msec_t circuit_window;
+  ngx_uint_t circuit_errors; /* percent of responses */
+  ngx_msec_t circuit_latency; /* p99 limit, 0 for none */
+  ngx_uint_t circuit_min_requests;
+  ngx_msec_t circuit_open; /* how long an open circuit stays open */
+  ngx_uint_t dispatching:1; /* dispatch() is on the stack */
+  ngx_event_t dispatch_event; /* posted when a batch was cut short */
+};
+
+struct max_connections_backend_s {
   struct sockaddr *sockaddr;
   socklen_t socklen;
   ngx_str_t *name;
 
-  ngx_uint_t weight; /* unused */
+  ngx_uint_t weight;
+  ngx_uint_t max_connections; /* slots on this backend, see backend_limit() */
   ngx_uint_t  max_fails;
   time_t fail_timeout;
 
   time_t accessed;
   ngx_uint_t down:1;
 
+  ngx_msec_t slow_start; /* ramp up time after coming back, or 0 */
+  ngx_msec_t revived; /* when it last came back, 0 when not ramping up */
+  ngx_event_t slow_start_event; /* fires when the ramp gains a slot */
+
   ngx_uint_t fails;
-  ngx_uint_t client_closures;
-  ngx_uint_t connections;
+  ngx_uint_t client_closures; /* slots held after clients went away */
+  ngx_uint_t draining; /* connections read to the end for gone clients */
+  ngx_uint_t connections; /* slots held by this worker */
+  max_connections_slots_t *slots; /* slots held by everyone */
+  max_connections_slots_t local_slots;
   ngx_event_t disconnect_event;
+  ngx_event_t revive_event; /* fires fail_timeout after the backend died */
   max_connections_srv_conf_t *maxconn_cf;
-} max_connections_backend_t;
+
+  /* response times for the adaptive limit */
+  ngx_msec_t min_rtt;
+  ngx_msec_t window_min_rtt;
+  ngx_uint_t rtt_samples;
+  ngx_msec_t last_decrease;
+
+  /* average response time in 1/EWMA_ONE ms for p2c_ewma, 0 before the
+   * first */
+  ngx_uint_t ewma;
+
+  ngx_uint_t heap_index; /* HEAP_NONE when not in maxconn_cf->heap */
+  ngx_queue_t saturated; /* link in maxconn_cf->saturated */
+  ngx_uint_t is_saturated:1;
+
+  /* the backend of another upstream in the pool whose slots these are */
+  max_connections_backend_t *pool_leader;
+
+  /* active health check, see check_start() */
+  ngx_uint_t check_down:1;
+  ngx_uint_t check_ok; /* checks in a row that passed */
+  ngx_uint_t check_failed; /* checks in a row that failed */
+  ngx_event_t check_event;
+  ngx_peer_connection_t check_pc;
+  size_t check_sent;
+  ngx_buf_t *check_response;
+
+  /* circuit breaker, see circuit_record() */
+  ngx_uint_t circuit; /* CIRCUIT_CLOSED, CIRCUIT_OPEN or CIRCUIT_HALF_OPEN */
+  ngx_uint_t circuit_probe:1; /* the half open circuit's request is out */
+  ngx_msec_t circuit_start; /* of circuit_now */
+  max_connections_window_t circuit_now;
+  max_connections_window_t circuit_prev; /* the window before */
+  ngx_event_t circuit_event; /* open -> half open */
+};
 
 typedef struct {
   max_connections_srv_conf_t *maxconn_cf;
   max_connections_backend_t  *backend; /* the backend the peer was sent to */
+  max_connections_backend_t  *served_by; /* last backend, kept for the log */
   ngx_queue_t queue; /* queue information */
+  max_connections_queue_t *queue_class;
+  ngx_event_t expire_event; /* fires when it has waited too long */
   ngx_http_request_t *r; /* the request associated with the peer */
   ngx_msec_t accessed;
+  ngx_msec_t waited; /* time spent in the queue */
+  ngx_msec_t timeout; /* its queue timeout */
+  ngx_uint_t position; /* requests ahead of it in its class when queued */
+  uintptr_t *tried; /* bitmap of backends, for retries */
+  uintptr_t tried_data;
+  ngx_msec_t started; /* when peer_get() sent it to the backend */
+  ngx_event_t hedge_event; /* fires when the backend is slow to answer */
+  ngx_uint_t hedges;
+  uint32_t hash; /* of the max_connections_hash key */
+  ngx_queue_t flow_queue; /* link in its flow, with max_connections_fair_key */
+  ngx_uint_t flow;
+  ngx_uint_t inflight:1; /* counted in fair_inflight */
+  ngx_uint_t hashed:1; /* the request had a key */
   ngx_uint_t really_needs_backend:1;
+  ngx_uint_t overflowed:1; /* handed to max_connections_overflow */
 } max_connections_peer_data_t;
 
 static ngx_uint_t max_connections_rr_index;
@@ -57,13 +356,56 @@ static ngx_uint_t max_connections_rr_index;
 static char * max_connections_command (ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static char * max_connections_queue_timeout_command (ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static char * max_connections_max_queue_length_command (ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char * max_connections_zone_command (ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char * max_connections_server_command (ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char * max_connections_queue_class_command (ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char * max_connections_queue_policy_command (ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char * max_connections_queue_mode_command (ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char * max_connections_hash_command (ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char * max_connections_fair_key_command (ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char * max_connections_balance_command (ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char * max_connections_deadline_headers_command (ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char * max_connections_hedge_command (ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char * max_connections_client_closure_command (ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char * max_connections_priority_command (ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char * max_connections_dispatch_batch_command (ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char * max_connections_health_check_command (ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char * max_connections_circuit_breaker_command (ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char * max_connections_pool_command (ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char * max_connections_queue_timeout_variable_command (ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char * max_connections_admission_command (ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char * max_connections_reject_status_command (ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char * max_connections_expire_status_command (ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char * max_connections_overflow_command (ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static ngx_int_t max_connections_init_process (ngx_cycle_t *cycle);
+static char * max_connections_status_command (ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static ngx_int_t max_connections_add_variables (ngx_conf_t *cf);
+static ngx_int_t max_connections_init (ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *uscf);
 static void * max_connections_create_conf(ngx_conf_t *cf);
 
-#define RAMP(x) (x > 0 ? x : 0)
+/* max_connections_admission. PREDICT_ONE is 1ms in dispatch_gap */
+#define ADMISSION_OFF     0
+#define ADMISSION_PREDICT 1
+#define ADMISSION_CODEL   2
+#define PREDICT_ONE       1024
+
+#define CIRCUIT_CLOSED    0
+#define CIRCUIT_OPEN      1
+#define CIRCUIT_HALF_OPEN 2
+
+#define TRIED_BITS (8 * sizeof(uintptr_t))
+#define backend_tried(tried, i) \
+  ((tried)[(i) / TRIED_BITS] & ((uintptr_t) 1 << (i) % TRIED_BITS))
+
+/* The counter bumped whenever a slot is freed. Shared by a pool. */
+#define releases_of(maxconn_cf) \
+  ((maxconn_cf)->pool_first->shared->releases)
+
+#define HEAP_NONE ((ngx_uint_t) -1)
 
 static ngx_command_t  max_connections_commands[] =
 { { ngx_string("max_connections")
-  , NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1
+  , NGX_HTTP_UPS_CONF|NGX_CONF_TAKE123
   , max_connections_command
   , 0
   , 0
@@ -83,11 +425,165 @@ static ngx_command_t  max_connections_commands[] =
   , 0
   , NULL
   }
+, { ngx_string("max_connections_zone")
+  , NGX_HTTP_UPS_CONF|NGX_CONF_TAKE2
+  , max_connections_zone_command
+  , 0
+  , 0
+  , NULL
+  }
+, { ngx_string("max_connections_server")
+  , NGX_HTTP_UPS_CONF|NGX_CONF_2MORE
+  , max_connections_server_command
+  , 0
+  , 0
+  , NULL
+  }
+, { ngx_string("max_connections_queue_class")
+  , NGX_HTTP_UPS_CONF|NGX_CONF_1MORE
+  , max_connections_queue_class_command
+  , 0
+  , 0
+  , NULL
+  }
+, { ngx_string("max_connections_queue_policy")
+  , NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1
+  , max_connections_queue_policy_command
+  , 0
+  , 0
+  , NULL
+  }
+, { ngx_string("max_connections_client_closure")
+  , NGX_HTTP_UPS_CONF|NGX_CONF_TAKE12
+  , max_connections_client_closure_command
+  , 0
+  , 0
+  , NULL
+  }
+, { ngx_string("max_connections_hash")
+  , NGX_HTTP_UPS_CONF|NGX_CONF_TAKE12
+  , max_connections_hash_command
+  , 0
+  , 0
+  , NULL
+  }
+, { ngx_string("max_connections_hedge")
+  , NGX_HTTP_UPS_CONF|NGX_CONF_1MORE
+  , max_connections_hedge_command
+  , 0
+  , 0
+  , NULL
+  }
+, { ngx_string("max_connections_deadline_headers")
+  , NGX_HTTP_UPS_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE12
+  , max_connections_deadline_headers_command
+  , 0
+  , 0
+  , NULL
+  }
+, { ngx_string("max_connections_balance")
+  , NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1
+  , max_connections_balance_command
+  , 0
+  , 0
+  , NULL
+  }
+, { ngx_string("max_connections_fair_key")
+  , NGX_HTTP_UPS_CONF|NGX_CONF_1MORE
+  , max_connections_fair_key_command
+  , 0
+  , 0
+  , NULL
+  }
+, { ngx_string("max_connections_queue_mode")
+  , NGX_HTTP_UPS_CONF|NGX_CONF_TAKE12
+  , max_connections_queue_mode_command
+  , 0
+  , 0
+  , NULL
+  }
+, { ngx_string("max_connections_priority")
+  , NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1
+  , max_connections_priority_command
+  , 0
+  , 0
+  , NULL
+  }
+, { ngx_string("max_connections_dispatch_batch")
+  , NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1
+  , max_connections_dispatch_batch_command
+  , 0
+  , 0
+  , NULL
+  }
+, { ngx_string("max_connections_health_check")
+  , NGX_HTTP_UPS_CONF|NGX_CONF_ANY
+  , max_connections_health_check_command
+  , 0
+  , 0
+  , NULL
+  }
+, { ngx_string("max_connections_circuit_breaker")
+  , NGX_HTTP_UPS_CONF|NGX_CONF_ANY
+  , max_connections_circuit_breaker_command
+  , 0
+  , 0
+  , NULL
+  }
+, { ngx_string("max_connections_pool")
+  , NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1
+  , max_connections_pool_command
+  , 0
+  , 0
+  , NULL
+  }
+, { ngx_string("max_connections_queue_timeout_variable")
+  , NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1
+  , max_connections_queue_timeout_variable_command
+  , 0
+  , 0
+  , NULL
+  }
+, { ngx_string("max_connections_admission")
+  , NGX_HTTP_UPS_CONF|NGX_CONF_1MORE
+  , max_connections_admission_command
+  , 0
+  , 0
+  , NULL
+  }
+, { ngx_string("max_connections_reject_status")
+  , NGX_HTTP_UPS_CONF|NGX_CONF_TAKE12
+  , max_connections_reject_status_command
+  , 0
+  , 0
+  , NULL
+  }
+, { ngx_string("max_connections_expire_status")
+  , NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1
+  , max_connections_expire_status_command
+  , 0
+  , 0
+  , NULL
+  }
+, { ngx_string("max_connections_overflow")
+  , NGX_HTTP_UPS_CONF|NGX_CONF_TAKE12
+  , max_connections_overflow_command
+  , 0
+  , 0
+  , NULL
+  }
+, { ngx_string("max_connections_status")
+  , NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE1
+  , max_connections_status_command
+  , 0
+  , 0
+  , NULL
+  }
 , ngx_null_command
 };
 
 static ngx_http_module_t max_connections_module_ctx =
-/* preconfiguration              */ { NULL 
+/* preconfiguration              */ { max_connections_add_variables
 /* postconfiguration             */ , NULL 
 /* create main configuration     */ , NULL 
 /* init main configuration       */ , NULL 
@@ -104,7 +600,7 @@ ngx_module_t max_connections_module =
 /* module type       */ , NGX_HTTP_MODULE
 /* init master       */ , NULL
 /* init module       */ , NULL
-/* init process      */ , NULL
+/* init process      */ , max_connections_init_process
 /* init thread       */ , NULL
 /* exit thread       */ , NULL
 /* exit process      */ , NULL
@@ -112,26 +608,120 @@ ngx_module_t max_connections_module =
                         , NGX_MODULE_V1_PADDING
                         };
 
+/* The queue length is kept in queue->queue_length. Walking the list to
+ * verify it is O(n) per operation, so it is only done in debug builds
+ * (make configure_debug). */
+#if (NGX_DEBUG)
 static ngx_uint_t
-queue_size (max_connections_srv_conf_t *maxconn_cf)
+queue_size (max_connections_queue_t *queue)
 {
   ngx_queue_t *node;
   ngx_uint_t queue_size = 0;
-  /* TODO O(n) could be O(1) */
-  for( node = maxconn_cf->waiting_requests.next
-     ; node && node != &maxconn_cf->waiting_requests 
+  for( node = queue->waiting_requests.next
+     ; node && node != &queue->waiting_requests 
      ; node = node->next
      ) queue_size += 1;
   return queue_size;
 }
 
+#define queue_check(queue) \
+  assert((queue)->queue_length == queue_size(queue)); \
+  assert((queue)->max_queue_length >= (queue)->queue_length)
+#else
+#define queue_check(queue)
+#endif
+
+/* Are there queued requests that may be sent now? With
+ * max_connections_fair_key the requests of flows at their max_inflight
+ * have to wait for one of the flow's requests to finish. */
+#define queue_ready(maxconn_cf) \
+  ( (maxconn_cf)->fair_index == NGX_ERROR \
+  ? (maxconn_cf)->queue_length > 0 \
+  : (maxconn_cf)->active_flows > 0 \
+  )
+
+#define class_ready(queue) \
+  ( (queue)->flows == NULL \
+  ? (queue)->queue_length > 0 \
+  : !ngx_queue_empty(&(queue)->active_flows) \
+  )
+
+#define flow_capped(maxconn_cf, f) \
+  ( (maxconn_cf)->fair_max_inflight \
+ && (maxconn_cf)->fair_inflight[f] >= (maxconn_cf)->fair_max_inflight \
+  )
+
+/* Puts flow f of the class at the back of its active flows, if it has
+ * requests and may send them. */
+static void
+flow_activate (max_connections_srv_conf_t *maxconn_cf, max_connections_queue_t *queue, ngx_uint_t f)
+{
+  max_connections_flow_t *flow = &queue->flows[f];
+
+  if( flow->active.next != NULL 
+   || ngx_queue_empty(&flow->waiting_requests) 
+   || flow_capped(maxconn_cf, f)
+    ) return;
+
+  ngx_queue_insert_tail(&queue->active_flows, &flow->active);
+  maxconn_cf->active_flows++;
+}
+
+static void
+flow_deactivate (max_connections_srv_conf_t *maxconn_cf, max_connections_flow_t *flow)
+{
+  if(flow->active.next == NULL) return;
+
+  ngx_queue_remove(&flow->active);
+  flow->active.prev = flow->active.next = NULL;
+  flow->deficit = 0;
+  maxconn_cf->active_flows--;
+}
+
+/* The request goes to a backend. It counts against its flow's max_inflight
+ * until flow_done(). */
+static void
+flow_start (max_connections_srv_conf_t *maxconn_cf, max_connections_peer_data_t *peer_data)
+{
+  max_connections_queue_t *queues = maxconn_cf->queues->elts;
+  ngx_uint_t i, f = peer_data->flow;
+
+  if(maxconn_cf->fair_index == NGX_ERROR) return;
+
+  peer_data->inflight = 1;
+  maxconn_cf->fair_inflight[f]++;
+
+  if(!flow_capped(maxconn_cf, f)) return;
+  for (i = 0; i < maxconn_cf->queues->nelts; i++) {
+    flow_deactivate(maxconn_cf, &queues[i].flows[f]);
+  }
+}
+
+static void
+flow_done (max_connections_srv_conf_t *maxconn_cf, max_connections_peer_data_t *peer_data)
+{
+  max_connections_queue_t *queues = maxconn_cf->queues->elts;
+  ngx_uint_t i, f = peer_data->flow;
+
+  if(!peer_data->inflight) return;
+
+  peer_data->inflight = 0;
+  assert(maxconn_cf->fair_inflight[f] > 0);
+  maxconn_cf->fair_inflight[f]--;
+
+  if(maxconn_cf->fair_max_inflight == 0) return;
+  for (i = 0; i < maxconn_cf->queues->nelts; i++) {
+    flow_activate(maxconn_cf, &queues[i], f);
+  }
+}
+
 static max_connections_peer_data_t *
-queue_oldest (max_connections_srv_conf_t *maxconn_cf)
+queue_oldest (max_connections_queue_t *queue)
 {
-  if(ngx_queue_empty(&maxconn_cf->waiting_requests)) 
+  if(ngx_queue_empty(&queue->waiting_requests)) 
     return NULL;
 
-  ngx_queue_t *last = ngx_queue_last(&maxconn_cf->waiting_requests);
+  ngx_queue_t *last = ngx_queue_last(&queue->waiting_requests);
 
   max_connections_peer_data_t *peer_data = 
     ngx_queue_data(last, max_connections_peer_data_t, queue);
@@ -142,448 +732,3872 @@ static ngx_int_t
 queue_remove (max_connections_peer_data_t *peer_data)
 {
   max_connections_srv_conf_t *maxconn_cf = peer_data->maxconn_cf;
+  max_connections_queue_t *queue = peer_data->queue_class;
 
   /* return 0 if it wasn't in the queue */
   if(peer_data->queue.next == NULL)
     return 0;
 
-  max_connections_peer_data_t *oldest = queue_oldest (maxconn_cf);
-
   ngx_queue_remove(&peer_data->queue);
   peer_data->queue.prev = peer_data->queue.next = NULL; 
 
+  if(queue->flows) {
+    max_connections_flow_t *flow = &queue->flows[peer_data->flow];
+    ngx_queue_remove(&peer_data->flow_queue);
+    if(ngx_queue_empty(&flow->waiting_requests)) flow_deactivate(maxconn_cf, flow);
+  }
+
+  queue->queue_length -= 1;
   maxconn_cf->queue_length -= 1;
-  assert(maxconn_cf->queue_length == queue_size(peer_data->maxconn_cf));
+  queue_check(queue);
 
-  ngx_log_error( NGX_LOG_INFO
+  ngx_log_debug2( NGX_LOG_DEBUG_HTTP
                 , peer_data->r->connection->log
                 , 0
-                , "max_connections del queue (new size %ui)"
-                , queue_size(peer_data->maxconn_cf)
+                , "max_connections del queue %V (new size %ui)"
+                , &queue->name
+                , queue->queue_length
                 );
 
-  if(ngx_queue_empty(&maxconn_cf->waiting_requests)) {
-    /* delete the timer if the queue is empty now */
-    if(maxconn_cf->queue_check_event.timer_set) {
-      ngx_del_timer( (&maxconn_cf->queue_check_event) );
-    }
-  } else if(oldest == peer_data) {  
-    /* if the removed peer_data was the first */
-    /* make sure that the check queue timer is set when we have things in
-     * the queue */
-    oldest = queue_oldest (maxconn_cf);
-
-    /*  ------|-----------|-------------|------------------------ */
-    /*       accessed    now           accessed + TIMEOUT         */
-    ngx_add_timer( (&maxconn_cf->queue_check_event)
-                 , RAMP(oldest->accessed + maxconn_cf->queue_timeout - ngx_current_msec)
-                 ); 
+  if(peer_data->expire_event.timer_set) {
+    ngx_del_timer( (&peer_data->expire_event) );
   }
 
   return 1;
 }
 
-/* removes the first item from the queue - returns request */
+/* Picks the class the next request is taken from. Under the strict policy
+ * that is the highest non-empty class. Under the weighted policy non-empty
+ * classes take turns in proportion to their weight (smooth weighted round
+ * robin, as nginx does for servers). */
+static max_connections_queue_t *
+queue_next_class (max_connections_srv_conf_t *maxconn_cf)
+{
+  max_connections_queue_t *queues = maxconn_cf->queues->elts;
+  max_connections_queue_t *best = NULL;
+  ngx_int_t total = 0;
+  ngx_uint_t i;
+
+  for (i = 0; i < maxconn_cf->queues->nelts; i++) {
+    if(!class_ready(&queues[i])) continue;
+
+    if(maxconn_cf->queue_policy == QUEUE_POLICY_STRICT) 
+      return &queues[i];
+
+    queues[i].current_weight += queues[i].weight;
+    total += queues[i].weight;
+
+    if(best == NULL || queues[i].current_weight > best->current_weight) 
+      best = &queues[i];
+  }
+
+  if(best) best->current_weight -= total;
+  return best;
+}
+
 static max_connections_peer_data_t *
-queue_shift (max_connections_srv_conf_t *maxconn_cf)
+queue_newest (max_connections_queue_t *queue)
 {
-  if(ngx_queue_empty(&maxconn_cf->waiting_requests)) 
+  if(ngx_queue_empty(&queue->waiting_requests)) 
     return NULL;
-  max_connections_peer_data_t *peer_data = queue_oldest (maxconn_cf);
 
-  ngx_int_t r = queue_remove (peer_data);
-  assert(r == 1);
+  ngx_queue_t *first = ngx_queue_head(&queue->waiting_requests);
 
+  max_connections_peer_data_t *peer_data = 
+    ngx_queue_data(first, max_connections_peer_data_t, queue);
   return peer_data;
 }
 
-/* adds a request to the end of the queue */
+/* Is the class served newest first right now? Under overload the oldest
+ * requests are the ones whose clients most likely gave up already, so
+ * "adaptive" switches to LIFO while the oldest has waited more than
+ * lifo_after, and back once the queue has caught up. */
 static ngx_int_t
-queue_push (max_connections_srv_conf_t *maxconn_cf, max_connections_peer_data_t *peer_data)
+queue_lifo (max_connections_srv_conf_t *maxconn_cf, max_connections_queue_t *queue)
 {
-  if(maxconn_cf->queue_length >= maxconn_cf->max_queue_length)
-    return NGX_ERROR;
+  max_connections_peer_data_t *oldest;
 
-  /* if this is the first element ensure we set the queue_check_event */
-  if(ngx_queue_empty(&maxconn_cf->waiting_requests)) {
-    assert(!maxconn_cf->queue_check_event.timer_set);
-    ngx_add_timer((&maxconn_cf->queue_check_event), maxconn_cf->queue_timeout); 
-  }
-  ngx_queue_insert_head(&maxconn_cf->waiting_requests, &peer_data->queue);
+  switch(maxconn_cf->queue_mode) {
+    case QUEUE_MODE_LIFO:
+      return 1;
 
-  maxconn_cf->queue_length += 1;
-  assert(maxconn_cf->queue_length == queue_size(peer_data->maxconn_cf));
-  assert(maxconn_cf->max_queue_length >=  maxconn_cf->queue_length);
+    case QUEUE_MODE_ADAPTIVE:
+      oldest = queue_oldest(queue);
+      return oldest 
+          && ngx_current_msec - oldest->accessed > maxconn_cf->lifo_after;
+  }
 
-  ngx_log_error( NGX_LOG_INFO
-                , peer_data->r->connection->log
-                , 0
-                , "max_connections add queue (new size %ui)"
-                , queue_size(maxconn_cf)
-                );
-  return NGX_OK;
+  return 0;
 }
 
-/* This function selects an open backend. It simply iterates through the
- * backends looking for the one with the least connections. */
-static max_connections_backend_t*
-find_upstream (max_connections_srv_conf_t *maxconn_cf, int forced)
+/* With max_connections_fair_key: deficit round robin over the active
+ * flows of the class. The flow at the front gets fair_quantum requests
+ * for its turn and then goes to the back, so a key with hundreds of
+ * requests queued gets no more turns than a key with one. Every request
+ * costs the same. */
+static max_connections_peer_data_t *
+flow_next (max_connections_srv_conf_t *maxconn_cf, max_connections_queue_t *queue, ngx_uint_t lifo)
 {
-#define MAXCONN_BIGNUM 999999
-  ngx_uint_t c
-           , index
-           , min_backend_index = MAXCONN_BIGNUM
-           , min_backend_connections = MAXCONN_BIGNUM 
-           ;
-  ngx_uint_t nbackends = maxconn_cf->backends->nelts;
-  max_connections_backend_t *backends = maxconn_cf->backends->elts;
-  time_t now = ngx_time();
-
-  for( c = 0, index = ngx_random() % nbackends
-     ; c < nbackends
-     ; c++, index = (index + 1) % nbackends
-     )
-  {
-    max_connections_backend_t *backend = &backends[index];
+  max_connections_flow_t *flow = 
+    ngx_queue_data( ngx_queue_head(&queue->active_flows)
+                  , max_connections_flow_t
+                  , active
+                  );
 
-    if(now - backend->accessed > backend->fail_timeout) {
-      backend->fails = 0;
-    }
+  ngx_queue_t *node = lifo 
+                    ? ngx_queue_head(&flow->waiting_requests)
+                    : ngx_queue_last(&flow->waiting_requests);
 
-    if(backend->fails >= backend->max_fails || backend->down) 
-      continue;
+  if(flow->deficit == 0) flow->deficit = maxconn_cf->fair_quantum;
+  flow->deficit--;
 
-    if(backend->connections < min_backend_connections) {
-      min_backend_connections = backend->connections;
-      min_backend_index = index;
-    }
+  if(flow->deficit == 0) {
+    ngx_queue_remove(&flow->active);
+    ngx_queue_insert_tail(&queue->active_flows, &flow->active);
   }
 
-  /* there weren't even any backends to look at */
-  if(min_backend_connections == MAXCONN_BIGNUM)
-    return NULL;
-
-  assert(min_backend_index < nbackends);
-
-  max_connections_backend_t *choosen = &backends[min_backend_index];
+  return ngx_queue_data(node, max_connections_peer_data_t, flow_queue);
+}
 
-  assert(choosen->connections == min_backend_connections);
-  assert(!choosen->down);
-  assert(choosen->fails < choosen->max_fails);
+/* removes the next item from the queue - returns request */
+static max_connections_peer_data_t *
+queue_shift (max_connections_srv_conf_t *maxconn_cf)
+{
+  max_connections_queue_t *queue = queue_next_class (maxconn_cf);
+  if(queue == NULL) 
+    return NULL;
+  ngx_uint_t lifo = queue_lifo(maxconn_cf, queue);
+  max_connections_peer_data_t *peer_data = queue->flows ? flow_next(maxconn_cf, queue, lifo)
+                                         : lifo ? queue_newest (queue)
+                                         : queue_oldest (queue);
 
-  if(!forced && choosen->connections >= maxconn_cf->max_connections) 
-    return NULL; /* no open slots */
+  ngx_int_t r = queue_remove (peer_data);
+  assert(r == 1);
 
-  return choosen;
+  return peer_data;
 }
 
-/* Returns true if there are no slots to send a request to. */
-#define upstreams_are_all_occupied(maxconn_cf) \
-  (find_upstream (maxconn_cf, 0) == NULL)
-#define upstreams_are_all_dead(maxconn_cf) \
-  (find_upstream (maxconn_cf, 1) == NULL)
+static void queue_expire (ngx_event_t *ev);
 
-/* This function takes the oldest request on the queue
- * (maxconn_cf->waiting_requests) and dispatches it to the backends.  This
- * calls ngx_http_upstream_connect() which will in turn call the peer get
- * callback, peer_get(). peer_get() will do
- * the actual selection of backend. Here we're just giving the request the
- * go-ahead to proceed.
- */
-static void
-dispatch (max_connections_srv_conf_t *maxconn_cf)
+/* adds a request to the newest end of its class's queue. It leaves the queue
+ * after timeout at the latest. */
+static ngx_int_t
+queue_push (max_connections_srv_conf_t *maxconn_cf, max_connections_peer_data_t *peer_data, ngx_msec_t timeout)
 {
-  if(ngx_queue_empty(&maxconn_cf->waiting_requests)) return;
-  if(upstreams_are_all_occupied(maxconn_cf)) return;
+  max_connections_queue_t *queue = peer_data->queue_class;
 
-  max_connections_peer_data_t *peer_data = queue_shift(maxconn_cf);
-  ngx_http_request_t *r = peer_data->r;
+  if(queue->queue_length >= queue->max_queue_length) 
+    return NGX_DECLINED;
 
-  assert(!r->connection->destroyed);
-  assert(!r->connection->error);
-  assert(peer_data->backend == NULL);
+  if(maxconn_cf->queue_length == 0) maxconn_cf->backlog_since = ngx_current_msec;
 
-  ngx_log_error( NGX_LOG_INFO
+  /* every request has its own timer, so the expirations come in deadline
+   * order from the timer tree of nginx whatever the timeouts are */
+  ngx_memzero(&peer_data->expire_event, sizeof(ngx_event_t));
+  peer_data->expire_event.handler = queue_expire;
+  peer_data->expire_event.log = peer_data->r->connection->log;
+  peer_data->expire_event.data = peer_data;
+  ngx_add_timer( (&peer_data->expire_event), timeout );
+
+  ngx_queue_insert_head(&queue->waiting_requests, &peer_data->queue);
+
+  if(queue->flows) {
+    ngx_queue_insert_head( &queue->flows[peer_data->flow].waiting_requests
+                         , &peer_data->flow_queue
+                         );
+    flow_activate(maxconn_cf, queue, peer_data->flow);
+  }
+
+  peer_data->position = queue->queue_length;
+  queue->queue_length += 1;
+  maxconn_cf->queue_length += 1;
+  queue_check(queue);
+
+  ngx_atomic_fetch_add(&maxconn_cf->shared->enqueued, 1);
+
+  ngx_log_debug2( NGX_LOG_DEBUG_HTTP
+                , peer_data->r->connection->log
+                , 0
+                , "max_connections add queue %V (new size %ui)"
+                , &queue->name
+                , queue->queue_length
+                );
+  return NGX_OK;
+}
+
+static ngx_uint_t
+isqrt (ngx_uint_t n)
+{
+  ngx_uint_t x = n, y = (n + 1) / 2;
+
+  while(y < x) {
+    x = y;
+    y = (x + n / x) / 2;
+  }
+  return x;
+}
+
+/* CoDel: the time the requests spent queued is looked at as they leave the
+ * queue. Once it has stayed above codel_target for codel_interval the
+ * upstream is dropping, and turns away arriving requests at a rate that
+ * grows with the square root of the number turned away until the
+ * time spent queued is below the target again. */
+static void
+codel_dequeue (max_connections_srv_conf_t *maxconn_cf, ngx_msec_t sojourn)
+{
+  ngx_msec_t now = ngx_current_msec;
+
+  if(sojourn < maxconn_cf->codel_target || maxconn_cf->queue_length == 0) {
+    maxconn_cf->codel_first_above = 0;
+    maxconn_cf->codel_dropping = 0;
+    return;
+  }
+
+  if(maxconn_cf->codel_first_above == 0) {
+    maxconn_cf->codel_first_above = now + maxconn_cf->codel_interval;
+    return;
+  }
+
+  if(!maxconn_cf->codel_dropping && now >= maxconn_cf->codel_first_above) {
+    maxconn_cf->codel_dropping = 1;
+    /* start near the old rate if we were dropping not long ago */
+    if( maxconn_cf->codel_count > 2
+     && now - maxconn_cf->codel_drop_next < 16 * maxconn_cf->codel_interval
+      ) {
+      maxconn_cf->codel_count -= 2;
+    } else {
+      maxconn_cf->codel_count = 1;
+    }
+    maxconn_cf->codel_drop_next = now;
+  }
+}
+
+static ngx_int_t
+codel_admit (max_connections_srv_conf_t *maxconn_cf)
+{
+  ngx_msec_t now = ngx_current_msec;
+
+  if(maxconn_cf->queue_length == 0) maxconn_cf->codel_dropping = 0;
+
+  if(!maxconn_cf->codel_dropping || now < maxconn_cf->codel_drop_next) 
+    return 1;
+
+  maxconn_cf->codel_count++;
+  maxconn_cf->codel_drop_next = 
+    now + maxconn_cf->codel_interval / isqrt(maxconn_cf->codel_count);
+  return 0;
+}
+
+/* The wait of a request joining queue, estimated from the number of
+ * requests that will leave the queue before it and the recent time between
+ * dispatches. 0 while there is nothing to go by. */
+static ngx_msec_t
+queue_predicted_wait (max_connections_srv_conf_t *maxconn_cf, max_connections_queue_t *queue)
+{
+  max_connections_queue_t *queues = maxconn_cf->queues->elts;
+  ngx_uint_t i, ahead = 0;
+
+  if(maxconn_cf->dispatch_gap == 0) return 0;
+
+  if(maxconn_cf->queue_policy == QUEUE_POLICY_STRICT) {
+    for (i = 0; &queues[i] <= queue; i++) ahead += queues[i].queue_length;
+  } else {
+    ahead = maxconn_cf->queue_length;
+  }
+  /* served newest first it would only wait for the ones still coming */
+  if(queue_lifo(maxconn_cf, queue)) ahead -= queue->queue_length;
+  if(maxconn_cf->heap_size == 0) ahead++; /* it waits for a slot too */
+
+  return ahead * maxconn_cf->dispatch_gap / PREDICT_ONE;
+}
+
+/* Should the request be queued at all? With "predict", if the predicted
+ * wait is more than the request's timeout it would only expire, so it is
+ * turned away now. */
+static ngx_int_t
+queue_admit (max_connections_srv_conf_t *maxconn_cf, max_connections_queue_t *queue, ngx_msec_t timeout)
+{
+  switch(maxconn_cf->admission) {
+    case ADMISSION_PREDICT:
+      return queue_predicted_wait(maxconn_cf, queue) <= timeout;
+
+    case ADMISSION_CODEL:
+      return codel_admit(maxconn_cf);
+  }
+
+  return 1;
+}
+
+/* Turns the request away at once with max_connections_reject_status. */
+static ngx_int_t
+queue_reject (max_connections_peer_data_t *peer_data)
+{
+  max_connections_srv_conf_t *maxconn_cf = peer_data->maxconn_cf;
+  ngx_http_request_t *r = peer_data->r;
+
+  ngx_atomic_fetch_add(&maxconn_cf->shared->rejected, 1);
+
+  if(maxconn_cf->retry_after) {
+    ngx_table_elt_t *h = ngx_list_push(&r->headers_out.headers);
+    if(h == NULL) return NGX_ERROR;
+
+    h->value.data = ngx_palloc(r->pool, NGX_TIME_T_LEN);
+    if(h->value.data == NULL) return NGX_ERROR;
+
+    h->hash = 1;
+    h->key.len = sizeof("Retry-After") - 1;
+    h->key.data = (u_char *) "Retry-After";
+    h->value.len = ngx_sprintf(h->value.data, "%T", maxconn_cf->retry_after) 
+                 - h->value.data;
+  }
+
+  ngx_log_debug1( NGX_LOG_DEBUG_HTTP
                 , r->connection->log
                 , 0
-                , "max_connections dispatch (max_queue_length: %ui, queue timeout: %ui, maxconn: %ui)"
-                , maxconn_cf->max_queue_length
-                , maxconn_cf->queue_timeout
-                , maxconn_cf->max_connections
+                , "max_connections reject %ui"
+                , maxconn_cf->reject_status
                 );
-  ngx_http_upstream_connect(r, r->upstream);
 
-  /* can we dispatch again? */
-  dispatch(maxconn_cf);
+  /* peer_init() returns NGX_BUSY after this, which leaves the request
+   * alone */
+  ngx_http_finalize_request(r, maxconn_cf->reject_status);
+  return NGX_BUSY;
+}
+
+/* Hands the request to the max_connections_overflow upstream instead of
+ * queueing it. A request that came here by overflowing is turned away
+ * rather than handed on again, so two upstreams overflowing into each
+ * other cannot loop. */
+static ngx_int_t
+queue_overflow (max_connections_peer_data_t *peer_data, ngx_uint_t nested)
+{
+  max_connections_srv_conf_t *maxconn_cf = peer_data->maxconn_cf;
+  ngx_http_upstream_srv_conf_t *overflow = maxconn_cf->overflow;
+  ngx_http_request_t *r = peer_data->r;
+
+  if(overflow == NULL || nested) return queue_reject(peer_data);
+
+  ngx_atomic_fetch_add(&maxconn_cf->shared->overflowed, 1);
+  peer_data->overflowed = 1;
+
+  ngx_log_debug1( NGX_LOG_DEBUG_HTTP
+                , r->connection->log
+                , 0
+                , "max_connections overflow to %V"
+                , &overflow->host
+                );
+
+  /* it sets up r->upstream->peer for the other upstream, and its NGX_OK
+   * or NGX_BUSY means the same to nginx as ours */
+  return overflow->peer.init(r, overflow);
+}
+
+/* The queue timeout of the request: the class's, or the value of the
+ * max_connections_queue_timeout_variable if that is a valid time and
+ * shorter. */
+static ngx_msec_t
+queue_timeout_for (max_connections_srv_conf_t *maxconn_cf, ngx_http_request_t *r, max_connections_queue_t *queue)
+{
+  ngx_msec_t timeout = queue->queue_timeout;
+
+  if(maxconn_cf->timeout_index == NGX_ERROR) return timeout;
+
+  ngx_http_variable_value_t *v = 
+    ngx_http_get_indexed_variable(r, maxconn_cf->timeout_index);
+  if(v == NULL || v->not_found || v->len == 0) return timeout;
+
+  ngx_str_t value;
+  value.len = v->len;
+  value.data = v->data;
+
+  ngx_int_t ms = ngx_parse_time(&value, 0);
+  if(ms != NGX_ERROR && (ngx_msec_t) ms < timeout) timeout = ms;
+
+  return timeout;
+}
+
+/* The class named by the max_connections_priority variable. Requests
+ * without one, or with an unknown name, go to the "default" class. */
+static max_connections_queue_t *
+queue_class_for (max_connections_srv_conf_t *maxconn_cf, ngx_http_request_t *r)
+{
+  max_connections_queue_t *queues = maxconn_cf->queues->elts;
+  ngx_uint_t i;
+
+  if(maxconn_cf->priority_index != NGX_ERROR) {
+    ngx_http_variable_value_t *v = 
+      ngx_http_get_indexed_variable(r, maxconn_cf->priority_index);
+
+    if(v != NULL && !v->not_found && v->len) {
+      for (i = 0; i < maxconn_cf->queues->nelts; i++) {
+        if( queues[i].name.len == v->len 
+         && ngx_strncmp(queues[i].name.data, v->data, v->len) == 0
+          ) return &queues[i];
+      }
+    }
+  }
+
+  return maxconn_cf->default_queue;
+}
+
+/* Weighted least connections: compares connections/weight without
+ * dividing. On a tie the heavier backend wins so that empty big boxes are
+ * filled first. */
+static ngx_int_t
+backend_less (max_connections_backend_t *a, max_connections_backend_t *b)
+{
+  ngx_uint_t la = a->connections * b->weight
+           , lb = b->connections * a->weight
+           ;
+  if(la != lb) return la < lb;
+  return a->weight > b->weight;
+}
+
+/* p2c_ewma: compares the expected time for a request to be done,
+ * (connections + 1) times the average response time over the weight. A
+ * backend without a response yet counts as taking a millisecond. */
+static ngx_int_t
+backend_faster (max_connections_backend_t *a, max_connections_backend_t *b)
+{
+  uint64_t ta = (uint64_t) (ngx_max(a->ewma, EWMA_ONE)) * (a->connections + 1) * b->weight
+         , tb = (uint64_t) (ngx_max(b->ewma, EWMA_ONE)) * (b->connections + 1) * a->weight
+         ;
+  if(ta != tb) return ta < tb;
+  return backend_less(a, b);
 }
 
 static void
-recover_from_client_closure(ngx_event_t *ev)
+heap_swap (max_connections_srv_conf_t *maxconn_cf, ngx_uint_t i, ngx_uint_t j)
 {
-  max_connections_backend_t *backend = ev->data;
+  max_connections_backend_t *tmp = maxconn_cf->heap[i];
 
-  assert(backend->connections > 0);
-  assert(backend->client_closures > 0);
+  maxconn_cf->heap[i] = maxconn_cf->heap[j];
+  maxconn_cf->heap[j] = tmp;
+  maxconn_cf->heap[i]->heap_index = i;
+  maxconn_cf->heap[j]->heap_index = j;
+}
 
-  backend->connections -= backend->client_closures; 
-  backend->client_closures = 0;
+static void
+heap_sift_up (max_connections_srv_conf_t *maxconn_cf, ngx_uint_t i)
+{
+  while(i > 0 && backend_less(maxconn_cf->heap[i], maxconn_cf->heap[(i - 1) / 2])) {
+    heap_swap(maxconn_cf, i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
 
-  dispatch(backend->maxconn_cf);
+static void
+heap_sift_down (max_connections_srv_conf_t *maxconn_cf, ngx_uint_t i)
+{
+  ngx_uint_t child;
+
+  while((child = 2 * i + 1) < maxconn_cf->heap_size) {
+    if( child + 1 < maxconn_cf->heap_size
+     && backend_less(maxconn_cf->heap[child + 1], maxconn_cf->heap[child])
+      ) child++;
+
+    if(!backend_less(maxconn_cf->heap[child], maxconn_cf->heap[i])) break;
+
+    heap_swap(maxconn_cf, i, child);
+    i = child;
+  }
 }
 
 static void
-queue_check_event(ngx_event_t *ev)
+heap_insert (max_connections_srv_conf_t *maxconn_cf, max_connections_backend_t *backend)
 {
-  max_connections_srv_conf_t *maxconn_cf = ev->data;
+  assert(backend->heap_index == HEAP_NONE);
+  assert(maxconn_cf->heap_size < maxconn_cf->backends->nelts);
 
-  max_connections_peer_data_t *oldest; 
+  backend->heap_index = maxconn_cf->heap_size++;
+  maxconn_cf->heap[backend->heap_index] = backend;
+  heap_sift_up(maxconn_cf, backend->heap_index);
+}
 
-  while ( (oldest = queue_oldest(maxconn_cf))
-       && ngx_current_msec - oldest->accessed > maxconn_cf->queue_timeout
-        ) 
-  {
-    max_connections_peer_data_t *peer_data = queue_shift(maxconn_cf);
-    assert(peer_data == oldest);
-    ngx_log_error( NGX_LOG_INFO
-                  , peer_data->r->connection->log
-                  , 0
-                  , "max_connections expire"
-                  );
-    ngx_http_finalize_request(peer_data->r, NGX_HTTP_QUEUE_EXPIRATION);
+static void
+heap_remove (max_connections_srv_conf_t *maxconn_cf, max_connections_backend_t *backend)
+{
+  ngx_uint_t i = backend->heap_index;
+
+  assert(i < maxconn_cf->heap_size && maxconn_cf->heap[i] == backend);
+
+  maxconn_cf->heap_size--;
+  if(i != maxconn_cf->heap_size) {
+    heap_swap(maxconn_cf, i, maxconn_cf->heap_size);
+    heap_sift_up(maxconn_cf, i);
+    heap_sift_down(maxconn_cf, i);
   }
+  backend->heap_index = HEAP_NONE;
+}
 
-  /* try to dispatch some requets */
-  dispatch(maxconn_cf);
+/* Alive means neither marked down nor out after max_fails failures. */
+static ngx_int_t
+backend_alive (max_connections_backend_t *backend)
+{
+  return !backend->down 
+      && !backend->check_down
+      && backend->circuit != CIRCUIT_OPEN
+      && backend->fails < backend->max_fails;
+}
 
-  /* check the check timer */
-  if( !ngx_queue_empty(&maxconn_cf->waiting_requests) 
-   && !maxconn_cf->queue_check_event.timer_set
-    ) 
-  {
-    ngx_add_timer((&maxconn_cf->queue_check_event), maxconn_cf->queue_timeout); 
+/* The number of slots the backend has when not ramping up. Fixed unless
+ * the upstream is adaptive, in which case it moves between adaptive_min
+ * and the backend's max_connections. */
+static ngx_uint_t
+backend_full_limit (max_connections_backend_t *backend)
+{
+  max_connections_srv_conf_t *maxconn_cf = backend->maxconn_cf;
+  ngx_uint_t limit = backend->max_connections;
+
+  if(maxconn_cf->adaptive) {
+    limit = backend->slots->limit / ADAPTIVE_ONE;
+    limit = ngx_max(limit, maxconn_cf->adaptive_min);
+    limit = ngx_min(limit, backend->max_connections);
   }
+
+  return limit;
 }
 
+/* The number of slots the backend has right now. For slow_start after the
+ * backend came back it is scaled down, from 1 slot rising linearly to the
+ * full limit; slow_start_step() ends the ramp. */
+static ngx_uint_t
+backend_limit (max_connections_backend_t *backend)
+{
+  ngx_uint_t limit = backend_full_limit(backend);
 
-/* The peer free function which is part of all NGINX upstream modules */
+  if(backend->revived) {
+    ngx_msec_t elapsed = ngx_current_msec - backend->revived;
+    if(elapsed < backend->slow_start) 
+      limit = 1 + (limit - 1) * elapsed / backend->slow_start;
+  }
+
+  return limit;
+}
+
+/* Arms the slow_start timer for when backend_limit() goes up by a slot,
+ * so that the backend gets it then rather than when a request finishes.
+ * Ends the ramp once slow_start has passed. */
 static void
-peer_free (ngx_peer_connection_t *pc, void *data, ngx_uint_t state)
+slow_start_schedule (max_connections_backend_t *backend)
 {
-  max_connections_peer_data_t *peer_data = data;
-  max_connections_backend_t *backend = peer_data->backend;
-  max_connections_srv_conf_t *maxconn_cf = peer_data->maxconn_cf;
+  ngx_msec_t elapsed = ngx_current_msec - backend->revived;
+  ngx_uint_t full = backend_full_limit(backend);
+  ngx_msec_t next = backend->slow_start;
 
-  assert(maxconn_cf->queue_length == queue_size(peer_data->maxconn_cf));
-  assert(maxconn_cf->max_queue_length >= maxconn_cf->queue_length);
+  if(backend->slow_start_event.timer_set) {
+    ngx_del_timer( (&backend->slow_start_event) );
+  }
 
-  /* This happens when a client closes their connection before the request
-   * is completed */
-  if(peer_data->r->connection->error) {
+  if(elapsed >= backend->slow_start) {
+    backend->revived = 0;
+    return;
+  }
 
-    /* If the connection is in the queue, remove it. */
-    queue_remove(peer_data);
-    
-    /* If the connection is connected to a backend */
-    if(backend != NULL) {
-      if(!backend->disconnect_event.timer_set) {
-        assert(backend->client_closures == 0);
-        ngx_add_timer( (&backend->disconnect_event)
-                     , CLIENT_CLOSURE_SLEEP
-                     );
+  /* the limit is 1 + (full - 1) * elapsed / slow_start */
+  if(full > 1) {
+    next = (backend_limit(backend) * backend->slow_start + full - 2) / (full - 1);
+    next = ngx_min(next, backend->slow_start);
+  }
+
+  ngx_add_timer( (&backend->slow_start_event), next > elapsed ? next - elapsed : 1 );
+}
+
+/* The backend is alive again after failing. */
+static void
+backend_revive (max_connections_backend_t *backend)
+{
+  backend->maxconn_cf->nalive++;
+  if(backend->slow_start) {
+    backend->revived = ngx_current_msec;
+    if(backend->revived == 0) backend->revived = 1;
+    slow_start_schedule(backend);
+  }
+}
+
+/* Can this worker send a request to the backend right now? */
+static ngx_int_t
+backend_available (max_connections_backend_t *backend)
+{
+  return backend_alive(backend) 
+      && !backend->is_saturated
+      && !backend->circuit_probe
+      && backend->connections < backend_limit(backend);
+}
+
+/* Must be called whenever anything backend_available() or backend_less()
+ * looks at has changed. Puts the backend in its right place in the heap,
+ * or takes it out. O(log n) */
+static void
+backend_update (max_connections_backend_t *backend)
+{
+  max_connections_srv_conf_t *maxconn_cf = backend->maxconn_cf;
+
+  if(!backend_available(backend)) {
+    if(backend->heap_index != HEAP_NONE) heap_remove(maxconn_cf, backend);
+    return;
+  }
+
+  if(backend->heap_index == HEAP_NONE) {
+    heap_insert(maxconn_cf, backend);
+  } else {
+    heap_sift_up(maxconn_cf, backend->heap_index);
+    heap_sift_down(maxconn_cf, backend->heap_index);
+  }
+}
+
+/* Call after changing anything backend_alive() looks at, with what it
+ * returned before. Keeps nalive and the heap right. */
+static void
+backend_alive_changed (max_connections_backend_t *backend, ngx_uint_t was_alive)
+{
+  if(was_alive && !backend_alive(backend)) {
+    backend->maxconn_cf->nalive--;
+  } else if(!was_alive && backend_alive(backend)) {
+    backend_revive(backend);
+  }
+  backend_update(backend);
+}
+
+/* Another worker holds the backend's last slots. Keep it out of the heap
+ * until the zone tells us something was released. */
+static void
+backend_saturate (max_connections_backend_t *backend)
+{
+  if(backend->is_saturated) return;
+  backend->is_saturated = 1;
+  ngx_queue_insert_tail(&backend->maxconn_cf->saturated, &backend->saturated);
+  backend_update(backend);
+}
+
+static void
+backends_unsaturate (max_connections_srv_conf_t *maxconn_cf)
+{
+  while(!ngx_queue_empty(&maxconn_cf->saturated)) {
+    ngx_queue_t *q = ngx_queue_head(&maxconn_cf->saturated);
+    max_connections_backend_t *backend = 
+      ngx_queue_data(q, max_connections_backend_t, saturated);
+
+    ngx_queue_remove(q);
+    backend->is_saturated = 0;
+    backend_update(backend);
+  }
+}
+
+/* Takes a slot on the backend. The check and the increment are one atomic
+ * operation because with a max_connections_zone other workers are racing
+ * for the same counter. Returns 0 if the backend filled up in the meantime.
+ * If forced the limit is ignored. */
+static ngx_int_t
+backend_acquire (max_connections_backend_t *backend, int forced)
+{
+  ngx_atomic_uint_t c;
+
+  if(forced) {
+    ngx_atomic_fetch_add(&backend->slots->connections, 1);
+  } else {
+    do {
+      c = backend->slots->connections;
+      if(c >= backend_limit(backend)) {
+        backend_saturate(backend);
+        return 0;
       }
-      backend->client_closures++;
-      assert(backend->client_closures <= maxconn_cf->max_connections);
-      peer_data->backend = NULL;
+    } while(!ngx_atomic_cmp_set(&backend->slots->connections, c, c + 1));
+  }
+
+  backend->connections++;
+  backend->maxconn_cf->connections++;
+  if(backend->circuit == CIRCUIT_HALF_OPEN) backend->circuit_probe = 1;
+  backend_update(backend);
+  return 1;
+}
+
+/* The other upstreams of the pool may be waiting for the slot that was
+ * just freed. They dispatch once this worker is done with the current
+ * event. */
+static void
+pool_notify (max_connections_srv_conf_t *maxconn_cf)
+{
+  ngx_array_t *members = maxconn_cf->pool_first->pool_members;
+  ngx_uint_t i;
+
+  if(members == NULL) return;
+
+  max_connections_srv_conf_t **member = members->elts;
+  for (i = 0; i < members->nelts; i++) {
+    if(member[i] == maxconn_cf || !queue_ready(member[i])) continue;
+    if(member[i]->dispatch_event.prev == NULL) {
+      ngx_post_event((&member[i]->dispatch_event), &ngx_posted_events);
+    }
+  }
+}
+
+/* Gives back n slots and lets the other workers know about it. */
+static void
+backend_release (max_connections_backend_t *backend, ngx_uint_t n)
+{
+  assert(backend->connections >= n);
+  assert(backend->slots->connections >= n);
+
+  backend->connections -= n;
+  backend->maxconn_cf->connections -= n;
+  backend->circuit_probe = 0;
+  ngx_atomic_fetch_add(&backend->slots->connections, -(ngx_atomic_int_t) n);
+  ngx_atomic_fetch_add(&releases_of(backend->maxconn_cf), 1);
+  backend_update(backend);
+  pool_notify(backend->maxconn_cf);
+}
+
+/* Records a failed request. After max_fails failures within fail_timeout
+ * the backend is taken out of rotation until revive_backend() fires. */
+static void
+backend_fail (max_connections_backend_t *backend)
+{
+  time_t now = ngx_time();
+
+  if(!backend_alive(backend)) return;
+
+  if(now - backend->accessed > backend->fail_timeout) {
+    backend->fails = 0;
+  }
+  backend->accessed = now;
+  backend->fails++;
+
+  if(!backend_alive(backend)) {
+    backend->maxconn_cf->nalive--;
+    ngx_add_timer( (&backend->revive_event)
+                 , (ngx_msec_t) backend->fail_timeout * 1000
+                 );
+  }
+  backend_update(backend);
+}
+
+/* Adjusts the adaptive limit after a response (AIMD). While responses
+ * come back about as fast as the fastest recent one the limit grows by one
+ * slot per limit responses, but only if the slots were actually in use.
+ * A failure, or a response slow enough to mean the backend is queueing,
+ * cuts the limit by 10% - at most once per round trip so a single slow
+ * period is not punished once for every request in it. With a zone the
+ * limit is shared by all workers; concurrent updates may overwrite each
+ * other, which only costs a step of the algorithm. */
+static void
+backend_adapt (max_connections_backend_t *backend, ngx_msec_t rtt, ngx_uint_t failed)
+{
+  max_connections_srv_conf_t *maxconn_cf = backend->maxconn_cf;
+
+  if(!maxconn_cf->adaptive) return;
+
+  ngx_uint_t lo = maxconn_cf->adaptive_min * ADAPTIVE_ONE
+           , hi = backend->max_connections * ADAPTIVE_ONE
+           , limit = backend->slots->limit
+           ;
+  limit = ngx_max(limit, lo);
+
+  if(!failed) {
+    /* stored as rtt + 1 so that 0 means no sample yet */
+    if(backend->window_min_rtt == 0 || rtt + 1 < backend->window_min_rtt)
+      backend->window_min_rtt = rtt + 1;
+
+    if(++backend->rtt_samples >= ADAPTIVE_RTT_WINDOW) {
+      backend->min_rtt = backend->window_min_rtt;
+      backend->window_min_rtt = 0;
+      backend->rtt_samples = 0;
+    }
+
+    if(backend->min_rtt == 0 || rtt + 1 < backend->min_rtt)
+      backend->min_rtt = rtt + 1;
+  }
+
+  if(failed || rtt > ADAPTIVE_TOLERANCE * (backend->min_rtt - 1) + ADAPTIVE_SLACK) {
+    if(ngx_current_msec - backend->last_decrease > rtt) {
+      limit = limit * 9 / 10;
+      backend->last_decrease = ngx_current_msec;
+    }
+  } else if(2 * (backend->connections + 1) >= backend_limit(backend)) {
+    limit += ADAPTIVE_ONE * ADAPTIVE_ONE / limit;
+  }
+
+  limit = ngx_max(limit, lo);
+  limit = ngx_min(limit, hi);
+
+  if(limit / ADAPTIVE_ONE != backend->slots->limit / ADAPTIVE_ONE) {
+    ngx_log_debug2( NGX_LOG_DEBUG_HTTP
+                  , backend->revive_event.log
+                  , 0
+                  , "max_connections %V adaptive limit %ui"
+                  , backend->name
+                  , limit / ADAPTIVE_ONE
+                  );
+  }
+
+  backend->slots->limit = limit;
+  backend_update(backend);
+}
+
+/* Folds a response time into the backend's average for p2c_ewma. A failed
+ * request usually fails fast, which would make the backend look quick, so
+ * it counts as twice the average instead. */
+static void
+backend_ewma (max_connections_backend_t *backend, ngx_msec_t rtt, ngx_uint_t failed)
+{
+  ngx_uint_t sample = rtt * EWMA_ONE;
+
+  if(backend->maxconn_cf->balance != BALANCE_P2C_EWMA) return;
+
+  if(failed) sample = ngx_max(sample, 2 * backend->ewma);
+
+  if(backend->ewma == 0) {
+    backend->ewma = ngx_max(sample, 1);
+  } else {
+    backend->ewma = backend->ewma - (backend->ewma >> EWMA_SHIFT) 
+                  + (sample >> EWMA_SHIFT);
+  }
+}
+
+static void dispatch (max_connections_srv_conf_t *maxconn_cf);
+
+/* Circuit breaker. Each worker keeps the share of errors (failures and 5xx
+ * responses) and of responses slower than circuit_latency over a sliding
+ * window of circuit_window: the current window plus the part of the
+ * previous one that still overlaps. When at least circuit_min_requests
+ * were seen and circuit_errors percent of them were errors, or more than
+ * 1% were slow (the 99th percentile is above circuit_latency), the circuit
+ * opens and the backend counts as dead. After circuit_open it half opens
+ * and takes a single request; that decides whether it closes again or
+ * stays open for another round. */
+
+static void
+circuit_open (max_connections_backend_t *backend)
+{
+  max_connections_srv_conf_t *maxconn_cf = backend->maxconn_cf;
+  ngx_uint_t was_alive = backend_alive(backend);
+
+  ngx_log_error( NGX_LOG_WARN
+                , backend->circuit_event.log
+                , 0
+                , "max_connections circuit of %V is open"
+                , backend->name
+                );
+
+  backend->circuit = CIRCUIT_OPEN;
+  if(backend->circuit_event.timer_set) {
+    ngx_del_timer( (&backend->circuit_event) );
+  }
+  ngx_add_timer( (&backend->circuit_event), maxconn_cf->circuit_open );
+
+  backend_alive_changed(backend, was_alive);
+}
+
+static void
+circuit_half_open (ngx_event_t *ev)
+{
+  max_connections_backend_t *backend = ev->data;
+  ngx_uint_t was_alive = backend_alive(backend);
+
+  backend->circuit = CIRCUIT_HALF_OPEN;
+  backend_alive_changed(backend, was_alive);
+
+  dispatch(backend->maxconn_cf);
+}
+
+static void
+circuit_record (max_connections_backend_t *backend, ngx_msec_t rtt, ngx_uint_t error)
+{
+  max_connections_srv_conf_t *maxconn_cf = backend->maxconn_cf;
+  max_connections_window_t *now = &backend->circuit_now;
+  max_connections_window_t *prev = &backend->circuit_prev;
+  ngx_msec_t window = maxconn_cf->circuit_window;
+  ngx_uint_t slow = maxconn_cf->circuit_latency 
+                 && rtt > maxconn_cf->circuit_latency;
+
+  if(window == 0) return;
+
+  switch(backend->circuit) {
+    case CIRCUIT_OPEN:
+      return; /* sent before the circuit opened */
+
+    case CIRCUIT_HALF_OPEN:
+      if(error || slow) {
+        circuit_open(backend);
+        return;
+      }
+      ngx_log_error( NGX_LOG_WARN
+                    , backend->circuit_event.log
+                    , 0
+                    , "max_connections circuit of %V is closed"
+                    , backend->name
+                    );
+      backend->circuit = CIRCUIT_CLOSED;
+      ngx_memzero(now, sizeof(max_connections_window_t));
+      ngx_memzero(prev, sizeof(max_connections_window_t));
+      backend->circuit_start = ngx_current_msec;
+      return;
+  }
+
+  ngx_msec_t elapsed = ngx_current_msec - backend->circuit_start;
+  if(elapsed >= 2 * window) {
+    ngx_memzero(prev, sizeof(max_connections_window_t));
+    ngx_memzero(now, sizeof(max_connections_window_t));
+    backend->circuit_start = ngx_current_msec;
+    elapsed = 0;
+  } else if(elapsed >= window) {
+    *prev = *now;
+    ngx_memzero(now, sizeof(max_connections_window_t));
+    backend->circuit_start += window;
+    elapsed -= window;
+  }
+
+  now->requests++;
+  if(error) now->errors++;
+  if(slow) now->slow++;
+
+  /* the previous window counts for the part still inside the last
+   * "window" ms */
+  ngx_uint_t requests = now->requests + prev->requests * (window - elapsed) / window;
+  ngx_uint_t errors = now->errors + prev->errors * (window - elapsed) / window;
+  ngx_uint_t slows = now->slow + prev->slow * (window - elapsed) / window;
+
+  if(requests < maxconn_cf->circuit_min_requests) return;
+
+  if( errors * 100 >= maxconn_cf->circuit_errors * requests
+   || slows * 100 > requests
+    ) {
+    circuit_open(backend);
+  }
+}
+
+/* The slow_start ramp gained a slot, or is over. */
+static void
+slow_start_step (ngx_event_t *ev)
+{
+  max_connections_backend_t *backend = ev->data;
+
+  if(!backend_alive(backend)) {
+    backend->revived = 0; /* it starts over when it comes back */
+    return;
+  }
+
+  slow_start_schedule(backend);
+  backend_update(backend);
+  dispatch(backend->maxconn_cf);
+}
+
+static void
+revive_backend (ngx_event_t *ev)
+{
+  max_connections_backend_t *backend = ev->data;
+
+  assert(!backend_alive(backend));
+  backend->fails = 0;
+  if(backend_alive(backend)) backend_revive(backend);
+  backend_update(backend);
+
+  dispatch(backend->maxconn_cf);
+}
+
+/* This function selects an open backend: the root of the heap, which is
+ * the one with the least connections. If forced, slot limits are ignored
+ * and any live backend will do, preferring those not in the tried bitmap;
+ * that only happens when retrying so a linear scan is fine. */
+static max_connections_backend_t*
+find_upstream (max_connections_srv_conf_t *maxconn_cf, int forced, uintptr_t *tried)
+{
+  if(!forced) {
+    if(maxconn_cf->heap_size == 0) return NULL; /* no open slots */
+    if(maxconn_cf->balance == BALANCE_LEAST_CONN || maxconn_cf->heap_size == 1) 
+      return maxconn_cf->heap[0];
+
+    /* power of two choices: the faster of two backends with a free slot,
+     * picked at random from the heap */
+    ngx_uint_t i = ngx_random() % maxconn_cf->heap_size
+             , j = ngx_random() % (maxconn_cf->heap_size - 1)
+             ;
+    if(j >= i) j++;
+    return backend_faster(maxconn_cf->heap[j], maxconn_cf->heap[i]) 
+         ? maxconn_cf->heap[j] 
+         : maxconn_cf->heap[i];
+  }
+
+  ngx_uint_t c, index;
+  ngx_uint_t nbackends = maxconn_cf->backends->nelts;
+  max_connections_backend_t *backends = maxconn_cf->backends->elts;
+  max_connections_backend_t *choosen = NULL;
+  ngx_uint_t choosen_tried = 0;
+
+  if(maxconn_cf->nalive == 0) return NULL;
+
+  for( c = 0, index = ngx_random() % nbackends
+     ; c < nbackends
+     ; c++, index = (index + 1) % nbackends
+     )
+  {
+    max_connections_backend_t *backend = &backends[index];
+
+    if(!backend_alive(backend)) continue;
+
+    ngx_uint_t t = tried && backend_tried(tried, index);
+
+    if( choosen == NULL 
+     || (choosen_tried && !t)
+     || ( choosen_tried == t 
+       && ( maxconn_cf->balance == BALANCE_P2C_EWMA 
+          ? backend_faster(backend, choosen) 
+          : backend_less(backend, choosen)
+          )
+        )
+      ) {
+      choosen = backend;
+      choosen_tried = t;
+    }
+  }
+
+  assert(choosen != NULL);
+  return choosen;
+}
+
+/* Returns true if there are no slots to send a request to. */
+#define upstreams_are_all_occupied(maxconn_cf) \
+  ((maxconn_cf)->heap_size == 0)
+#define upstreams_are_all_dead(maxconn_cf) \
+  ((maxconn_cf)->nalive == 0)
+
+/* With a zone, slots can be released by other workers without this one
+ * hearing about it. While requests are waiting we poll the release counter
+ * and try to dispatch whenever it moved. */
+static void
+zone_poll (max_connections_srv_conf_t *maxconn_cf)
+{
+  if(maxconn_cf->zone == NULL) return;
+
+  if(!queue_ready(maxconn_cf)) {
+    if(maxconn_cf->zone_poll_event.timer_set) {
+      ngx_del_timer( (&maxconn_cf->zone_poll_event) );
+    }
+    return;
+  }
+
+  if(!maxconn_cf->zone_poll_event.timer_set) {
+    ngx_add_timer( (&maxconn_cf->zone_poll_event), ZONE_POLL_INTERVAL );
+  }
+}
+
+/* The backend a max_connections_hash key belongs to: the first one at or
+ * after the key's hash on the ring. Without a bound that is the first live
+ * backend, and NULL if it has no free slot. With bounded= a backend is
+ * passed over while it holds bound times the average slots per live
+ * backend, counting this request, or more, so hot keys spill onto the next
+ * backends of the ring instead of overloading one box. The caller holds a
+ * slot on held for the request already. */
+static max_connections_backend_t *
+hash_backend (max_connections_srv_conf_t *maxconn_cf, uint32_t hash, max_connections_backend_t *held)
+{
+  max_connections_point_t *points = maxconn_cf->points;
+  ngx_uint_t lo = 0, hi = maxconn_cf->npoints, c, cap = 0;
+
+  if(maxconn_cf->nalive == 0 || hi == 0) return NULL;
+
+  while(lo < hi) {
+    ngx_uint_t mid = (lo + hi) / 2;
+    if(points[mid].hash < hash) lo = mid + 1; else hi = mid;
+  }
+
+  if(maxconn_cf->hash_bound) {
+    /* the caller already holds a slot for this request */
+    cap = ( maxconn_cf->connections * maxconn_cf->hash_bound 
+          + maxconn_cf->nalive * HASH_ONE - 1
+          ) / (maxconn_cf->nalive * HASH_ONE);
+  }
+
+  for(c = 0; c < maxconn_cf->npoints; c++) {
+    max_connections_backend_t *backend = 
+      points[(lo + c) % maxconn_cf->npoints].backend;
+
+    if(!backend_alive(backend)) continue;
+
+    ngx_uint_t has_slot = backend == held || backend_available(backend);
+
+    if(!maxconn_cf->hash_bound) return has_slot ? backend : NULL;
+
+    if(has_slot && backend->connections - (backend == held) < cap) return backend;
+  }
+
+  return NULL;
+}
+
+/* max_connections_deadline_headers: tells the backend when the request was
+ * queued and how much of its queue timeout is left, so that it can drop
+ * work whose client is about to give up. The proxy module has built the
+ * request before peer_init(), so the headers go into a copy of its first
+ * buffer, right after the request line. Requests that do not start with
+ * an HTTP/1.x request line (memcached_pass, fastcgi_pass) are left alone,
+ * and so is the remaining time of a request whose queue timeout is 0. */
+static void
+deadline_headers (max_connections_srv_conf_t *maxconn_cf, max_connections_peer_data_t *peer_data)
+{
+  ngx_http_request_t *r = peer_data->r;
+  ngx_chain_t *cl = r->upstream->request_bufs;
+  ngx_time_t *tp = ngx_timeofday();
+  ngx_buf_t *b, *old;
+  u_char *eol;
+
+  if(cl == NULL || cl->buf->in_file) return;
+  old = cl->buf;
+
+  for(eol = old->pos; eol < old->last && *eol != LF; eol++) /* void */ ;
+  /* the request line ends in " HTTP/1.x" CRLF */
+  if( eol == old->last 
+   || eol - old->pos < (ssize_t) sizeof(" HTTP/1.x\r") - 1
+   || ngx_strncmp(eol - (sizeof(" HTTP/1.x\r") - 1), " HTTP/1.", 8) != 0
+   || eol[-1] != CR
+    ) return;
+  eol++;
+
+  size_t len = old->last - old->pos
+             + maxconn_cf->deadline_start.len 
+             + sizeof(": t=.000" CRLF) - 1 + NGX_TIME_T_LEN
+             + maxconn_cf->deadline_remaining.len 
+             + sizeof(": " CRLF) - 1 + NGX_INT_T_LEN;
+
+  b = ngx_create_temp_buf(r->pool, len);
+  if(b == NULL) return;
+
+  b->last = ngx_cpymem(b->last, old->pos, eol - old->pos);
+
+  if(maxconn_cf->deadline_start.len) {
+    time_t sec = tp->sec - peer_data->waited / 1000;
+    ngx_msec_t msec = tp->msec + 1000 - peer_data->waited % 1000;
+    if(msec < 1000) sec--; else msec -= 1000;
+
+    b->last = ngx_sprintf( b->last, "%V: t=%T.%03M" CRLF
+                         , &maxconn_cf->deadline_start, sec, msec
+                         );
+  }
+
+  if(maxconn_cf->deadline_remaining.len && peer_data->timeout) {
+    b->last = ngx_sprintf( b->last, "%V: %M" CRLF
+                         , &maxconn_cf->deadline_remaining
+                         , peer_data->timeout > peer_data->waited 
+                           ? peer_data->timeout - peer_data->waited 
+                           : 0
+                         );
+  }
+
+  b->last = ngx_cpymem(b->last, eol, old->last - eol);
+  b->flush = old->flush;
+  b->last_buf = old->last_buf;
+
+  cl->buf = b;
+}
+
+/* Sends the next queued request to backend, whose slot the caller has
+ * already acquired. A request with a max_connections_hash key goes to its
+ * own backend instead if that has a free slot. */
+static void
+dispatch_one (max_connections_srv_conf_t *maxconn_cf, max_connections_backend_t *backend)
+{
+  max_connections_peer_data_t *peer_data = queue_shift(maxconn_cf);
+  ngx_http_request_t *r = peer_data->r;
+
+  if(peer_data->hashed) {
+    max_connections_backend_t *own = hash_backend(maxconn_cf, peer_data->hash, backend);
+    if(own && own != backend && backend_acquire(own, 0)) {
+      backend_release(backend, 1);
+      backend = own;
+    }
+  }
+
+  assert(!r->connection->destroyed);
+  assert(!r->connection->error);
+  assert(peer_data->backend == NULL);
+
+  peer_data->backend = backend;
+  flow_start(maxconn_cf, peer_data);
+
+  /* statistics */
+  ngx_msec_t waited = ngx_current_msec - peer_data->accessed;
+  peer_data->waited = waited;
+  ngx_uint_t b;
+  for( b = 0
+     ; b < WAIT_BUCKETS - 1 && waited > max_connections_wait_buckets[b]
+     ; b++
+     ) /* void */ ;
+  ngx_atomic_fetch_add(&maxconn_cf->shared->wait[b], 1);
+  ngx_atomic_fetch_add(&maxconn_cf->shared->wait_sum, waited);
+  ngx_atomic_fetch_add(&maxconn_cf->shared->dispatched, 1);
+
+  /* for the predicted wait, how long it took since the last dispatch or
+   * since requests started waiting */
+  if(maxconn_cf->backlog_since) {
+    ngx_uint_t gap = (ngx_current_msec - maxconn_cf->backlog_since) * PREDICT_ONE;
+    maxconn_cf->dispatch_gap = maxconn_cf->dispatch_gap 
+                             ? (7 * maxconn_cf->dispatch_gap + gap) / 8
+                             : gap;
+  }
+  maxconn_cf->backlog_since = maxconn_cf->queue_length ? ngx_current_msec : 0;
+
+  if(maxconn_cf->admission == ADMISSION_CODEL) codel_dequeue(maxconn_cf, waited);
+
+  if(maxconn_cf->hedge_max) {
+    maxconn_cf->hedge_tokens = ngx_min( maxconn_cf->hedge_tokens + maxconn_cf->hedge_budget
+                                      , HEDGE_BURST * HEDGE_COST
+                                      );
+  }
+
+  if(maxconn_cf->deadline_start.len || maxconn_cf->deadline_remaining.len) 
+    deadline_headers(maxconn_cf, peer_data);
+
+  ngx_log_debug4( NGX_LOG_DEBUG_HTTP
+                , r->connection->log
+                , 0
+                , "max_connections dispatch %V (max_queue_length: %ui, queue timeout: %ui, maxconn: %ui)"
+                , &peer_data->queue_class->name
+                , peer_data->queue_class->max_queue_length
+                , peer_data->queue_class->queue_timeout
+                , backend->max_connections
+                );
+  ngx_http_upstream_connect(r, r->upstream);
+}
+
+/* This function takes the next requests of the classes queue_next_class()
+ * picks and dispatches them to the backends until either the queue is
+ * empty, no backend has a free slot, or dispatch_batch requests went out.
+ * In the last case the rest is left to dispatch_event, which runs after
+ * the other events of this loop iteration. For each request the
+ * slot is reserved here, before the request leaves the queue, so that a
+ * racing worker cannot take it between the check and peer_get(). This
+ * calls ngx_http_upstream_connect() which will in turn call the peer get
+ * callback, peer_get(), which hands the reserved backend to nginx.
+ *
+ * A failed connect frees its peer from within ngx_http_upstream_connect()
+ * and calls back in here; that inner call returns at once and the loop
+ * below picks up whatever it would have done.
+ */
+static void
+dispatch (max_connections_srv_conf_t *maxconn_cf)
+{
+  max_connections_backend_t *backend;
+  ngx_uint_t n;
+
+  if(maxconn_cf->dispatching) return;
+
+  if(releases_of(maxconn_cf) != maxconn_cf->releases_seen) {
+    maxconn_cf->releases_seen = releases_of(maxconn_cf);
+    backends_unsaturate(maxconn_cf);
+  }
+
+  maxconn_cf->dispatching = 1;
+
+  for(n = 0; queue_ready(maxconn_cf); n++) {
+    if(n == maxconn_cf->dispatch_batch && n > 0) {
+      if(maxconn_cf->dispatch_event.prev == NULL) {
+        ngx_post_event((&maxconn_cf->dispatch_event), &ngx_posted_events);
+      }
+      break;
+    }
+
+    do {
+      backend = find_upstream(maxconn_cf, 0, NULL);
+    } while(backend != NULL && !backend_acquire(backend, 0));
+    if(backend == NULL) break; /* all occupied */
+
+    dispatch_one(maxconn_cf, backend);
+  }
+
+  maxconn_cf->dispatching = 0;
+
+  ngx_log_debug1( NGX_LOG_DEBUG_HTTP
+                , ngx_cycle->log
+                , 0
+                , "max_connections dispatched %ui"
+                , n
+                );
+
+  zone_poll(maxconn_cf);
+}
+
+static void
+dispatch_event (ngx_event_t *ev)
+{
+  dispatch(ev->data);
+}
+
+static void
+connection_close (ngx_connection_t *c)
+{
+  if(c->pool) ngx_destroy_pool(c->pool);
+  ngx_close_connection(c);
+}
+
+static void
+dummy_handler (ngx_event_t *ev)
+{
+}
+
+
+static void
+zone_poll_event(ngx_event_t *ev)
+{
+  max_connections_srv_conf_t *maxconn_cf = ev->data;
+
+  if(releases_of(maxconn_cf) != maxconn_cf->releases_seen) {
+    dispatch(maxconn_cf);
+  } else {
+    zone_poll(maxconn_cf);
+  }
+}
+
+static void
+recover_from_client_closure(ngx_event_t *ev)
+{
+  max_connections_backend_t *backend = ev->data;
+
+  assert(backend->connections > 0);
+  assert(backend->client_closures > 0);
+
+  backend_release(backend, backend->client_closures); 
+  backend->client_closures = 0;
+
+  dispatch(backend->maxconn_cf);
+}
+
+/* A request waited in the queue for its whole timeout. */
+static void
+queue_expire (ngx_event_t *ev)
+{
+  max_connections_peer_data_t *peer_data = ev->data;
+  max_connections_srv_conf_t *maxconn_cf = peer_data->maxconn_cf;
+
+  queue_remove(peer_data);
+  ngx_log_debug0( NGX_LOG_DEBUG_HTTP
+                , peer_data->r->connection->log
+                , 0
+                , "max_connections expire"
+                );
+  peer_data->waited = ngx_current_msec - peer_data->accessed;
+  ngx_atomic_fetch_add(&maxconn_cf->shared->expired, 1);
+  ngx_http_finalize_request(peer_data->r, maxconn_cf->expire_status);
+}
+
+
+/* With "max_connections_client_closure drain" the backend connection of a
+ * request whose client went away is kept open and whatever the backend
+ * still sends is thrown away. The slot is released once the backend closes
+ * the connection, that is when it is really done with the request, or
+ * after closure_timeout. */
+static void
+drain_handler (ngx_event_t *rev)
+{
+  ngx_connection_t *c = rev->data;
+  max_connections_backend_t *backend = c->data;
+  static u_char buf[4096];
+  ssize_t n = NGX_ERROR;
+
+  if(!rev->timedout) {
+    do {
+      n = c->recv(c, buf, sizeof(buf));
+    } while(n > 0);
+
+    if(n == NGX_AGAIN && ngx_handle_read_event(rev, 0) == NGX_OK) return;
+  }
+
+  ngx_log_debug2( NGX_LOG_DEBUG_HTTP
+                , c->log
+                , 0
+                , "max_connections drained %V (%s)"
+                , backend->name
+                , rev->timedout ? "timed out" : "done"
+                );
+
+  if(c->pool) ngx_destroy_pool(c->pool);
+  ngx_close_connection(c);
+
+  backend->draining--;
+  backend_release(backend, 1);
+  dispatch(backend->maxconn_cf);
+}
+
+/* Returns 1 if the connection is now drained by drain_handler(), in which
+ * case nginx must not close it. */
+static ngx_int_t
+drain_start (max_connections_backend_t *backend, ngx_connection_t *c, ngx_pool_t *request_pool)
+{
+  if(c == NULL || c->read->eof || c->read->error || c->read->timedout) 
+    return 0;
+
+  if(c->read->timer_set) ngx_del_timer(c->read);
+  if(c->write->timer_set) ngx_del_timer(c->write);
+
+  if(c->pool == request_pool) c->pool = NULL;
+
+  c->data = backend;
+  c->read->handler = drain_handler;
+  c->write->handler = dummy_handler;
+  c->log = ngx_cycle->log;
+  c->read->log = ngx_cycle->log;
+  c->write->log = ngx_cycle->log;
+  if(c->pool) c->pool->log = ngx_cycle->log;
+
+  ngx_add_timer(c->read, backend->maxconn_cf->closure_timeout);
+  backend->draining++;
+
+  /* with edge triggered events what is already there is not reported
+   * again */
+  if(c->read->ready && c->read->prev == NULL) {
+    ngx_post_event(c->read, &ngx_posted_events);
+  }
+
+  return 1;
+}
+
+/* The request is done with backend, which is probably still busy with it:
+ * the client went away, or the request was hedged to another backend.
+ * Holds on to the slot for a while, drains the connection, or releases
+ * the slot at once, as max_connections_client_closure says. Returns 1 if
+ * the connection c is now ours. */
+static ngx_int_t
+backend_abandon (max_connections_backend_t *backend, ngx_connection_t *c, ngx_pool_t *request_pool)
+{
+  max_connections_srv_conf_t *maxconn_cf = backend->maxconn_cf;
+
+  if( maxconn_cf->client_closure == CLOSURE_DRAIN 
+   && drain_start(backend, c, request_pool)
+    ) return 1;
+
+  if(maxconn_cf->client_closure == CLOSURE_RELEASE) {
+    backend_release(backend, 1);
+    return 0;
+  }
+
+  if(!backend->disconnect_event.timer_set) {
+    assert(backend->client_closures == 0);
+    ngx_add_timer( (&backend->disconnect_event)
+                 , maxconn_cf->client_closure == CLOSURE_HOLD
+                   ? maxconn_cf->closure_timeout
+                   : CLIENT_CLOSURE_SLEEP
+                 );
+  }
+  backend->client_closures++;
+  assert(backend->client_closures <= backend->connections);
+  return 0;
+}
+
+/* Hedging. A request that has had no response from its backend after
+ * hedge_after (or the hedge_percentile of recent response times) is sent
+ * to another backend with a free slot, if its method allows and the budget
+ * has a token left. nginx can only wait for one backend per request, so
+ * the first is given up on and treated as if its client had gone away. */
+
+/* the response time below which hedge_percentile of recent responses were */
+static ngx_msec_t
+hedge_threshold (max_connections_srv_conf_t *maxconn_cf)
+{
+  ngx_uint_t i, total = 0, seen = 0;
+
+  if(maxconn_cf->hedge_after) return maxconn_cf->hedge_after;
+
+  for (i = 0; i < WAIT_BUCKETS; i++) total += maxconn_cf->hedge_histogram[i];
+  if(total < HEDGE_MIN) return 0;
+
+  for (i = 0; i < WAIT_BUCKETS - 1; i++) {
+    seen += maxconn_cf->hedge_histogram[i];
+    if(seen * 100 >= total * maxconn_cf->hedge_percentile) 
+      return max_connections_wait_buckets[i];
+  }
+  return 0; /* beyond the last bucket */
+}
+
+static void
+hedge_record (max_connections_srv_conf_t *maxconn_cf, ngx_msec_t rtt)
+{
+  ngx_uint_t b;
+
+  if(maxconn_cf->hedge_percentile == 0) return;
+
+  for( b = 0
+     ; b < WAIT_BUCKETS - 1 && rtt > max_connections_wait_buckets[b]
+     ; b++
+     ) /* void */ ;
+  maxconn_cf->hedge_histogram[b]++;
+
+  if(++maxconn_cf->hedge_samples == HEDGE_WINDOW) {
+    for (b = 0; b < WAIT_BUCKETS; b++) maxconn_cf->hedge_histogram[b] /= 2;
+    maxconn_cf->hedge_samples = 0;
+  }
+}
+
+/* The least loaded backend with a free slot the request has not been to
+ * yet. The backend it is on is usually the top of the heap, then the next
+ * best is one of the top's children; nothing further down is looked at. */
+static max_connections_backend_t *
+hedge_backend (max_connections_srv_conf_t *maxconn_cf, uintptr_t *tried)
+{
+  max_connections_backend_t *backends = maxconn_cf->backends->elts;
+  max_connections_backend_t *choosen = NULL;
+  ngx_uint_t i, n = ngx_min(maxconn_cf->heap_size, 3);
+
+  if(n > 0 && !backend_tried(tried, maxconn_cf->heap[0] - backends)) 
+    return maxconn_cf->heap[0];
+
+  for (i = 1; i < n; i++) {
+    max_connections_backend_t *backend = maxconn_cf->heap[i];
+    if(backend_tried(tried, backend - backends)) continue;
+    if(choosen == NULL || backend_less(backend, choosen)) choosen = backend;
+  }
+  return choosen;
+}
+
+static void
+hedge_handler (ngx_event_t *ev)
+{
+  max_connections_peer_data_t *peer_data = ev->data;
+  max_connections_srv_conf_t *maxconn_cf = peer_data->maxconn_cf;
+  max_connections_backend_t *backend = peer_data->backend, *other;
+  ngx_http_request_t *r = peer_data->r;
+  ngx_http_upstream_t *u = r->upstream;
+  ngx_connection_t *c = u->peer.connection;
+
+  if( backend == NULL || c == NULL 
+   || u->header_sent || u->headers_in.status_n
+   || maxconn_cf->hedge_tokens < HEDGE_COST
+    ) return;
+
+  other = hedge_backend(maxconn_cf, peer_data->tried);
+  if(other == NULL || !backend_acquire(other, 0)) return;
+
+  maxconn_cf->hedge_tokens -= HEDGE_COST;
+  peer_data->hedges++;
+  ngx_atomic_fetch_add(&maxconn_cf->shared->hedged, 1);
+
+  ngx_log_debug2( NGX_LOG_DEBUG_HTTP
+                , r->connection->log
+                , 0
+                , "max_connections hedge %V to %V"
+                , backend->name
+                , other->name
+                );
+
+  /* all there is of the abandoned attempt is that it took at least this
+   * long; without it a backend that is hedged away from would only ever
+   * be credited with its fast responses */
+  ngx_msec_t rtt = ngx_current_msec - peer_data->started;
+  backend_ewma(backend, rtt, 0);
+  hedge_record(maxconn_cf, rtt);
+  circuit_record(backend, rtt, 0);
+
+  u->peer.connection = NULL;
+  if(!backend_abandon(backend, c, r->pool)) connection_close(c);
+
+  peer_data->backend = other;
+  ngx_http_upstream_connect(r, u);
+}
+
+/* The peer free function which is part of all NGINX upstream modules */
+static void
+peer_free (ngx_peer_connection_t *pc, void *data, ngx_uint_t state)
+{
+  max_connections_peer_data_t *peer_data = data;
+  max_connections_backend_t *backend = peer_data->backend;
+  max_connections_srv_conf_t *maxconn_cf = peer_data->maxconn_cf;
+
+  queue_check(peer_data->queue_class);
+
+  if(peer_data->hedge_event.timer_set) {
+    ngx_del_timer( (&peer_data->hedge_event) );
+  }
+
+  /* This happens when a client closes their connection before the request
+   * is completed */
+  if(peer_data->r->connection->error) {
+
+    /* If the connection is in the queue, remove it. */
+    queue_remove(peer_data);
+    
+    /* If the connection is connected to a backend, the backend is
+     * probably still busy with the request. Hold on to the slot for a
+     * while, until the backend is done, or not at all. */
+    if(backend != NULL) {
+      if(backend_abandon(backend, pc ? pc->connection : NULL, peer_data->r->pool)) {
+        pc->connection = NULL; /* now ours */
+      }
+      peer_data->backend = NULL;
+    }
+
+    pc->tries = 0;
+    goto dispatch;
+  }
+
+  if(pc) 
+    pc->tries--;
+
+  if(backend) {
+    ngx_msec_t rtt = ngx_current_msec - peer_data->started;
+    ngx_uint_t error = (state & (NGX_PEER_FAILED|NGX_PEER_NEXT))
+                    || peer_data->r->upstream->headers_in.status_n >= 500;
+
+    assert(backend->connections > 0);
+    backend_release(backend, 1); /* free the slot */
+    ngx_atomic_fetch_add( (state & NGX_PEER_FAILED) 
+                          ? &backend->slots->failures 
+                          : &backend->slots->requests
+                        , 1
+                        );
+    backend_adapt(backend, rtt, state & NGX_PEER_FAILED);
+    backend_ewma(backend, rtt, state & NGX_PEER_FAILED);
+    if(!(state & NGX_PEER_FAILED)) hedge_record(maxconn_cf, rtt);
+    circuit_record(backend, rtt, error);
+    ngx_log_debug2( NGX_LOG_DEBUG_HTTP
+                  , peer_data->r->connection->log
+                  , 0
+                  , "max_connections recv client from %V (now %ui connections)"
+                  , backend->name
+                  , backend->slots->connections
+                  );
+  }
+
+  /* previous connection failed (state & NGX_PEER_FAILED) or either the
+   * connection failed, or it succeeded but the application returned an
+   * error (state & NGX_PEER_NEXT) 
+   */ 
+  if(state & NGX_PEER_FAILED) {
+    ngx_log_debug1( NGX_LOG_DEBUG_HTTP
+                  , pc->log
+                  , 0
+                  , "max_connections %V failed "
+                  , backend->name
+                  );
+    backend_fail(backend);
+    peer_data->backend = NULL;
+
+    /* this forces a backend even if it's maxconn is full */
+    peer_data->really_needs_backend = 1; 
+
+    if(upstreams_are_all_dead(maxconn_cf)) {
+      pc->tries = 0; /* kill this request */
+      ngx_log_error( NGX_LOG_INFO
+                    , pc->log
+                    , 0
+                    , "max_connections all backends are dead. killing request."
+                    );
+    }
+
+    return;
+  }
+
+  /* The backend answered but proxy_next_upstream wants another one to try
+   * (http_404). Like a failure the retry goes straight to peer_get(). */
+  if(state & NGX_PEER_NEXT) {
+    peer_data->backend = NULL;
+    peer_data->really_needs_backend = 1; 
+
+    /* the answer may have opened the breaker on the last backend */
+    if(upstreams_are_all_dead(maxconn_cf)) {
+      pc->tries = 0;
+      ngx_log_error( NGX_LOG_INFO
+                    , pc->log
+                    , 0
+                    , "max_connections all backends are dead. killing request."
+                    );
+    }
+
+    return;
+  }
+
+  peer_data->backend = NULL;
+
+dispatch:
+  flow_done(maxconn_cf, peer_data);
+  dispatch(maxconn_cf);
+}
+
+static ngx_int_t
+peer_get (ngx_peer_connection_t *pc, void *data)
+{
+  max_connections_peer_data_t *peer_data = data;
+  max_connections_srv_conf_t *maxconn_cf = peer_data->maxconn_cf;
+
+  assert(peer_data->queue.next == NULL && "should not be in the queue");
+  assert(peer_data->queue.prev == NULL && "should not be in the queue");
+
+  max_connections_backend_t *backend = peer_data->backend;
+
+  /* dispatch() reserves a slot before connecting. Retries after a failed
+   * backend come straight here and take whatever is alive, trying backends
+   * they have not been to first. */
+  if(backend == NULL) {
+    backend = find_upstream( maxconn_cf
+                           , peer_data->really_needs_backend
+                           , peer_data->tried
+                           );
+    if(backend == NULL) {
+      /* everything died while this request was on its way here */
+      pc->tries = 0;
+      return NGX_BUSY;
+    }
+
+    backend_acquire(backend, 1);
+    peer_data->backend = backend;
+  }
+
+  ngx_uint_t index = backend - (max_connections_backend_t *) maxconn_cf->backends->elts;
+  peer_data->tried[index / TRIED_BITS] |= (uintptr_t) 1 << index % TRIED_BITS;
+
+  pc->sockaddr = backend->sockaddr;
+  pc->socklen  = backend->socklen;
+  pc->name     = backend->name;
+  peer_data->served_by = backend;
+
+  ngx_log_debug2( NGX_LOG_DEBUG_HTTP
+                , pc->log
+                , 0
+                , "max_connections sending client to %V (now %ui connections)"
+                , pc->name
+                , backend->slots->connections
+                );
+
+  peer_data->started = ngx_current_msec;
+
+  if( peer_data->hedges < maxconn_cf->hedge_max 
+   && (peer_data->r->method & maxconn_cf->hedge_methods)
+    ) {
+    ngx_msec_t after = hedge_threshold(maxconn_cf);
+    if(after) ngx_add_timer( (&peer_data->hedge_event), after );
+  }
+
+  return NGX_OK;
+}
+
+static ngx_int_t
+peer_init (ngx_http_request_t *r, ngx_http_upstream_srv_conf_t *uscf)
+{
+  max_connections_srv_conf_t *maxconn_cf = 
+    ngx_http_conf_upstream_srv_conf(uscf, max_connections_module);
+
+  max_connections_peer_data_t *peer_data = 
+    ngx_palloc(r->pool, sizeof(max_connections_peer_data_t));
+  if(peer_data == NULL) return NGX_ERROR;
+
+  peer_data->backend = NULL;
+  peer_data->served_by = NULL;
+  peer_data->maxconn_cf = maxconn_cf;
+  peer_data->r = r;
+  peer_data->accessed = ngx_current_msec; 
+  peer_data->waited = 0;
+  peer_data->position = 0;
+  peer_data->really_needs_backend = 0;
+  peer_data->hashed = 0;
+  peer_data->overflowed = 0;
+  peer_data->inflight = 0;
+  peer_data->flow = 0;
+  peer_data->hedges = 0;
+  peer_data->hedge_event.timer_set = 0;
+
+  if(maxconn_cf->hedge_max) {
+    ngx_memzero(&peer_data->hedge_event, sizeof(ngx_event_t));
+    peer_data->hedge_event.handler = hedge_handler;
+    peer_data->hedge_event.log = r->connection->log;
+    peer_data->hedge_event.data = peer_data;
+  }
+
+  if(maxconn_cf->hash_index != NGX_ERROR) {
+    ngx_http_variable_value_t *v = 
+      ngx_http_get_indexed_variable(r, maxconn_cf->hash_index);
+    if(v && !v->not_found && v->len) {
+      peer_data->hash = ngx_crc32_long(v->data, v->len);
+      peer_data->hashed = 1;
+    }
+  }
+
+  if(maxconn_cf->fair_index != NGX_ERROR) {
+    ngx_http_variable_value_t *v = 
+      ngx_http_get_indexed_variable(r, maxconn_cf->fair_index);
+    if(v && !v->not_found && v->len) {
+      peer_data->flow = ngx_crc32_long(v->data, v->len) % maxconn_cf->fair_flows;
+    }
+  }
+
+  peer_data->queue_class = queue_class_for(maxconn_cf, r);
+  peer_data->queue.prev = peer_data->queue.next = NULL;
+
+  ngx_uint_t n = maxconn_cf->backends->nelts;
+  if(n <= TRIED_BITS) {
+    peer_data->tried = &peer_data->tried_data;
+    peer_data->tried_data = 0;
+  } else {
+    peer_data->tried = 
+      ngx_pcalloc(r->pool, (n + TRIED_BITS - 1) / TRIED_BITS * sizeof(uintptr_t));
+    if(peer_data->tried == NULL) return NGX_ERROR;
+  }
+
+  /* already through one of our upstreams: it overflowed into this one */
+  ngx_uint_t nested = ngx_http_get_module_ctx(r, max_connections_module) != NULL;
+
+  r->upstream->peer.free  = peer_free;
+  r->upstream->peer.get   = peer_get;
+  r->upstream->peer.tries = maxconn_cf->backends->nelts;
+  r->upstream->peer.data  = peer_data;
+  ngx_http_set_ctx(r, peer_data, max_connections_module);
+
+  ngx_msec_t timeout = queue_timeout_for(maxconn_cf, r, peer_data->queue_class);
+  peer_data->timeout = timeout;
+
+  if(!queue_admit(maxconn_cf, peer_data->queue_class, timeout)) 
+    return queue_overflow(peer_data, nested);
+
+  if(maxconn_cf->overflow_wait && !nested &&
+     queue_predicted_wait(maxconn_cf, peer_data->queue_class) > maxconn_cf->overflow_wait)
+    return queue_overflow(peer_data, nested);
+
+  if(queue_push(maxconn_cf, peer_data, timeout) == NGX_DECLINED)
+    return queue_overflow(peer_data, nested);
+
+  dispatch(peer_data->maxconn_cf);
+
+  return NGX_BUSY;
+}
+
+/* Active health checks. Every check_interval each worker sends
+ * "GET check_path HTTP/1.0" to each backend and reads the status line; a
+ * 2xx or 3xx within check_timeout passes. After check_fall failed checks
+ * in a row the backend is taken out just as if it had failed max_fails
+ * requests, and after check_rise passed checks it is back and its fails
+ * are forgotten. */
+
+static void check_done (max_connections_backend_t *backend, ngx_uint_t ok);
+
+static void
+check_read_handler (ngx_event_t *rev)
+{
+  ngx_connection_t *c = rev->data;
+  max_connections_backend_t *backend = c->data;
+  ngx_buf_t *b = backend->check_response;
+
+  if(rev->timedout) {
+    check_done(backend, 0);
+    return;
+  }
+
+  ssize_t n = c->recv(c, b->last, b->end - b->last);
+
+  if(n == NGX_AGAIN) {
+    if(ngx_handle_read_event(rev, 0) == NGX_ERROR) check_done(backend, 0);
+    return;
+  }
+
+  if(n == NGX_ERROR || n == 0) {
+    check_done(backend, 0);
+    return;
+  }
+
+  b->last += n;
+
+  /* "HTTP/1.x NNN" */
+  if(b->last - b->pos < 12) {
+    if(b->last == b->end) check_done(backend, 0);
+    return;
+  }
+
+  if(ngx_strncmp(b->pos, "HTTP/1.", 7) != 0) {
+    check_done(backend, 0);
+    return;
+  }
+
+  ngx_int_t status = ngx_atoi(b->pos + 9, 3);
+  check_done(backend, status >= 200 && status < 400);
+}
+
+static void
+check_write_handler (ngx_event_t *wev)
+{
+  ngx_connection_t *c = wev->data;
+  max_connections_backend_t *backend = c->data;
+  ngx_buf_t *request = backend->maxconn_cf->check_request;
+
+  if(wev->timedout) {
+    check_done(backend, 0);
+    return;
+  }
+
+  while(backend->check_sent < (size_t) (request->last - request->pos)) {
+    ssize_t n = c->send( c
+                       , request->pos + backend->check_sent
+                       , request->last - request->pos - backend->check_sent
+                       );
+    if(n == NGX_ERROR) {
+      check_done(backend, 0);
+      return;
+    }
+    if(n == NGX_AGAIN) {
+      if(ngx_handle_write_event(wev, 0) == NGX_ERROR) check_done(backend, 0);
+      return;
+    }
+    backend->check_sent += n;
+  }
+
+  /* sent. now wait for the status line */
+  wev->handler = dummy_handler;
+  if(wev->timer_set) ngx_del_timer(wev);
+  ngx_add_timer(c->read, backend->maxconn_cf->check_timeout);
+
+  if(c->read->ready) {
+    check_read_handler(c->read);
+  } else if(ngx_handle_read_event(c->read, 0) == NGX_ERROR) {
+    check_done(backend, 0);
+  }
+}
+
+static void
+check_start (ngx_event_t *ev)
+{
+  max_connections_backend_t *backend = ev->data;
+  max_connections_srv_conf_t *maxconn_cf = backend->maxconn_cf;
+
+  if(ngx_exiting) return;
+
+  if(backend->down) {
+    ngx_add_timer(ev, maxconn_cf->check_interval);
+    return;
+  }
+
+  ngx_peer_connection_t *pc = &backend->check_pc;
+  ngx_memzero(pc, sizeof(ngx_peer_connection_t));
+  pc->sockaddr = backend->sockaddr;
+  pc->socklen = backend->socklen;
+  pc->name = backend->name;
+  pc->get = ngx_event_get_peer;
+  pc->log = ev->log;
+  pc->log_error = NGX_ERROR_ERR;
+
+  ngx_int_t rc = ngx_event_connect_peer(pc);
+  if(rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+    pc->connection = NULL; /* already closed, if there was one */
+    check_done(backend, 0);
+    return;
+  }
+
+  ngx_connection_t *c = pc->connection;
+  c->data = backend;
+  c->read->handler = check_read_handler;
+  c->write->handler = check_write_handler;
+
+  backend->check_sent = 0;
+  backend->check_response->pos = backend->check_response->start;
+  backend->check_response->last = backend->check_response->start;
+
+  ngx_add_timer(c->write, maxconn_cf->check_timeout);
+  if(rc == NGX_OK) check_write_handler(c->write);
+}
+
+static void
+check_done (max_connections_backend_t *backend, ngx_uint_t ok)
+{
+  max_connections_srv_conf_t *maxconn_cf = backend->maxconn_cf;
+
+  if(backend->check_pc.connection) {
+    ngx_close_connection(backend->check_pc.connection);
+    backend->check_pc.connection = NULL;
+  }
+
+  ngx_uint_t was_alive = backend_alive(backend);
+
+  if(ok) {
+    backend->check_failed = 0;
+    backend->check_ok++;
+    if(backend->check_down && backend->check_ok >= maxconn_cf->check_rise) {
+      ngx_log_error( NGX_LOG_WARN
+                    , backend->check_event.log
+                    , 0
+                    , "max_connections health check: %V is up"
+                    , backend->name
+                    );
+      backend->check_down = 0;
+      backend->fails = 0;
+      if(backend->revive_event.timer_set) {
+        ngx_del_timer( (&backend->revive_event) );
+      }
+    }
+  } else {
+    backend->check_ok = 0;
+    backend->check_failed++;
+    if(!backend->check_down && backend->check_failed >= maxconn_cf->check_fall) {
+      ngx_log_error( NGX_LOG_WARN
+                    , backend->check_event.log
+                    , 0
+                    , "max_connections health check: %V is down"
+                    , backend->name
+                    );
+      backend->check_down = 1;
+    }
+  }
+
+  backend_alive_changed(backend, was_alive);
+  if(!was_alive && backend_alive(backend)) dispatch(maxconn_cf);
+
+  if(!ngx_exiting) {
+    ngx_add_timer( (&backend->check_event), maxconn_cf->check_interval );
+  }
+}
+
+/* Starts the health checks of every upstream in this worker. The first
+ * check of each backend is at a random point of the first interval so
+ * the workers do not all check at once. */
+static ngx_int_t
+max_connections_init_process (ngx_cycle_t *cycle)
+{
+  ngx_http_upstream_main_conf_t *umcf = 
+    ngx_http_cycle_get_module_main_conf(cycle, ngx_http_upstream_module);
+  if(umcf == NULL) return NGX_OK;
+
+  ngx_http_upstream_srv_conf_t **uscfp = umcf->upstreams.elts;
+  ngx_uint_t i, j;
+
+  for (i = 0; i < umcf->upstreams.nelts; i++) {
+    if (uscfp[i]->peer.init != peer_init) continue;
+
+    max_connections_srv_conf_t *maxconn_cf = 
+      ngx_http_conf_upstream_srv_conf(uscfp[i], max_connections_module);
+    if (maxconn_cf->check_interval == 0) continue;
+
+    max_connections_backend_t *backends = maxconn_cf->backends->elts;
+    for (j = 0; j < maxconn_cf->backends->nelts; j++) {
+      backends[j].check_event.log = cycle->log;
+      ngx_add_timer( (&backends[j].check_event)
+                   , (ngx_msec_t) ngx_random() % maxconn_cf->check_interval
+                   );
+    }
+  }
+
+  return NGX_OK;
+}
+
+/* Joins the pool of the upstream. The first member to be initialized
+ * keeps the list; backends at an address that an earlier member already
+ * has take over that backend's slots. */
+static ngx_int_t
+max_connections_init_pool (ngx_conf_t *cf, max_connections_srv_conf_t *maxconn_cf)
+{
+  ngx_http_upstream_main_conf_t *umcf = 
+    ngx_http_conf_get_module_main_conf(cf, ngx_http_upstream_module);
+  ngx_http_upstream_srv_conf_t **uscfp = umcf->upstreams.elts;
+  max_connections_srv_conf_t *first = NULL;
+  ngx_uint_t i, j, k;
+
+  /* upstreams already initialized by this module have peer_init set */
+  for (i = 0; i < umcf->upstreams.nelts; i++) {
+    if (uscfp[i]->peer.init != peer_init) continue;
+
+    max_connections_srv_conf_t *other = 
+      ngx_http_conf_upstream_srv_conf(uscfp[i], max_connections_module);
+
+    if ( other != maxconn_cf
+      && other->pool.len == maxconn_cf->pool.len
+      && ngx_strncmp(other->pool.data, maxconn_cf->pool.data, maxconn_cf->pool.len) == 0
+       ) {
+      first = other->pool_first;
+      break;
+    }
+  }
+
+  if (first == NULL) {
+    first = maxconn_cf;
+    first->pool_members = 
+      ngx_array_create(cf->pool, 2, sizeof(max_connections_srv_conf_t *));
+    if (first->pool_members == NULL) return NGX_ERROR;
+  } else if (first->zone != maxconn_cf->zone) {
+    ngx_log_error( NGX_LOG_EMERG
+                  , cf->log
+                  , 0
+                  , "upstreams in max_connections_pool \"%V\" must use the "
+                    "same max_connections_zone"
+                  , &maxconn_cf->pool
+                  );
+    return NGX_ERROR;
+  }
+
+  maxconn_cf->pool_first = first;
+
+  max_connections_srv_conf_t **members = first->pool_members->elts;
+  max_connections_backend_t *backends = maxconn_cf->backends->elts;
+
+  for (j = 0; j < maxconn_cf->backends->nelts; j++) {
+    max_connections_backend_t *backend = &backends[j];
+
+    for (i = 0; i < first->pool_members->nelts && !backend->pool_leader; i++) {
+      max_connections_backend_t *others = members[i]->backends->elts;
+
+      for (k = 0; k < members[i]->backends->nelts; k++) {
+        if ( others[k].socklen != backend->socklen
+          || ngx_memcmp(others[k].sockaddr, backend->sockaddr, backend->socklen) != 0
+           ) continue;
+
+        backend->pool_leader = others[k].pool_leader 
+                             ? others[k].pool_leader 
+                             : &others[k];
+        backend->slots = backend->pool_leader->slots;
+        break;
+      }
+    }
+  }
+
+  max_connections_srv_conf_t **member = ngx_array_push(first->pool_members);
+  if (member == NULL) return NGX_ERROR;
+  *member = maxconn_cf;
+
+  return NGX_OK;
+}
+
+static int
+point_cmp (const void *one, const void *two)
+{
+  const max_connections_point_t *a = one, *b = two;
+
+  if(a->hash < b->hash) return -1;
+  return a->hash > b->hash;
+}
+
+/* Builds the consistent hash ring: HASH_POINTS points per unit of weight
+ * for every backend, at the hashes of "name-i". */
+static ngx_int_t
+max_connections_init_hash (ngx_conf_t *cf, max_connections_srv_conf_t *maxconn_cf)
+{
+  max_connections_backend_t *backends = maxconn_cf->backends->elts;
+  ngx_uint_t i, j, n = 0;
+  size_t len = 0;
+
+  for (i = 0; i < maxconn_cf->backends->nelts; i++) {
+    n += backends[i].weight * HASH_POINTS;
+    len = ngx_max(len, backends[i].name->len);
+  }
+
+  len += sizeof("-") - 1 + NGX_INT_T_LEN;
+  u_char *buf = ngx_palloc(cf->pool, len);
+  if (buf == NULL) return NGX_ERROR;
+
+  maxconn_cf->points = ngx_palloc(cf->pool, n * sizeof(max_connections_point_t));
+  if (maxconn_cf->points == NULL) return NGX_ERROR;
+
+  for (n = 0, i = 0; i < maxconn_cf->backends->nelts; i++) {
+    for (j = 0; j < backends[i].weight * HASH_POINTS; j++, n++) {
+      u_char *last = ngx_snprintf(buf, len, "%V-%ui", backends[i].name, j);
+      maxconn_cf->points[n].hash = ngx_crc32_long(buf, last - buf);
+      maxconn_cf->points[n].backend = &backends[i];
+    }
+  }
+  maxconn_cf->npoints = n;
+
+  ngx_qsort(maxconn_cf->points, n, sizeof(max_connections_point_t), point_cmp);
+  return NGX_OK;
+}
+
+/* Finds the upstream named by max_connections_overflow. Its peer.init is
+ * only read when a request overflows, by which time every upstream has
+ * been initialized. */
+static ngx_int_t
+max_connections_init_overflow (ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *uscf, max_connections_srv_conf_t *maxconn_cf)
+{
+  ngx_http_upstream_main_conf_t *umcf = 
+    ngx_http_conf_get_module_main_conf(cf, ngx_http_upstream_module);
+  ngx_http_upstream_srv_conf_t **uscfp = umcf->upstreams.elts;
+  ngx_uint_t i;
+
+  for (i = 0; i < umcf->upstreams.nelts; i++) {
+    if ( uscfp[i]->host.len == maxconn_cf->overflow_name.len
+      && ngx_strncasecmp( uscfp[i]->host.data
+                        , maxconn_cf->overflow_name.data
+                        , maxconn_cf->overflow_name.len
+                        ) == 0
+       ) {
+      maxconn_cf->overflow = uscfp[i];
+      break;
+    }
+  }
+
+  if (maxconn_cf->overflow == NULL || maxconn_cf->overflow == uscf) {
+    ngx_log_error( NGX_LOG_EMERG
+                  , cf->log
+                  , 0
+                  , "max_connections_overflow \"%V\" is not another upstream"
+                  , &maxconn_cf->overflow_name
+                  );
+    return NGX_ERROR;
+  }
+
+  return NGX_OK;
+}
+
+static ngx_int_t
+max_connections_init(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *uscf)
+{
+  ngx_log_error( NGX_LOG_INFO
+                , cf->log
+                , 0
+                , "max_connections_init"
+                );
+
+  max_connections_srv_conf_t *maxconn_cf = 
+    ngx_http_conf_upstream_srv_conf(uscf, max_connections_module);
+
+  /* allocate all the max_connections_backend_t. put them in
+   * maxconn_cf->backends */
+  if(uscf->servers == NULL) return NGX_ERROR;
+  ngx_http_upstream_server_t *server = uscf->servers->elts;
+  ngx_uint_t i, j;
+  ngx_uint_t number_backends = 0;
+
+  for (i = 0; i < uscf->servers->nelts; i++) 
+      number_backends += server[i].naddrs;
+
+  ngx_array_t *backends = 
+    ngx_array_create(cf->pool, number_backends, sizeof(max_connections_backend_t));
+  if (backends == NULL) return NGX_ERROR;
+
+  /* one hostname can have multiple IP addresses in DNS */
+  ngx_uint_t n, k, a;
+  for (n = 0, i = 0; i < uscf->servers->nelts; i++) {
+    for (j = 0; j < server[i].naddrs; j++, n++) {
+      max_connections_backend_t *backend = ngx_array_push(backends);
+      ngx_memzero(backend, sizeof(max_connections_backend_t));
+      backend->sockaddr     = server[i].addrs[j].sockaddr;
+      backend->socklen      = server[i].addrs[j].socklen;
+      backend->name         = &(server[i].addrs[j].name);
+      backend->max_fails    = server[i].max_fails;
+      backend->fail_timeout = server[i].fail_timeout;
+      backend->down         = server[i].down;
+      backend->weight       = server[i].down ? 0 : server[i].weight;
+      backend->max_connections = maxconn_cf->max_connections;
+      backend->slow_start   = 0;
+      backend->revived      = 0;
+      backend->connections  = 0;
+      backend->slots        = &backend->local_slots;
+      ngx_memzero(backend->slots, sizeof(max_connections_slots_t));
+      backend->slots->limit = maxconn_cf->adaptive_min * ADAPTIVE_ONE;
+      backend->heap_index   = HEAP_NONE;
+
+      backend->disconnect_event.handler = recover_from_client_closure;
+      backend->disconnect_event.log = cf->log;
+      backend->disconnect_event.data = backend;
+      backend->revive_event.handler = revive_backend;
+      backend->revive_event.log = cf->log;
+      backend->revive_event.data = backend;
+      backend->slow_start_event.handler = slow_start_step;
+      backend->slow_start_event.log = cf->log;
+      backend->slow_start_event.data = backend;
+      backend->maxconn_cf = maxconn_cf;
+
+      backend->circuit = CIRCUIT_CLOSED;
+      backend->circuit_event.handler = circuit_half_open;
+      backend->circuit_event.log = cf->log;
+      backend->circuit_event.data = backend;
+
+      if(maxconn_cf->check_interval) {
+        backend->check_event.handler = check_start;
+        backend->check_event.log = cf->log;
+        backend->check_event.data = backend;
+        backend->check_response = ngx_create_temp_buf(cf->pool, 32);
+        if(backend->check_response == NULL) return NGX_ERROR;
+      }
+
+      if (maxconn_cf->servers == NULL) continue;
+
+      /* the last max_connections_server for an address wins */
+      max_connections_server_conf_t *sc = maxconn_cf->servers->elts;
+      for (k = 0; k < maxconn_cf->servers->nelts; k++) {
+        for (a = 0; a < sc[k].naddrs; a++) {
+          if ( sc[k].addrs[a].socklen != backend->socklen
+            || ngx_memcmp(sc[k].addrs[a].sockaddr, backend->sockaddr, backend->socklen) != 0
+             ) continue;
+
+          if (sc[k].max_connections) 
+            backend->max_connections = sc[k].max_connections;
+          if (sc[k].slow_start) 
+            backend->slow_start = sc[k].slow_start;
+        }
+      }
+    }
+  }
+  maxconn_cf->backends = backends;
+
+  if(maxconn_cf->pool.len && max_connections_init_pool(cf, maxconn_cf) != NGX_OK) 
+    return NGX_ERROR;
+
+  maxconn_cf->heap = 
+    ngx_palloc(cf->pool, number_backends * sizeof(max_connections_backend_t *));
+  if (maxconn_cf->heap == NULL) return NGX_ERROR;
+  maxconn_cf->heap_size = 0;
+  maxconn_cf->nalive = 0;
+  ngx_queue_init(&maxconn_cf->saturated);
+
+  max_connections_backend_t *backend = backends->elts;
+  for (i = 0; i < backends->nelts; i++) {
+    if (backend_alive(&backend[i])) maxconn_cf->nalive++;
+    backend_update(&backend[i]);
+  }
+
+  if(maxconn_cf->hash_index != NGX_ERROR 
+  && max_connections_init_hash(cf, maxconn_cf) != NGX_OK
+    ) return NGX_ERROR;
+
+  if(maxconn_cf->overflow_name.len 
+  && max_connections_init_overflow(cf, uscf, maxconn_cf) != NGX_OK
+    ) return NGX_ERROR;
+
+  uscf->peer.init = peer_init;
+
+  /* the default class goes last unless it was declared explicitly */
+  max_connections_queue_t *queue = maxconn_cf->queues->elts;
+  for (i = 0; i < maxconn_cf->queues->nelts; i++) {
+    if (queue[i].name.len == sizeof("default") - 1
+     && ngx_strncmp(queue[i].name.data, "default", sizeof("default") - 1) == 0
+       ) break;
+  }
+
+  if (i == maxconn_cf->queues->nelts) {
+    queue = ngx_array_push(maxconn_cf->queues);
+    if (queue == NULL) return NGX_ERROR;
+    ngx_memzero(queue, sizeof(max_connections_queue_t));
+    queue->name.len = sizeof("default") - 1;
+    queue->name.data = (u_char *) "default";
+    queue->weight = 1;
+  }
+  maxconn_cf->default_queue = 
+    (max_connections_queue_t *) maxconn_cf->queues->elts + i;
+
+  queue = maxconn_cf->queues->elts;
+  for (i = 0; i < maxconn_cf->queues->nelts; i++) {
+    if (queue[i].max_queue_length == 0)
+      queue[i].max_queue_length = maxconn_cf->max_queue_length;
+    if (queue[i].queue_timeout == 0)
+      queue[i].queue_timeout = maxconn_cf->queue_timeout;
+
+    ngx_queue_init(&queue[i].waiting_requests);
+    assert(ngx_queue_empty(&queue[i].waiting_requests));
+
+    ngx_queue_init(&queue[i].active_flows);
+    if (maxconn_cf->fair_index != NGX_ERROR) {
+      queue[i].flows = 
+        ngx_pcalloc(cf->pool, maxconn_cf->fair_flows * sizeof(max_connections_flow_t));
+      if (queue[i].flows == NULL) return NGX_ERROR;
+      for (j = 0; j < maxconn_cf->fair_flows; j++) {
+        ngx_queue_init(&queue[i].flows[j].waiting_requests);
+      }
+    }
+
+    queue[i].maxconn_cf = maxconn_cf;
+  }
+
+  if (maxconn_cf->fair_index != NGX_ERROR) {
+    maxconn_cf->fair_inflight = 
+      ngx_pcalloc(cf->pool, maxconn_cf->fair_flows * sizeof(ngx_uint_t));
+    if (maxconn_cf->fair_inflight == NULL) return NGX_ERROR;
+  }
+
+  maxconn_cf->shared = &maxconn_cf->local_shared;
+  maxconn_cf->zone_poll_event.handler = zone_poll_event;
+  maxconn_cf->zone_poll_event.log = cf->log;
+  maxconn_cf->zone_poll_event.data = maxconn_cf;
+  if(maxconn_cf->check_interval) {
+    size_t len = sizeof("GET  HTTP/1.0" CRLF "Host: " CRLF CRLF) - 1
+               + maxconn_cf->check_path.len + uscf->host.len;
+    maxconn_cf->check_request = ngx_create_temp_buf(cf->pool, len);
+    if(maxconn_cf->check_request == NULL) return NGX_ERROR;
+    maxconn_cf->check_request->last = 
+      ngx_sprintf( maxconn_cf->check_request->pos
+                 , "GET %V HTTP/1.0" CRLF "Host: %V" CRLF CRLF
+                 , &maxconn_cf->check_path
+                 , &uscf->host
+                 );
+  }
+
+  maxconn_cf->dispatch_event.handler = dispatch_event;
+  maxconn_cf->dispatch_event.log = cf->log;
+  maxconn_cf->dispatch_event.data = maxconn_cf;
+
+  return NGX_OK;
+}
+
+/* Called by nginx once the shared memory exists, after all upstreams have
+ * been initialized. Moves the slot counters of every upstream using the
+ * zone into it. On reload the old counters are kept if the layout did not
+ * change so that requests still running in old workers stay accounted. */
+static ngx_int_t
+max_connections_init_zone (ngx_shm_zone_t *shm_zone, void *data)
+{
+  max_connections_zone_t *ozone = data;
+  max_connections_zone_t *zone = shm_zone->data;
+  ngx_slab_pool_t *shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+  max_connections_srv_conf_t **upstreams = zone->upstreams->elts;
+  max_connections_shm_t *sh, *ozone_sh = ozone ? ozone->sh : NULL;
+  ngx_uint_t i, j, nslots = 0;
+
+  for (i = 0; i < zone->upstreams->nelts; i++) 
+    nslots += upstreams[i]->backends->nelts;
+
+  /* The old block is never freed: workers of the previous cycle may still
+   * be releasing slots into it. */
+  sh = NULL;
+  if( ozone && ozone->sh
+   && ozone->sh->nupstreams == zone->upstreams->nelts 
+   && ozone->sh->nslots == nslots
+    ) sh = ozone->sh;
+
+  if(sh == NULL) {
+    size_t size = sizeof(max_connections_shm_t)
+                + sizeof(max_connections_shared_t) * zone->upstreams->nelts
+                + sizeof(max_connections_slots_t) * nslots;
+
+    sh = ngx_slab_alloc(shpool, size);
+    if(sh == NULL) {
+      ngx_log_error( NGX_LOG_EMERG
+                    , shm_zone->shm.log
+                    , 0
+                    , "max_connections_zone \"%V\" is too small"
+                    , &shm_zone->shm.name
+                    );
+      return NGX_ERROR;
+    }
+    ngx_memzero(sh, size);
+
+    sh->nupstreams = zone->upstreams->nelts;
+    sh->nslots = nslots;
+    sh->upstreams = (max_connections_shared_t *) (sh + 1);
+    sh->slots = (max_connections_slots_t *) (sh->upstreams + sh->nupstreams);
+  }
+  zone->sh = sh;
+
+  max_connections_slots_t *slots = sh->slots;
+  for (i = 0; i < zone->upstreams->nelts; i++) {
+    max_connections_backend_t *backends = upstreams[i]->backends->elts;
+
+    upstreams[i]->shared = &sh->upstreams[i];
+    for (j = 0; j < upstreams[i]->backends->nelts; j++) {
+      if(sh != ozone_sh) slots->limit = backends[j].slots->limit;
+      if(!backends[j].pool_leader) backends[j].slots = slots;
+      slots++;
+    }
+  }
+
+  /* backends in a pool use their leader's slots, which are in this zone
+   * as well */
+  for (i = 0; i < zone->upstreams->nelts; i++) {
+    max_connections_backend_t *backends = upstreams[i]->backends->elts;
+
+    for (j = 0; j < upstreams[i]->backends->nelts; j++) {
+      if(backends[j].pool_leader) 
+        backends[j].slots = backends[j].pool_leader->slots;
+    }
+  }
+
+  return NGX_OK;
+}
+
+/* Variables for the access log. They describe the last time the request
+ * went through a max_connections upstream and are not found otherwise, or
+ * if it was spilled from there to an overflow upstream without a queue. */
+
+static ngx_int_t
+variable_queue_time (ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data)
+{
+  max_connections_peer_data_t *peer_data = 
+    ngx_http_get_module_ctx(r, max_connections_module);
+
+  if(peer_data == NULL || peer_data->overflowed) {
+    v->not_found = 1;
+    return NGX_OK;
+  }
+
+  u_char *p = ngx_palloc(r->pool, NGX_INT_T_LEN + 4);
+  if(p == NULL) return NGX_ERROR;
+
+  v->len = ngx_sprintf( p
+                      , "%ui.%03ui"
+                      , (ngx_uint_t) (peer_data->waited / 1000)
+                      , (ngx_uint_t) (peer_data->waited % 1000)
+                      ) - p;
+  v->valid = 1;
+  v->no_cachable = 0;
+  v->not_found = 0;
+  v->data = p;
+  return NGX_OK;
+}
+
+static ngx_int_t
+variable_queue_position (ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data)
+{
+  max_connections_peer_data_t *peer_data = 
+    ngx_http_get_module_ctx(r, max_connections_module);
+
+  if(peer_data == NULL || peer_data->overflowed) {
+    v->not_found = 1;
+    return NGX_OK;
+  }
+
+  u_char *p = ngx_palloc(r->pool, NGX_INT_T_LEN);
+  if(p == NULL) return NGX_ERROR;
+
+  v->len = ngx_sprintf(p, "%ui", peer_data->position) - p;
+  v->valid = 1;
+  v->no_cachable = 0;
+  v->not_found = 0;
+  v->data = p;
+  return NGX_OK;
+}
+
+static ngx_int_t
+variable_backend (ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data)
+{
+  max_connections_peer_data_t *peer_data = 
+    ngx_http_get_module_ctx(r, max_connections_module);
+
+  /* peer_free() has cleared peer_data->backend by the time the access log
+   * is written */
+  if(peer_data == NULL || peer_data->overflowed || peer_data->served_by == NULL) {
+    v->not_found = 1;
+    return NGX_OK;
+  }
+
+  v->len = peer_data->served_by->name->len;
+  v->valid = 1;
+  v->no_cachable = 0;
+  v->not_found = 0;
+  v->data = peer_data->served_by->name->data;
+  return NGX_OK;
+}
+
+static ngx_http_variable_t max_connections_variables[] = 
+{ { ngx_string("max_connections_queue_time")
+  , NULL
+  , variable_queue_time
+  , 0
+  , NGX_HTTP_VAR_NOHASH|NGX_HTTP_VAR_NOCACHABLE
+  , 0
+  }
+, { ngx_string("max_connections_queue_position_at_enqueue")
+  , NULL
+  , variable_queue_position
+  , 0
+  , NGX_HTTP_VAR_NOHASH|NGX_HTTP_VAR_NOCACHABLE
+  , 0
+  }
+, { ngx_string("max_connections_backend")
+  , NULL
+  , variable_backend
+  , 0
+  , NGX_HTTP_VAR_NOHASH|NGX_HTTP_VAR_NOCACHABLE
+  , 0
+  }
+, { ngx_null_string, NULL, NULL, 0, 0, 0 }
+};
+
+static ngx_int_t
+max_connections_add_variables (ngx_conf_t *cf)
+{
+  ngx_http_variable_t *var, *v;
+
+  for (v = max_connections_variables; v->name.len; v++) {
+    var = ngx_http_add_variable(cf, &v->name, v->flags);
+    if (var == NULL) return NGX_ERROR;
+
+    var->get_handler = v->get_handler;
+    var->data = v->data;
+  }
+
+  return NGX_OK;
+}
+
+/* max_connections_status: reports the queues and slots of every upstream
+ * balanced by this module, as JSON or in the Prometheus text format.
+ * Counters and slot counts cover all workers when the upstream has a
+ * max_connections_zone; queue lengths, client closures and fails are
+ * always those of the worker that answered. */
+
+#define STATUS_JSON       0
+#define STATUS_PROMETHEUS 1
+
+static char *max_connections_status_le[] = 
+  { "0.001", "0.005", "0.01", "0.025", "0.05", "0.1", "0.25", "0.5"
+  , "1", "2.5", "5", "10", "+Inf" 
+  };
+
+static char *max_connections_circuit_names[] = 
+  { "closed", "open", "half_open" };
+
+/* An upper bound of what status_json() or status_prometheus() write: room
+ * for the fixed text and numbers, plus the names as often as the
+ * Prometheus format repeats them (the upstream on every line, a class or
+ * backend on each of its lines). */
+#define STATUS_UPSTREAM_LINES (8 + WAIT_BUCKETS)
+#define STATUS_BACKEND_LINES 11
+
+static size_t
+status_size (ngx_str_t *name, max_connections_srv_conf_t *maxconn_cf)
+{
+  max_connections_queue_t *queues = maxconn_cf->queues->elts;
+  max_connections_backend_t *backends = maxconn_cf->backends->elts;
+  ngx_uint_t i;
+  size_t size = 4096 + STATUS_UPSTREAM_LINES * name->len;
+
+  for (i = 0; i < maxconn_cf->queues->nelts; i++) {
+    size += 256 + name->len + queues[i].name.len;
+  }
+
+  for (i = 0; i < maxconn_cf->backends->nelts; i++) {
+    size += 2560 + STATUS_BACKEND_LINES * (name->len + backends[i].name->len);
+  }
+
+  return size;
+}
+
+static u_char *
+status_json (u_char *p, ngx_str_t *name, max_connections_srv_conf_t *maxconn_cf)
+{
+  max_connections_shared_t *sh = maxconn_cf->shared;
+  max_connections_queue_t *queues = maxconn_cf->queues->elts;
+  max_connections_backend_t *backends = maxconn_cf->backends->elts;
+  ngx_uint_t i;
+
+  p = ngx_sprintf(p, "{\"name\":\"%V\",\"shared\":%s,"
+                     "\"queue_length\":%ui,\"classes\":["
+                 , name
+                 , maxconn_cf->zone ? "true" : "false"
+                 , maxconn_cf->queue_length
+                 );
+
+  for (i = 0; i < maxconn_cf->queues->nelts; i++) {
+    p = ngx_sprintf(p, "%s{\"name\":\"%V\",\"queue_length\":%ui,"
+                       "\"max_queue_length\":%ui,\"queue_timeout\":%ui}"
+                   , i ? "," : ""
+                   , &queues[i].name
+                   , queues[i].queue_length
+                   , queues[i].max_queue_length
+                   , queues[i].queue_timeout
+                   );
+  }
+
+  p = ngx_sprintf(p, "],\"enqueued\":%uA,\"dispatched\":%uA,"
+                     "\"expired\":%uA,\"rejected\":%uA,\"hedged\":%uA,"
+                     "\"overflowed\":%uA,\"queue_wait_ms\":{\"sum\":%uA,\"buckets\":{"
+                 , sh->enqueued
+                 , sh->dispatched
+                 , sh->expired
+                 , sh->rejected
+                 , sh->hedged
+                 , sh->overflowed
+                 , sh->wait_sum
+                 );
+
+  for (i = 0; i < WAIT_BUCKETS; i++) {
+    if (i < WAIT_BUCKETS - 1) {
+      p = ngx_sprintf(p, "%s\"%M\":%uA"
+                     , i ? "," : ""
+                     , max_connections_wait_buckets[i]
+                     , sh->wait[i]
+                     );
+    } else {
+      p = ngx_sprintf(p, ",\"+Inf\":%uA", sh->wait[i]);
+    }
+  }
+
+  p = ngx_sprintf(p, "}},\"backends\":[");
+
+  for (i = 0; i < maxconn_cf->backends->nelts; i++) {
+    max_connections_backend_t *backend = &backends[i];
+
+    p = ngx_sprintf(p, "%s{\"name\":\"%V\",\"connections\":%uA,"
+                       "\"worker_connections\":%ui,\"limit\":%ui,"
+                       "\"client_closures\":%ui,\"draining\":%ui,\"fails\":%ui,"
+                       "\"down\":%s,\"alive\":%s,\"circuit\":\"%s\","
+                       "\"requests\":%uA,\"failures\":%uA,\"response_ms\":%ui}"
+                   , i ? "," : ""
+                   , backend->name
+                   , backend->slots->connections
+                   , backend->connections
+                   , backend_limit(backend)
+                   , backend->client_closures
+                   , backend->draining
+                   , backend->fails
+                   , backend->down ? "true" : "false"
+                   , backend_alive(backend) ? "true" : "false"
+                   , max_connections_circuit_names[backend->circuit]
+                   , backend->slots->requests
+                   , backend->slots->failures
+                   , backend->ewma / EWMA_ONE
+                   );
+  }
+
+  return ngx_sprintf(p, "]}");
+}
+
+static u_char *
+status_prometheus (u_char *p, ngx_str_t *name, max_connections_srv_conf_t *maxconn_cf)
+{
+  max_connections_shared_t *sh = maxconn_cf->shared;
+  max_connections_queue_t *queues = maxconn_cf->queues->elts;
+  max_connections_backend_t *backends = maxconn_cf->backends->elts;
+  ngx_atomic_uint_t cumulative = 0;
+  ngx_uint_t i;
+
+  for (i = 0; i < maxconn_cf->queues->nelts; i++) {
+    p = ngx_sprintf(p, "max_connections_queue_length{upstream=\"%V\",class=\"%V\"} %ui\n"
+                   , name, &queues[i].name, queues[i].queue_length);
+  }
+
+  p = ngx_sprintf(p, "max_connections_enqueued_total{upstream=\"%V\"} %uA\n"
+                     "max_connections_dispatched_total{upstream=\"%V\"} %uA\n"
+                     "max_connections_expired_total{upstream=\"%V\"} %uA\n"
+                     "max_connections_rejected_total{upstream=\"%V\"} %uA\n"
+                     "max_connections_hedged_total{upstream=\"%V\"} %uA\n"
+                     "max_connections_overflowed_total{upstream=\"%V\"} %uA\n"
+                 , name, sh->enqueued
+                 , name, sh->dispatched
+                 , name, sh->expired
+                 , name, sh->rejected
+                 , name, sh->hedged
+                 , name, sh->overflowed
+                 );
+
+  for (i = 0; i < WAIT_BUCKETS; i++) {
+    cumulative += sh->wait[i];
+    p = ngx_sprintf(p, "max_connections_queue_wait_seconds_bucket{upstream=\"%V\",le=\"%s\"} %uA\n"
+                   , name, max_connections_status_le[i], cumulative);
+  }
+
+  p = ngx_sprintf(p, "max_connections_queue_wait_seconds_sum{upstream=\"%V\"} %uA.%03uA\n"
+                     "max_connections_queue_wait_seconds_count{upstream=\"%V\"} %uA\n"
+                 , name, sh->wait_sum / 1000, sh->wait_sum % 1000
+                 , name, cumulative
+                 );
+
+  for (i = 0; i < maxconn_cf->backends->nelts; i++) {
+    max_connections_backend_t *backend = &backends[i];
+
+    p = ngx_sprintf(p, "max_connections_backend_connections{upstream=\"%V\",backend=\"%V\"} %uA\n"
+                       "max_connections_backend_limit{upstream=\"%V\",backend=\"%V\"} %ui\n"
+                       "max_connections_backend_client_closures{upstream=\"%V\",backend=\"%V\"} %ui\n"
+                       "max_connections_backend_draining{upstream=\"%V\",backend=\"%V\"} %ui\n"
+                       "max_connections_backend_fails{upstream=\"%V\",backend=\"%V\"} %ui\n"
+                       "max_connections_backend_down{upstream=\"%V\",backend=\"%V\"} %d\n"
+                       "max_connections_backend_alive{upstream=\"%V\",backend=\"%V\"} %d\n"
+                       "max_connections_backend_circuit{upstream=\"%V\",backend=\"%V\"} %ui\n"
+                       "max_connections_backend_requests_total{upstream=\"%V\",backend=\"%V\"} %uA\n"
+                       "max_connections_backend_failures_total{upstream=\"%V\",backend=\"%V\"} %uA\n"
+                       "max_connections_backend_response_ms{upstream=\"%V\",backend=\"%V\"} %ui\n"
+                   , name, backend->name, backend->slots->connections
+                   , name, backend->name, backend_limit(backend)
+                   , name, backend->name, backend->client_closures
+                   , name, backend->name, backend->draining
+                   , name, backend->name, backend->fails
+                   , name, backend->name, (int) backend->down
+                   , name, backend->name, (int) backend_alive(backend)
+                   , name, backend->name, backend->circuit
+                   , name, backend->name, backend->slots->requests
+                   , name, backend->name, backend->slots->failures
+                   , name, backend->name, backend->ewma / EWMA_ONE
+                   );
+  }
+
+  return p;
+}
+
+static ngx_int_t
+status_handler (ngx_http_request_t *r, ngx_uint_t format)
+{
+  ngx_http_upstream_main_conf_t *umcf = 
+    ngx_http_get_module_main_conf(r, ngx_http_upstream_module);
+  ngx_http_upstream_srv_conf_t **uscfp = umcf->upstreams.elts;
+  ngx_uint_t i, n;
+  size_t size = 64;
+  ngx_int_t rc;
+
+  if (r->method != NGX_HTTP_GET && r->method != NGX_HTTP_HEAD) {
+    return NGX_HTTP_NOT_ALLOWED;
+  }
+
+  rc = ngx_http_discard_request_body(r);
+  if (rc != NGX_OK) return rc;
+
+  for (i = 0; i < umcf->upstreams.nelts; i++) {
+    if (uscfp[i]->peer.init != peer_init) continue;
+    size += status_size( &uscfp[i]->host
+                       , ngx_http_conf_upstream_srv_conf(uscfp[i], max_connections_module)
+                       );
+  }
+
+  ngx_buf_t *b = ngx_create_temp_buf(r->pool, size);
+  if (b == NULL) return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+  u_char *p = b->last;
+
+  if (format == STATUS_JSON) 
+    p = ngx_sprintf(p, "{\"worker\":%P,\"upstreams\":[", ngx_pid);
+
+  for (n = 0, i = 0; i < umcf->upstreams.nelts; i++) {
+    if (uscfp[i]->peer.init != peer_init) continue;
+
+    max_connections_srv_conf_t *maxconn_cf = 
+      ngx_http_conf_upstream_srv_conf(uscfp[i], max_connections_module);
+
+    if (format == STATUS_JSON) {
+      if (n++) *p++ = ',';
+      p = status_json(p, &uscfp[i]->host, maxconn_cf);
+    } else {
+      p = status_prometheus(p, &uscfp[i]->host, maxconn_cf);
+    }
+  }
+
+  if (format == STATUS_JSON) p = ngx_sprintf(p, "]}\n");
+
+  assert(p <= b->end && "status_size() too small");
+  b->last = p;
+  b->last_buf = 1;
+
+  r->headers_out.status = NGX_HTTP_OK;
+  r->headers_out.content_length_n = b->last - b->pos;
+  if (format == STATUS_JSON) {
+    r->headers_out.content_type.len = sizeof("application/json") - 1;
+    r->headers_out.content_type.data = (u_char *) "application/json";
+  } else {
+    r->headers_out.content_type.len = sizeof("text/plain; version=0.0.4") - 1;
+    r->headers_out.content_type.data = (u_char *) "text/plain; version=0.0.4";
+  }
+
+  rc = ngx_http_send_header(r);
+  if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) return rc;
+
+  ngx_chain_t out;
+  out.buf = b;
+  out.next = NULL;
+
+  return ngx_http_output_filter(r, &out);
+}
+
+static ngx_int_t
+status_json_handler (ngx_http_request_t *r)
+{
+  return status_handler(r, STATUS_JSON);
+}
+
+static ngx_int_t
+status_prometheus_handler (ngx_http_request_t *r)
+{
+  return status_handler(r, STATUS_PROMETHEUS);
+}
+
+/* max_connections_status [json|prometheus]; */
+static char *
+max_connections_status_command (ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_http_core_loc_conf_t *clcf = 
+    ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+
+  ngx_str_t *value = cf->args->elts;
+
+  if (cf->args->nelts == 1 || ngx_strcmp(value[1].data, "json") == 0) {
+    clcf->handler = status_json_handler;
+  } else if (ngx_strcmp(value[1].data, "prometheus") == 0) {
+    clcf->handler = status_prometheus_handler;
+  } else {
+    return "must be \"json\" or \"prometheus\"";
+  }
+
+  return NGX_CONF_OK;
+}
+
+/* ngx_parse_time() for the millisecond parameters, which go into timers.
+ * Anything too large for one (NGX_PARSE_LARGE_TIME) is NGX_ERROR too. */
+static ngx_int_t
+parse_msec (ngx_str_t *s)
+{
+  ngx_int_t n = ngx_parse_time(s, 0);
+  return n == NGX_PARSE_LARGE_TIME ? NGX_ERROR : n;
+}
+
+/* TODO This function is probably not neccesary. Nginx provides a means of
+ * easily setting scalar time values with ngx_conf_set_msec_slot() in the
+ * ngx_command_t structure. I couldn't manage to make it work, not knowing
+ * what I should be using for the two offset parameters. 
+ */ 
+static char *
+max_connections_queue_timeout_command (ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_http_upstream_srv_conf_t *uscf = 
+    ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+  max_connections_srv_conf_t *maxconn_cf = 
+    ngx_http_conf_upstream_srv_conf(uscf, max_connections_module);
+
+  ngx_str_t        *value; 
+
+  value = cf->args->elts;    
+
+  ngx_msec_t ms = ngx_parse_time(&value[1], 0); 
+  if (ms == (ngx_msec_t) NGX_ERROR) {
+      return "invalid value";
+  }
+
+  if (ms == (ngx_msec_t) NGX_PARSE_LARGE_TIME) {
+      return "value must be less than 597 hours";
+  }
+
+  maxconn_cf->queue_timeout = ms;
+
+  return NGX_CONF_OK;
+}
+
+/* TODO same as above */
+static char *
+max_connections_max_queue_length_command (ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_http_upstream_srv_conf_t *uscf = 
+    ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+  max_connections_srv_conf_t *maxconn_cf = 
+    ngx_http_conf_upstream_srv_conf(uscf, max_connections_module);
+
+  ngx_str_t *value = cf->args->elts;    
+  ngx_int_t n = ngx_atoi(value[1].data, value[1].len);
+  if (n == NGX_ERROR) {
+    return "invalid number";        
+  }
+
+  maxconn_cf->max_queue_length = n;
+
+  return NGX_CONF_OK;
+}
+
+static char *
+max_connections_zone_command (ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_http_upstream_srv_conf_t *uscf = 
+    ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+  max_connections_srv_conf_t *maxconn_cf = 
+    ngx_http_conf_upstream_srv_conf(uscf, max_connections_module);
+
+  ngx_str_t *value = cf->args->elts;
+
+  if(maxconn_cf->zone) {
+    return "is duplicate";
+  }
+
+  ssize_t size = ngx_parse_size(&value[2]);
+  if (size == NGX_ERROR) {
+    ngx_conf_log_error( NGX_LOG_EMERG
+                      , cf
+                      , 0
+                      , "invalid size \"%V\" in \"%V\" directive"
+                      , &value[2]
+                      , &cmd->name
+                      );
+    return NGX_CONF_ERROR;
+  }
+
+  if (size < (ssize_t) (8 * ngx_pagesize)) {
+    ngx_conf_log_error( NGX_LOG_EMERG
+                      , cf
+                      , 0
+                      , "max_connections_zone \"%V\" is too small"
+                      , &value[1]
+                      );
+    return NGX_CONF_ERROR;
+  }
+
+  /* the zone is only useful to upstreams balanced by this module */
+  uscf->peer.init_upstream = max_connections_init;
+
+  ngx_shm_zone_t *shm_zone = 
+    ngx_shared_memory_add(cf, &value[1], size, &max_connections_module);
+  if (shm_zone == NULL) return NGX_CONF_ERROR;
+
+  /* several upstreams may share one zone */
+  max_connections_zone_t *zone = shm_zone->data;
+  if (zone == NULL) {
+    zone = ngx_pcalloc(cf->pool, sizeof(max_connections_zone_t));
+    if (zone == NULL) return NGX_CONF_ERROR;
+
+    zone->upstreams = 
+      ngx_array_create(cf->pool, 1, sizeof(max_connections_srv_conf_t *));
+    if (zone->upstreams == NULL) return NGX_CONF_ERROR;
+
+    zone->shm_zone = shm_zone;
+    shm_zone->init = max_connections_init_zone;
+    shm_zone->data = zone;
+  }
+
+  max_connections_srv_conf_t **upstream = ngx_array_push(zone->upstreams);
+  if (upstream == NULL) return NGX_CONF_ERROR;
+  *upstream = maxconn_cf;
+
+  maxconn_cf->zone = zone;
+
+  return NGX_CONF_OK;
+}
+
+/* max_connections_server address [max_conns=N] [slow_start=T]; */
+static char *
+max_connections_server_command (ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_http_upstream_srv_conf_t *uscf = 
+    ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+  max_connections_srv_conf_t *maxconn_cf = 
+    ngx_http_conf_upstream_srv_conf(uscf, max_connections_module);
+
+  ngx_str_t *value = cf->args->elts;
+  ngx_uint_t i;
+
+  if (maxconn_cf->servers == NULL) {
+    maxconn_cf->servers = 
+      ngx_array_create(cf->pool, 4, sizeof(max_connections_server_conf_t));
+    if (maxconn_cf->servers == NULL) return NGX_CONF_ERROR;
+  }
+
+  max_connections_server_conf_t *sc = ngx_array_push(maxconn_cf->servers);
+  if (sc == NULL) return NGX_CONF_ERROR;
+  ngx_memzero(sc, sizeof(max_connections_server_conf_t));
+
+  ngx_url_t u;
+  ngx_memzero(&u, sizeof(ngx_url_t));
+  u.url = value[1];
+  u.default_port = 80;
+
+  if (ngx_parse_url(cf, &u) != NGX_OK) {
+    if (u.err) {
+      ngx_conf_log_error( NGX_LOG_EMERG
+                        , cf
+                        , 0
+                        , "%s in \"%V\" of max_connections_server"
+                        , u.err
+                        , &u.url
+                        );
+    }
+    return NGX_CONF_ERROR;
+  }
+
+  sc->name = value[1];
+  sc->addrs = u.addrs;
+  sc->naddrs = u.naddrs;
+
+  for (i = 2; i < cf->args->nelts; i++) {
+
+    if (ngx_strncmp(value[i].data, "max_conns=", 10) == 0) {
+      ngx_int_t n = ngx_atoi(&value[i].data[10], value[i].len - 10);
+      if (n == NGX_ERROR || n == 0) goto invalid;
+      sc->max_connections = n;
+      continue;
+    }
+
+    if (ngx_strncmp(value[i].data, "slow_start=", 11) == 0) {
+      ngx_str_t s;
+      s.len = value[i].len - 11;
+      s.data = &value[i].data[11];
+      ngx_int_t n = parse_msec(&s);
+      if (n == NGX_ERROR || n == 0) goto invalid;
+      sc->slow_start = n;
+      continue;
+    }
+
+    goto invalid;
+  }
+
+  return NGX_CONF_OK;
+
+invalid:
+  ngx_conf_log_error( NGX_LOG_EMERG
+                    , cf
+                    , 0
+                    , "invalid parameter \"%V\" in \"%V\" directive"
+                    , &value[i]
+                    , &cmd->name
+                    );
+  return NGX_CONF_ERROR;
+}
+
+/* max_connections_queue_class name [max_queue_length=N] [queue_timeout=T]
+ *                             [weight=N]; 
+ * Classes are in order of priority, the first one highest. */
+static char *
+max_connections_queue_class_command (ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_http_upstream_srv_conf_t *uscf = 
+    ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+  max_connections_srv_conf_t *maxconn_cf = 
+    ngx_http_conf_upstream_srv_conf(uscf, max_connections_module);
+
+  ngx_str_t *value = cf->args->elts;
+  max_connections_queue_t *queue = maxconn_cf->queues->elts;
+  ngx_uint_t i;
+
+  for (i = 0; i < maxconn_cf->queues->nelts; i++) {
+    if (queue[i].name.len == value[1].len
+     && ngx_strncmp(queue[i].name.data, value[1].data, value[1].len) == 0
+       ) return "is duplicate";
+  }
+
+  queue = ngx_array_push(maxconn_cf->queues);
+  if (queue == NULL) return NGX_CONF_ERROR;
+  ngx_memzero(queue, sizeof(max_connections_queue_t));
+
+  queue->name = value[1];
+  queue->weight = 1;
+
+  for (i = 2; i < cf->args->nelts; i++) {
+
+    if (ngx_strncmp(value[i].data, "max_queue_length=", 17) == 0) {
+      ngx_int_t n = ngx_atoi(&value[i].data[17], value[i].len - 17);
+      if (n == NGX_ERROR || n == 0) goto invalid;
+      queue->max_queue_length = n;
+      continue;
+    }
+
+    if (ngx_strncmp(value[i].data, "queue_timeout=", 14) == 0) {
+      ngx_str_t s;
+      s.len = value[i].len - 14;
+      s.data = &value[i].data[14];
+
+      ngx_msec_t ms = ngx_parse_time(&s, 0);
+      if (ms == (ngx_msec_t) NGX_ERROR || ms == (ngx_msec_t) NGX_PARSE_LARGE_TIME) 
+        goto invalid;
+      queue->queue_timeout = ms;
+      continue;
+    }
+
+    if (ngx_strncmp(value[i].data, "weight=", 7) == 0) {
+      ngx_int_t n = ngx_atoi(&value[i].data[7], value[i].len - 7);
+      if (n == NGX_ERROR || n == 0) goto invalid;
+      queue->weight = n;
+      continue;
+    }
+
+    goto invalid;
+  }
+
+  return NGX_CONF_OK;
+
+invalid:
+  ngx_conf_log_error( NGX_LOG_EMERG
+                    , cf
+                    , 0
+                    , "invalid parameter \"%V\" in \"%V\" directive"
+                    , &value[i]
+                    , &cmd->name
+                    );
+  return NGX_CONF_ERROR;
+}
+
+/* max_connections_queue_policy strict|weighted; */
+static char *
+max_connections_queue_policy_command (ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_http_upstream_srv_conf_t *uscf = 
+    ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+  max_connections_srv_conf_t *maxconn_cf = 
+    ngx_http_conf_upstream_srv_conf(uscf, max_connections_module);
+
+  ngx_str_t *value = cf->args->elts;
+
+  if (ngx_strcmp(value[1].data, "strict") == 0) {
+    maxconn_cf->queue_policy = QUEUE_POLICY_STRICT;
+  } else if (ngx_strcmp(value[1].data, "weighted") == 0) {
+    maxconn_cf->queue_policy = QUEUE_POLICY_WEIGHTED;
+  } else {
+    return "must be \"strict\" or \"weighted\"";
+  }
+
+  return NGX_CONF_OK;
+}
+
+/* max_connections_queue_mode fifo|lifo|adaptive [lifo_after=T]; */
+static char *
+max_connections_queue_mode_command (ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_http_upstream_srv_conf_t *uscf = 
+    ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+  max_connections_srv_conf_t *maxconn_cf = 
+    ngx_http_conf_upstream_srv_conf(uscf, max_connections_module);
+
+  ngx_str_t *value = cf->args->elts;
+
+  if (ngx_strcmp(value[1].data, "fifo") == 0) {
+    maxconn_cf->queue_mode = QUEUE_MODE_FIFO;
+  } else if (ngx_strcmp(value[1].data, "lifo") == 0) {
+    maxconn_cf->queue_mode = QUEUE_MODE_LIFO;
+  } else if (ngx_strcmp(value[1].data, "adaptive") == 0) {
+    maxconn_cf->queue_mode = QUEUE_MODE_ADAPTIVE;
+  } else {
+    return "must be \"fifo\", \"lifo\" or \"adaptive\"";
+  }
+
+  if (cf->args->nelts == 3) {
+    if ( maxconn_cf->queue_mode != QUEUE_MODE_ADAPTIVE
+      || ngx_strncmp(value[2].data, "lifo_after=", 11) != 0
+       ) {
+      return "takes lifo_after= only with \"adaptive\"";
+    }
+
+    ngx_str_t s;
+    s.len = value[2].len - 11;
+    s.data = &value[2].data[11];
+    ngx_int_t n = parse_msec(&s);
+    if (n == NGX_ERROR) return "has an invalid lifo_after=";
+    maxconn_cf->lifo_after = n;
+  }
+
+  return NGX_CONF_OK;
+}
+
+/* max_connections_dispatch_batch N; */
+static char *
+max_connections_dispatch_batch_command (ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_http_upstream_srv_conf_t *uscf = 
+    ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+  max_connections_srv_conf_t *maxconn_cf = 
+    ngx_http_conf_upstream_srv_conf(uscf, max_connections_module);
+
+  ngx_str_t *value = cf->args->elts;
+  ngx_int_t n = ngx_atoi(value[1].data, value[1].len);
+  if (n == NGX_ERROR) {
+    return "invalid number";        
+  }
+
+  maxconn_cf->dispatch_batch = n;
+
+  return NGX_CONF_OK;
+}
+
+/* max_connections_health_check [interval=1s] [timeout=1s] [path=/]
+ *                              [fall=3] [rise=2]; 
+ * timeout defaults to the interval. */
+static char *
+max_connections_health_check_command (ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_http_upstream_srv_conf_t *uscf = 
+    ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+  max_connections_srv_conf_t *maxconn_cf = 
+    ngx_http_conf_upstream_srv_conf(uscf, max_connections_module);
+
+  ngx_str_t *value = cf->args->elts;
+  ngx_str_t s;
+  ngx_uint_t i;
+  ngx_int_t n;
+
+  maxconn_cf->check_interval = 1000;
+  maxconn_cf->check_timeout = NGX_CONF_UNSET_MSEC;
+  maxconn_cf->check_path.len = 1;
+  maxconn_cf->check_path.data = (u_char *) "/";
+  maxconn_cf->check_fall = 3;
+  maxconn_cf->check_rise = 2;
+
+  for (i = 1; i < cf->args->nelts; i++) {
+
+    if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+      s.len = value[i].len - 9;
+      s.data = &value[i].data[9];
+      n = parse_msec(&s);
+      if (n == NGX_ERROR || n == 0) goto invalid;
+      maxconn_cf->check_interval = n;
+      continue;
+    }
+
+    if (ngx_strncmp(value[i].data, "timeout=", 8) == 0) {
+      s.len = value[i].len - 8;
+      s.data = &value[i].data[8];
+      n = parse_msec(&s);
+      if (n == NGX_ERROR || n == 0) goto invalid;
+      maxconn_cf->check_timeout = n;
+      continue;
+    }
+
+    if (ngx_strncmp(value[i].data, "path=", 5) == 0) {
+      if (value[i].len == 5 || value[i].data[5] != '/') goto invalid;
+      maxconn_cf->check_path.len = value[i].len - 5;
+      maxconn_cf->check_path.data = &value[i].data[5];
+      continue;
+    }
+
+    if (ngx_strncmp(value[i].data, "fall=", 5) == 0) {
+      n = ngx_atoi(&value[i].data[5], value[i].len - 5);
+      if (n == NGX_ERROR || n == 0) goto invalid;
+      maxconn_cf->check_fall = n;
+      continue;
+    }
+
+    if (ngx_strncmp(value[i].data, "rise=", 5) == 0) {
+      n = ngx_atoi(&value[i].data[5], value[i].len - 5);
+      if (n == NGX_ERROR || n == 0) goto invalid;
+      maxconn_cf->check_rise = n;
+      continue;
+    }
+
+    goto invalid;
+  }
+
+  if (maxconn_cf->check_timeout == NGX_CONF_UNSET_MSEC) 
+    maxconn_cf->check_timeout = maxconn_cf->check_interval;
+
+  return NGX_CONF_OK;
+
+invalid:
+  ngx_conf_log_error( NGX_LOG_EMERG
+                    , cf
+                    , 0
+                    , "invalid parameter \"%V\""
+                    , &value[i]
+                    );
+  return NGX_CONF_ERROR;
+}
+
+/* max_connections_circuit_breaker [errors=50%] [latency=T] [window=10s]
+ *                                 [min_requests=20] [open=30s]; */
+static char *
+max_connections_circuit_breaker_command (ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_http_upstream_srv_conf_t *uscf = 
+    ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+  max_connections_srv_conf_t *maxconn_cf = 
+    ngx_http_conf_upstream_srv_conf(uscf, max_connections_module);
+
+  ngx_str_t *value = cf->args->elts;
+  ngx_str_t s;
+  ngx_uint_t i;
+  ngx_int_t n;
+
+  maxconn_cf->circuit_window = 10000;
+  maxconn_cf->circuit_errors = 50;
+  maxconn_cf->circuit_latency = 0;
+  maxconn_cf->circuit_min_requests = 20;
+  maxconn_cf->circuit_open = 30000;
+
+  for (i = 1; i < cf->args->nelts; i++) {
+
+    if (ngx_strncmp(value[i].data, "errors=", 7) == 0) {
+      s.len = value[i].len - 7;
+      s.data = &value[i].data[7];
+      if (s.len && s.data[s.len - 1] == '%') s.len--;
+      n = ngx_atoi(s.data, s.len);
+      if (n == NGX_ERROR || n == 0 || n > 100) goto invalid;
+      maxconn_cf->circuit_errors = n;
+      continue;
+    }
+
+    if (ngx_strncmp(value[i].data, "latency=", 8) == 0) {
+      s.len = value[i].len - 8;
+      s.data = &value[i].data[8];
+      n = parse_msec(&s);
+      if (n == NGX_ERROR || n == 0) goto invalid;
+      maxconn_cf->circuit_latency = n;
+      continue;
+    }
+
+    if (ngx_strncmp(value[i].data, "window=", 7) == 0) {
+      s.len = value[i].len - 7;
+      s.data = &value[i].data[7];
+      n = parse_msec(&s);
+      if (n == NGX_ERROR || n == 0) goto invalid;
+      maxconn_cf->circuit_window = n;
+      continue;
+    }
+
+    if (ngx_strncmp(value[i].data, "min_requests=", 13) == 0) {
+      n = ngx_atoi(&value[i].data[13], value[i].len - 13);
+      if (n == NGX_ERROR || n == 0) goto invalid;
+      maxconn_cf->circuit_min_requests = n;
+      continue;
+    }
+
+    if (ngx_strncmp(value[i].data, "open=", 5) == 0) {
+      s.len = value[i].len - 5;
+      s.data = &value[i].data[5];
+      n = parse_msec(&s);
+      if (n == NGX_ERROR || n == 0) goto invalid;
+      maxconn_cf->circuit_open = n;
+      continue;
+    }
+
+    goto invalid;
+  }
+
+  return NGX_CONF_OK;
+
+invalid:
+  ngx_conf_log_error( NGX_LOG_EMERG
+                    , cf
+                    , 0
+                    , "invalid parameter \"%V\""
+                    , &value[i]
+                    );
+  return NGX_CONF_ERROR;
+}
+
+/* max_connections_pool name; */
+static char *
+max_connections_pool_command (ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_http_upstream_srv_conf_t *uscf = 
+    ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+  max_connections_srv_conf_t *maxconn_cf = 
+    ngx_http_conf_upstream_srv_conf(uscf, max_connections_module);
+
+  ngx_str_t *value = cf->args->elts;
+
+  if (maxconn_cf->pool.len) {
+    return "is duplicate";
+  }
+
+  maxconn_cf->pool = value[1];
+
+  return NGX_CONF_OK;
+}
+
+/* max_connections_priority $variable; */
+static char *
+max_connections_priority_command (ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_http_upstream_srv_conf_t *uscf = 
+    ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+  max_connections_srv_conf_t *maxconn_cf = 
+    ngx_http_conf_upstream_srv_conf(uscf, max_connections_module);
+
+  ngx_str_t *value = cf->args->elts;
+
+  if (value[1].len < 2 || value[1].data[0] != '$') {
+    return "must be a variable";
+  }
+
+  value[1].len--;
+  value[1].data++;
+
+  maxconn_cf->priority_index = ngx_http_get_variable_index(cf, &value[1]);
+  if (maxconn_cf->priority_index == NGX_ERROR) return NGX_CONF_ERROR;
+
+  return NGX_CONF_OK;
+}
+
+/* max_connections_queue_timeout_variable $variable; */
+static char *
+max_connections_queue_timeout_variable_command (ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_http_upstream_srv_conf_t *uscf = 
+    ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+  max_connections_srv_conf_t *maxconn_cf = 
+    ngx_http_conf_upstream_srv_conf(uscf, max_connections_module);
+
+  ngx_str_t *value = cf->args->elts;
+
+  if (value[1].len < 2 || value[1].data[0] != '$') {
+    return "must be a variable";
+  }
+
+  value[1].len--;
+  value[1].data++;
+
+  maxconn_cf->timeout_index = ngx_http_get_variable_index(cf, &value[1]);
+  if (maxconn_cf->timeout_index == NGX_ERROR) return NGX_CONF_ERROR;
+
+  return NGX_CONF_OK;
+}
+
+/* max_connections_client_closure hold [500ms] | drain [60s] | release; */
+static char *
+max_connections_client_closure_command (ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_http_upstream_srv_conf_t *uscf = 
+    ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+  max_connections_srv_conf_t *maxconn_cf = 
+    ngx_http_conf_upstream_srv_conf(uscf, max_connections_module);
+
+  ngx_str_t *value = cf->args->elts;
+
+  if (ngx_strcmp(value[1].data, "hold") == 0) {
+    maxconn_cf->client_closure = CLOSURE_HOLD;
+    maxconn_cf->closure_timeout = CLIENT_CLOSURE_SLEEP;
+  } else if (ngx_strcmp(value[1].data, "drain") == 0) {
+    maxconn_cf->client_closure = CLOSURE_DRAIN;
+    maxconn_cf->closure_timeout = CLIENT_CLOSURE_DRAIN;
+  } else if (ngx_strcmp(value[1].data, "release") == 0) {
+    maxconn_cf->client_closure = CLOSURE_RELEASE;
+    if (cf->args->nelts == 3) return "takes no time with \"release\"";
+  } else {
+    return "must be \"hold\", \"drain\" or \"release\"";
+  }
+
+  if (cf->args->nelts == 3) {
+    ngx_int_t n = parse_msec(&value[2]);
+    if (n == NGX_ERROR || n == 0) return "has an invalid time";
+    maxconn_cf->closure_timeout = n;
+  }
+
+  return NGX_CONF_OK;
+}
+
+/* max_connections_hash $key [bounded=1.25]; */
+static char *
+max_connections_hash_command (ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_http_upstream_srv_conf_t *uscf = 
+    ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+  max_connections_srv_conf_t *maxconn_cf = 
+    ngx_http_conf_upstream_srv_conf(uscf, max_connections_module);
+
+  ngx_str_t *value = cf->args->elts;
+
+  if (value[1].len < 2 || value[1].data[0] != '$') {
+    return "must be a variable";
+  }
+
+  value[1].len--;
+  value[1].data++;
+
+  maxconn_cf->hash_index = ngx_http_get_variable_index(cf, &value[1]);
+  if (maxconn_cf->hash_index == NGX_ERROR) return NGX_CONF_ERROR;
+
+  if (cf->args->nelts == 3) {
+    if (ngx_strncmp(value[2].data, "bounded=", 8) != 0) {
+      return "takes only bounded=";
+    }
+
+    /* a factor such as 1.25, kept in hundredths */
+    u_char *p = value[2].data + 8, *last = value[2].data + value[2].len;
+    ngx_uint_t bound = 0, scale = HASH_ONE;
+
+    if (p == last) return "has an invalid bounded=";
+    for ( ; p < last && *p != '.'; p++) {
+      if (*p < '0' || *p > '9') return "has an invalid bounded=";
+      bound = bound * 10 + (*p - '0');
+    }
+    bound *= HASH_ONE;
+    if (p < last) {
+      for (p++; p < last; p++) {
+        if (*p < '0' || *p > '9') return "has an invalid bounded=";
+        scale /= 10;
+        bound += (*p - '0') * scale;
+      }
+    }
+
+    if (bound < HASH_ONE) return "must have bounded= of at least 1";
+    maxconn_cf->hash_bound = bound;
+  }
+
+  return NGX_CONF_OK;
+}
+
+static ngx_conf_bitmask_t max_connections_hedge_methods[] = 
+  { { ngx_string("GET"), NGX_HTTP_GET }
+  , { ngx_string("HEAD"), NGX_HTTP_HEAD }
+  , { ngx_string("PUT"), NGX_HTTP_PUT }
+  , { ngx_string("DELETE"), NGX_HTTP_DELETE }
+  , { ngx_null_string, 0 }
+  };
+
+/* max_connections_hedge after=200ms|p95 [methods=GET,HEAD] [max=1] [budget=10%]; */
+static char *
+max_connections_hedge_command (ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_http_upstream_srv_conf_t *uscf = 
+    ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+  max_connections_srv_conf_t *maxconn_cf = 
+    ngx_http_conf_upstream_srv_conf(uscf, max_connections_module);
+
+  ngx_str_t *value = cf->args->elts;
+  ngx_str_t s;
+  ngx_uint_t i, m;
+  ngx_int_t n;
+  u_char *p, *last;
+
+  maxconn_cf->hedge_methods = NGX_HTTP_GET|NGX_HTTP_HEAD;
+  maxconn_cf->hedge_max = 1;
+  maxconn_cf->hedge_budget = 10;
+
+  for (i = 1; i < cf->args->nelts; i++) {
+    if (ngx_strncmp(value[i].data, "after=p", 7) == 0) {
+      n = ngx_atoi(value[i].data + 7, value[i].len - 7);
+      if (n == NGX_ERROR || n == 0 || n > 99) goto invalid;
+      maxconn_cf->hedge_percentile = n;
+      continue;
+    }
+
+    if (ngx_strncmp(value[i].data, "after=", 6) == 0) {
+      s.len = value[i].len - 6;
+      s.data = &value[i].data[6];
+      n = parse_msec(&s);
+      if (n == NGX_ERROR || n == 0) goto invalid;
+      maxconn_cf->hedge_after = n;
+      continue;
+    }
+
+    if (ngx_strncmp(value[i].data, "methods=", 8) == 0) {
+      maxconn_cf->hedge_methods = 0;
+      p = value[i].data + 8;
+      last = value[i].data + value[i].len;
+
+      while (p < last) {
+        u_char *comma = p;
+        while (comma < last && *comma != ',') comma++;
+
+        for (m = 0; max_connections_hedge_methods[m].name.len; m++) {
+          if ( max_connections_hedge_methods[m].name.len == (size_t) (comma - p)
+            && ngx_strncmp(max_connections_hedge_methods[m].name.data, p, comma - p) == 0
+             ) break;
+        }
+        if (max_connections_hedge_methods[m].name.len == 0) goto invalid;
+        maxconn_cf->hedge_methods |= max_connections_hedge_methods[m].mask;
+
+        p = comma + 1;
+      }
+      if (maxconn_cf->hedge_methods == 0) goto invalid;
+      continue;
+    }
+
+    if (ngx_strncmp(value[i].data, "max=", 4) == 0) {
+      n = ngx_atoi(value[i].data + 4, value[i].len - 4);
+      if (n == NGX_ERROR || n == 0) goto invalid;
+      maxconn_cf->hedge_max = n;
+      continue;
+    }
+
+    if (ngx_strncmp(value[i].data, "budget=", 7) == 0 
+     && value[i].data[value[i].len - 1] == '%'
+       ) {
+      n = ngx_atoi(value[i].data + 7, value[i].len - 8);
+      if (n == NGX_ERROR || n == 0 || n > 100) goto invalid;
+      maxconn_cf->hedge_budget = n;
+      continue;
     }
 
-    pc->tries = 0;
-    goto dispatch;
+    goto invalid;
   }
 
-  if(pc) 
-    pc->tries--;
-
-  if(backend) {
-    assert(backend->connections > 0);
-    backend->connections--; /* free the slot */
-    ngx_log_error( NGX_LOG_INFO
-                  , peer_data->r->connection->log
-                  , 0
-                  , "max_connections recv client from %V (now %ui connections)"
-                  , backend->name
-                  , backend->connections
-                  );
+  if (maxconn_cf->hedge_after == 0 && maxconn_cf->hedge_percentile == 0) {
+    return "needs after=";
   }
 
-  /* previous connection failed (state & NGX_PEER_FAILED) or either the
-   * connection failed, or it succeeded but the application returned an
-   * error (state & NGX_PEER_NEXT) 
-   */ 
-  if(state & NGX_PEER_FAILED) {
-    ngx_log_error( NGX_LOG_INFO
-                  , pc->log
-                  , 0
-                  , "max_connections %V failed "
-                  , backend->name
-                  );
-    peer_data->backend->accessed = ngx_time();
-    peer_data->backend->fails++;
-    peer_data->backend = NULL;
-
-    /* this forces a backend even if it's maxconn is full */
-    peer_data->really_needs_backend = 1; 
+  /* start with a full budget */
+  maxconn_cf->hedge_tokens = HEDGE_BURST * HEDGE_COST;
+  return NGX_CONF_OK;
 
-    if(upstreams_are_all_dead(maxconn_cf)) {
-      pc->tries = 0; /* kill this request */
-      ngx_log_error( NGX_LOG_INFO
-                    , pc->log
+invalid:
+  ngx_conf_log_error( NGX_LOG_EMERG
+                    , cf
                     , 0
-                    , "max_connections all backends are dead. killing request."
+                    , "invalid parameter \"%V\""
+                    , &value[i]
                     );
-    }
+  return NGX_CONF_ERROR;
+}
 
-    return;
-  }
+/* max_connections_deadline_headers [start=X-Queue-Start] [remaining=X-Queue-Remaining]; */
+static char *
+max_connections_deadline_headers_command (ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_http_upstream_srv_conf_t *uscf = 
+    ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
 
-  /*
-  if (state & NGX_PEER_NEXT) {
-    assert(0 && "TODO just get the next host");
+  max_connections_srv_conf_t *maxconn_cf = 
+    ngx_http_conf_upstream_srv_conf(uscf, max_connections_module);
+
+  ngx_str_t *value = cf->args->elts;
+  ngx_uint_t i;
+
+  if (cf->args->nelts == 1) {
+    maxconn_cf->deadline_start.len = sizeof("X-Queue-Start") - 1;
+    maxconn_cf->deadline_start.data = (u_char *) "X-Queue-Start";
+    maxconn_cf->deadline_remaining.len = sizeof("X-Queue-Remaining") - 1;
+    maxconn_cf->deadline_remaining.data = (u_char *) "X-Queue-Remaining";
+    return NGX_CONF_OK;
   }
-  */
 
-  peer_data->backend = NULL;
+  for (i = 1; i < cf->args->nelts; i++) {
+    if (ngx_strncmp(value[i].data, "start=", 6) == 0 && value[i].len > 6) {
+      maxconn_cf->deadline_start.len = value[i].len - 6;
+      maxconn_cf->deadline_start.data = value[i].data + 6;
+      continue;
+    }
 
-dispatch:
-  dispatch(maxconn_cf);
+    if (ngx_strncmp(value[i].data, "remaining=", 10) == 0 && value[i].len > 10) {
+      maxconn_cf->deadline_remaining.len = value[i].len - 10;
+      maxconn_cf->deadline_remaining.data = value[i].data + 10;
+      continue;
+    }
+
+    ngx_conf_log_error( NGX_LOG_EMERG
+                      , cf
+                      , 0
+                      , "invalid parameter \"%V\""
+                      , &value[i]
+                      );
+    return NGX_CONF_ERROR;
+  }
+
+  return NGX_CONF_OK;
 }
 
-static ngx_int_t
-peer_get (ngx_peer_connection_t *pc, void *data)
+/* max_connections_balance least_conn | p2c_ewma; */
+static char *
+max_connections_balance_command (ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-  max_connections_peer_data_t *peer_data = data;
-  max_connections_srv_conf_t *maxconn_cf = peer_data->maxconn_cf;
-
-  assert(peer_data->queue.next == NULL && "should not be in the queue");
-  assert(peer_data->queue.prev == NULL && "should not be in the queue");
+  ngx_http_upstream_srv_conf_t *uscf = 
+    ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
 
-  max_connections_backend_t *backend = 
-    find_upstream(maxconn_cf, peer_data->really_needs_backend);
-  assert(backend != NULL && "should always be an availible backend in peer_get()");
-  assert(peer_data->backend == NULL);
+  max_connections_srv_conf_t *maxconn_cf = 
+    ngx_http_conf_upstream_srv_conf(uscf, max_connections_module);
 
-  peer_data->backend = backend;
-  backend->connections++; /* keep track of how many slots are occupied */
+  ngx_str_t *value = cf->args->elts;
 
-  pc->sockaddr = backend->sockaddr;
-  pc->socklen  = backend->socklen;
-  pc->name     = backend->name;
+  if (ngx_strcmp(value[1].data, "least_conn") == 0) {
+    maxconn_cf->balance = BALANCE_LEAST_CONN;
+  } else if (ngx_strcmp(value[1].data, "p2c_ewma") == 0) {
+    maxconn_cf->balance = BALANCE_P2C_EWMA;
+  } else {
+    return "must be \"least_conn\" or \"p2c_ewma\"";
+  }
 
-  ngx_log_error( NGX_LOG_INFO
-                , pc->log
-                , 0
-                , "max_connections sending client to %V (now %ui connections)"
-                , pc->name
-                , backend->connections
-                );
-  return NGX_OK;
+  return NGX_CONF_OK;
 }
 
-static ngx_int_t
-peer_init (ngx_http_request_t *r, ngx_http_upstream_srv_conf_t *uscf)
+/* max_connections_fair_key $key [flows=1024] [quantum=1] [max_inflight=N]; */
+static char *
+max_connections_fair_key_command (ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
+  ngx_http_upstream_srv_conf_t *uscf = 
+    ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
   max_connections_srv_conf_t *maxconn_cf = 
     ngx_http_conf_upstream_srv_conf(uscf, max_connections_module);
 
-  max_connections_peer_data_t *peer_data = 
-    ngx_palloc(r->pool, sizeof(max_connections_peer_data_t));
-  if(peer_data == NULL) return NGX_ERROR;
+  ngx_str_t *value = cf->args->elts;
+  ngx_uint_t i;
+  ngx_int_t n;
 
-  peer_data->backend = NULL;
-  peer_data->maxconn_cf = maxconn_cf;
-  peer_data->r = r;
-  peer_data->accessed = ngx_current_msec; 
-  peer_data->really_needs_backend = 0;
+  if (value[1].len < 2 || value[1].data[0] != '$') {
+    return "must be a variable";
+  }
 
-  r->upstream->peer.free  = peer_free;
-  r->upstream->peer.get   = peer_get;
-  r->upstream->peer.tries = maxconn_cf->backends->nelts;
-  r->upstream->peer.data  = peer_data;
+  value[1].len--;
+  value[1].data++;
 
-  if(queue_push(maxconn_cf, peer_data) == NGX_ERROR)
-    return NGX_ERROR;
+  maxconn_cf->fair_index = ngx_http_get_variable_index(cf, &value[1]);
+  if (maxconn_cf->fair_index == NGX_ERROR) return NGX_CONF_ERROR;
 
-  dispatch(peer_data->maxconn_cf);
+  maxconn_cf->fair_flows = FAIR_FLOWS;
+  maxconn_cf->fair_quantum = 1;
+  maxconn_cf->fair_max_inflight = 0;
 
-  return NGX_BUSY;
+  for (i = 2; i < cf->args->nelts; i++) {
+    if (ngx_strncmp(value[i].data, "flows=", 6) == 0) {
+      n = ngx_atoi(value[i].data + 6, value[i].len - 6);
+      if (n == NGX_ERROR || n == 0) goto invalid;
+      maxconn_cf->fair_flows = n;
+      continue;
+    }
+
+    if (ngx_strncmp(value[i].data, "quantum=", 8) == 0) {
+      n = ngx_atoi(value[i].data + 8, value[i].len - 8);
+      if (n == NGX_ERROR || n == 0) goto invalid;
+      maxconn_cf->fair_quantum = n;
+      continue;
+    }
+
+    if (ngx_strncmp(value[i].data, "max_inflight=", 13) == 0) {
+      n = ngx_atoi(value[i].data + 13, value[i].len - 13);
+      if (n == NGX_ERROR || n == 0) goto invalid;
+      maxconn_cf->fair_max_inflight = n;
+      continue;
+    }
+
+    goto invalid;
+  }
+
+  return NGX_CONF_OK;
+
+invalid:
+  ngx_conf_log_error( NGX_LOG_EMERG
+                    , cf
+                    , 0
+                    , "invalid parameter \"%V\""
+                    , &value[i]
+                    );
+  return NGX_CONF_ERROR;
 }
 
-static ngx_int_t
-max_connections_init(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *uscf)
+/* max_connections_admission off | predict | codel [target=5ms] [interval=100ms]; */
+static char *
+max_connections_admission_command (ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-  ngx_log_error( NGX_LOG_INFO
-                , cf->log
-                , 0
-                , "max_connections_init"
-                );
+  ngx_http_upstream_srv_conf_t *uscf = 
+    ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
 
   max_connections_srv_conf_t *maxconn_cf = 
     ngx_http_conf_upstream_srv_conf(uscf, max_connections_module);
 
-  /* allocate all the max_connections_backend_t. put them in
-   * maxconn_cf->backends */
-  if(uscf->servers == NULL) return NGX_ERROR;
-  ngx_http_upstream_server_t *server = uscf->servers->elts;
-  ngx_uint_t i, j;
-  ngx_uint_t number_backends = 0;
+  ngx_str_t *value = cf->args->elts;
+  ngx_str_t s;
+  ngx_uint_t i;
+  ngx_int_t n;
 
-  for (i = 0; i < uscf->servers->nelts; i++) 
-      number_backends += server[i].naddrs;
+  if (ngx_strcmp(value[1].data, "off") == 0) {
+    maxconn_cf->admission = ADMISSION_OFF;
+  } else if (ngx_strcmp(value[1].data, "predict") == 0) {
+    maxconn_cf->admission = ADMISSION_PREDICT;
+  } else if (ngx_strcmp(value[1].data, "codel") == 0) {
+    maxconn_cf->admission = ADMISSION_CODEL;
+  } else {
+    i = 1;
+    goto invalid;
+  }
 
-  ngx_array_t *backends = 
-    ngx_array_create(cf->pool, number_backends, sizeof(max_connections_backend_t));
-  if (backends == NULL) return NGX_ERROR;
+  maxconn_cf->codel_target = 5;
+  maxconn_cf->codel_interval = 100;
 
-  /* one hostname can have multiple IP addresses in DNS */
-  ngx_uint_t n;
-  for (n = 0, i = 0; i < uscf->servers->nelts; i++) {
-    for (j = 0; j < server[i].naddrs; j++, n++) {
-      max_connections_backend_t *backend = ngx_array_push(backends);
-      backend->sockaddr     = server[i].addrs[j].sockaddr;
-      backend->socklen      = server[i].addrs[j].socklen;
-      backend->name         = &(server[i].addrs[j].name);
-      backend->max_fails    = server[i].max_fails;
-      backend->fail_timeout = server[i].fail_timeout;
-      backend->down         = server[i].down;
-      backend->weight       = server[i].down ? 0 : server[i].weight;
-      backend->connections  = 0;
+  for (i = 2; i < cf->args->nelts; i++) {
+    if (maxconn_cf->admission != ADMISSION_CODEL) goto invalid;
 
-      backend->disconnect_event.handler = recover_from_client_closure;
-      backend->disconnect_event.log = cf->log;
-      backend->disconnect_event.data = backend;
-      backend->maxconn_cf = maxconn_cf;
+    if (ngx_strncmp(value[i].data, "target=", 7) == 0) {
+      s.len = value[i].len - 7;
+      s.data = &value[i].data[7];
+      n = parse_msec(&s);
+      if (n == NGX_ERROR || n == 0) goto invalid;
+      maxconn_cf->codel_target = n;
+      continue;
     }
-  }
-  maxconn_cf->backends = backends;
 
-  uscf->peer.init = peer_init;
+    if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+      s.len = value[i].len - 9;
+      s.data = &value[i].data[9];
+      n = parse_msec(&s);
+      if (n == NGX_ERROR || n == 0) goto invalid;
+      maxconn_cf->codel_interval = n;
+      continue;
+    }
 
-  ngx_queue_init(&maxconn_cf->waiting_requests);
-  assert(ngx_queue_empty(&maxconn_cf->waiting_requests));
+    goto invalid;
+  }
 
-  maxconn_cf->queue_check_event.handler = queue_check_event;
-  maxconn_cf->queue_check_event.log = cf->log;
-  maxconn_cf->queue_check_event.data = maxconn_cf;
+  return NGX_CONF_OK;
 
-  return NGX_OK;
+invalid:
+  ngx_conf_log_error( NGX_LOG_EMERG
+                    , cf
+                    , 0
+                    , "invalid parameter \"%V\""
+                    , &value[i]
+                    );
+  return NGX_CONF_ERROR;
 }
 
-/* TODO This function is probably not neccesary. Nginx provides a means of
- * easily setting scalar time values with ngx_conf_set_msec_slot() in the
- * ngx_command_t structure. I couldn't manage to make it work, not knowing
- * what I should be using for the two offset parameters. 
- */ 
+/* max_connections_reject_status code [retry_after=T]; */
 static char *
-max_connections_queue_timeout_command (ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+max_connections_reject_status_command (ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
   ngx_http_upstream_srv_conf_t *uscf = 
     ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
@@ -591,27 +4605,33 @@ max_connections_queue_timeout_command (ngx_conf_t *cf, ngx_command_t *cmd, void
   max_connections_srv_conf_t *maxconn_cf = 
     ngx_http_conf_upstream_srv_conf(uscf, max_connections_module);
 
-  ngx_str_t        *value; 
-
-  value = cf->args->elts;    
+  ngx_str_t *value = cf->args->elts;
 
-  ngx_msec_t ms = ngx_parse_time(&value[1], 0); 
-  if (ms == (ngx_msec_t) NGX_ERROR) {
-      return "invalid value";
+  ngx_int_t n = ngx_atoi(value[1].data, value[1].len);
+  if (n == NGX_ERROR || n < 400 || n > 599) {
+    return "must be between 400 and 599";
   }
+  maxconn_cf->reject_status = n;
 
-  if (ms == (ngx_msec_t) NGX_PARSE_LARGE_TIME) {
-      return "value must be less than 597 hours";
-  }
+  if (cf->args->nelts == 3) {
+    if (ngx_strncmp(value[2].data, "retry_after=", 12) != 0) {
+      return "takes only retry_after=";
+    }
 
-  maxconn_cf->queue_timeout = ms;
+    ngx_str_t s;
+    s.len = value[2].len - 12;
+    s.data = &value[2].data[12];
+    time_t sec = ngx_parse_time(&s, 1);
+    if (sec == NGX_ERROR || sec == NGX_PARSE_LARGE_TIME) return "has an invalid retry_after=";
+    maxconn_cf->retry_after = sec;
+  }
 
   return NGX_CONF_OK;
 }
 
-/* TODO same as above */
+/* max_connections_expire_status code; */
 static char *
-max_connections_max_queue_length_command (ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+max_connections_expire_status_command (ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
   ngx_http_upstream_srv_conf_t *uscf = 
     ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
@@ -619,13 +4639,51 @@ max_connections_max_queue_length_command (ngx_conf_t *cf, ngx_command_t *cmd, vo
   max_connections_srv_conf_t *maxconn_cf = 
     ngx_http_conf_upstream_srv_conf(uscf, max_connections_module);
 
-  ngx_str_t *value = cf->args->elts;    
+  ngx_str_t *value = cf->args->elts;
+
   ngx_int_t n = ngx_atoi(value[1].data, value[1].len);
-  if (n == NGX_ERROR) {
-    return "invalid number";        
+  if (n == NGX_ERROR || n < 400 || n > 599) {
+    return "must be between 400 and 599";
   }
+  maxconn_cf->expire_status = n;
 
-  maxconn_cf->max_queue_length = n;
+  return NGX_CONF_OK;
+}
+
+/* max_connections_overflow upstream [when=queue_full|when=predicted_wait>T];
+ * the upstream is looked up in max_connections_init(), as it may be
+ * defined further down. */
+static char *
+max_connections_overflow_command (ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_http_upstream_srv_conf_t *uscf = 
+    ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+  max_connections_srv_conf_t *maxconn_cf = 
+    ngx_http_conf_upstream_srv_conf(uscf, max_connections_module);
+
+  ngx_str_t *value = cf->args->elts;
+
+  if (maxconn_cf->overflow_name.len) return "is duplicate";
+
+  maxconn_cf->overflow_name = value[1];
+
+  if (cf->args->nelts == 3) {
+    if (ngx_strcmp(value[2].data, "when=queue_full") == 0) {
+      return NGX_CONF_OK;
+    }
+
+    if (ngx_strncmp(value[2].data, "when=predicted_wait>", 20) != 0) {
+      return "takes only when=queue_full or when=predicted_wait>T";
+    }
+
+    ngx_str_t s;
+    s.len = value[2].len - 20;
+    s.data = &value[2].data[20];
+    ngx_int_t ms = parse_msec(&s);
+    if (ms == NGX_ERROR || ms == 0) return "has an invalid predicted_wait>";
+    maxconn_cf->overflow_wait = ms;
+  }
 
   return NGX_CONF_OK;
 }
@@ -639,26 +4697,64 @@ max_connections_command (ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
   uscf->peer.init_upstream = max_connections_init;
 
   ngx_str_t *value = cf->args->elts;
-  ngx_int_t max_connections = ngx_atoi(value[1].data, value[1].len);
-
-  if (max_connections == NGX_ERROR || max_connections == 0) {
-    ngx_conf_log_error( NGX_LOG_EMERG
-                      , cf
-                      , 0
-                      , "invalid value \"%V\" in \"%V\" directive"
-                      , &value[1]
-                      , &cmd->name
-                      );
-    return NGX_CONF_ERROR;
-  }
+  ngx_uint_t i = 1;
 
   max_connections_srv_conf_t *maxconn_cf = 
     ngx_http_conf_upstream_srv_conf(uscf, max_connections_module);
+  maxconn_cf->queue_length = 0;
+
+  /* max_connections adaptive [min=N] [max=N]; */
+  if (ngx_strcmp(value[1].data, "adaptive") == 0) {
+    maxconn_cf->adaptive = 1;
+    maxconn_cf->adaptive_min = 1;
+    maxconn_cf->max_connections = 16;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+      ngx_int_t n;
+
+      if (ngx_strncmp(value[i].data, "min=", 4) == 0) {
+        n = ngx_atoi(&value[i].data[4], value[i].len - 4);
+        if (n == NGX_ERROR || n == 0) goto invalid;
+        maxconn_cf->adaptive_min = n;
+        continue;
+      }
+
+      if (ngx_strncmp(value[i].data, "max=", 4) == 0) {
+        n = ngx_atoi(&value[i].data[4], value[i].len - 4);
+        if (n == NGX_ERROR || n == 0) goto invalid;
+        maxconn_cf->max_connections = n;
+        continue;
+      }
+
+      goto invalid;
+    }
+
+    if (maxconn_cf->adaptive_min > maxconn_cf->max_connections) {
+      return "min must not be greater than max";
+    }
+
+    return NGX_CONF_OK;
+  }
+
+  if (cf->args->nelts != 2) goto invalid;
+
+  ngx_int_t max_connections = ngx_atoi(value[1].data, value[1].len);
+  if (max_connections == NGX_ERROR || max_connections == 0) goto invalid;
+
   /* 2. set the number of max_connections */
   maxconn_cf->max_connections = (ngx_uint_t)max_connections;
-  maxconn_cf->queue_length = 0;
 
   return NGX_CONF_OK;
+
+invalid:
+  ngx_conf_log_error( NGX_LOG_EMERG
+                    , cf
+                    , 0
+                    , "invalid value \"%V\" in \"%V\" directive"
+                    , &value[i]
+                    , &cmd->name
+                    );
+  return NGX_CONF_ERROR;
 }
 
 static void *
@@ -672,6 +4768,22 @@ max_connections_create_conf(ngx_conf_t *cf)
     conf->max_connections = 1;
     conf->max_queue_length = 10000; /* default max queue length 10000 */
     conf->queue_timeout = 10000;  /* default queue timeout 10 seconds */
+    conf->queue_policy = QUEUE_POLICY_STRICT;
+    conf->queue_mode = QUEUE_MODE_FIFO;
+    conf->balance = BALANCE_LEAST_CONN;
+    conf->lifo_after = 100;
+    conf->dispatch_batch = 64;
+    conf->client_closure = CLOSURE_HOLD;
+    conf->closure_timeout = CLIENT_CLOSURE_SLEEP;
+    conf->pool_first = conf;
+    conf->priority_index = NGX_ERROR;
+    conf->timeout_index = NGX_ERROR;
+    conf->hash_index = NGX_ERROR;
+    conf->fair_index = NGX_ERROR;
+    conf->reject_status = NGX_HTTP_SERVICE_UNAVAILABLE;
+    conf->expire_status = NGX_HTTP_QUEUE_EXPIRATION;
+    conf->queues = ngx_array_create(cf->pool, 4, sizeof(max_connections_queue_t));
+    if (conf->queues == NULL) return NGX_CONF_ERROR;
     return conf;
 }
 
@@ -213,6 +213,18 @@ module MaxconnTest
     end
   end
 
+  class ErrorBackend < MongrelBackend
+    def real_call(env)
+      [503, {"Content-Type" => "text/plain"}, "unavailable\n"]
+    end
+  end
+
+  class NotFoundBackend < MongrelBackend
+    def real_call(env)
+      [404, {"Content-Type" => "text/plain"}, "not found\n"]
+    end
+  end
+
   class NoResponseBackend < DelayBackend
     def initialize
       super(99999999)
@@ -371,6 +383,10 @@ module MaxconnTest
       @options[:max_connections] || 1
     end
 
+    def adaptive
+      @options[:adaptive]
+    end
+
     def queue_timeout
       @options[:queue_timeout]
     end
@@ -379,6 +395,107 @@ module MaxconnTest
       @options[:max_queue_length]
     end
 
+    def weights
+      @options[:weights]
+    end
+
+    def max_conns
+      @options[:max_conns]
+    end
+
+    def slow_start
+      @options[:slow_start]
+    end
+
+    def queue_classes
+      @options[:queue_classes] || []
+    end
+
+    def priority
+      @options[:priority]
+    end
+
+    def queue_policy
+      @options[:queue_policy]
+    end
+
+    def zone
+      @options[:zone]
+    end
+
+    def health_check
+      @options[:health_check]
+    end
+
+    def circuit_breaker
+      @options[:circuit_breaker]
+    end
+
+    def pool
+      @options[:pool]
+    end
+
+    def queue_timeout_variable
+      @options[:queue_timeout_variable]
+    end
+
+    def client_closure
+      @options[:client_closure]
+    end
+
+    def hash_key
+      @options[:hash_key]
+    end
+
+    def queue_mode
+      @options[:queue_mode]
+    end
+
+    def fair_key
+      @options[:fair_key]
+    end
+
+    def balance
+      @options[:balance]
+    end
+
+    def deadline_headers
+      @options[:deadline_headers]
+    end
+
+    def dispatch_batch
+      @options[:dispatch_batch]
+    end
+
+    def hedge
+      @options[:hedge]
+    end
+
+    def admission
+      @options[:admission]
+    end
+
+    def reject_status
+      @options[:reject_status]
+    end
+
+    def expire_status
+      @options[:expire_status]
+    end
+
+    def overflow
+      @options[:overflow]
+    end
+
+    def next_upstream
+      @options[:next_upstream]
+    end
+
+    # with :overflow the last backend is the overflow upstream's
+    def upstream_backends
+      overflow ? @backends[0..-2] : @backends
+    end
+
     def fail_timeout
       @options[:backend_timeouts] || 10
     end
@@ -0,0 +1,53 @@
+require File.dirname(__FILE__) + '/maxconn_test'
+require 'net/http'
+include MaxconnTest
+
+# Takes 50ms a request until it is asked for /slow, then 400ms: slow
+# enough for the module to see it queueing.
+class SlowingBackend < DelayBackend
+  def real_call(env)
+    @delay = 0.4 if env["PATH_INFO"] == "/slow"
+    super
+  end
+end
+
+def backend_limit(nginx)
+  body = Net::HTTP.get_response("127.0.0.1", "/max_connections_status", nginx.port).body
+  body =~ /"limit":(\d+)/
+  $1.to_i
+end
+
+def send_requests(nginx, clients, requests)
+  threads = (1..clients).map do
+    Thread.new do
+      requests.times do
+        response = Net::HTTP.get_response("127.0.0.1", "/", nginx.port)
+        assert_equal "200", response.code
+      end
+    end
+  end
+  threads.each { |t| t.join }
+end
+
+# The limit starts at min=1 and grows while the backend keeps up with a
+# backlog of requests, then is cut once its responses slow down.
+backend = SlowingBackend.new(0.05)
+
+test_nginx([backend],
+  :adaptive => "min=1 max=16",
+  :worker_processes => 1,
+  :queue_timeout => "30s"
+) do |nginx|
+  assert_equal 1, backend_limit(nginx)
+
+  send_requests(nginx, 16, 10)
+  grown = backend_limit(nginx)
+  assert grown >= 4, "limit only grew to #{grown}"
+
+  Net::HTTP.get_response("127.0.0.1", "/slow", nginx.port)
+  send_requests(nginx, 16, 4)
+  cut = backend_limit(nginx)
+  assert cut < grown, "limit #{cut} was not cut from #{grown}"
+end
+
+assert backend.experienced_max_connections <= 16
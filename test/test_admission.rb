@@ -0,0 +1,45 @@
+require File.dirname(__FILE__) + '/maxconn_test'
+require 'net/http'
+
+# Requests take a second and the queue timeout is 1.5s, so with one
+# already waiting the predicted wait is too long. Later arrivals are turned
+# away at once with 429 and Retry-After rather than expiring in the queue.
+backends = [MaxconnTest::DelayBackend.new(1)]
+
+# starts a request every interval, returns [response, seconds] for each
+# in order of arrival
+def staggered_requests(nginx, n, interval)
+  threads = (1..n).map do
+    thread = Thread.new do
+      start = Time.now
+      response = Net::HTTP.get_response("127.0.0.1", "/", nginx.port)
+      [response, Time.now - start]
+    end
+    sleep interval
+    thread
+  end
+  threads.map { |t| t.value }
+end
+
+test_nginx(backends,
+  :max_connections => 1,
+  :queue_timeout => "1500ms",
+  :admission => "predict",
+  :reject_status => "429 retry_after=3s"
+) do |nginx|
+  # the second request waits for the first, so a dispatch after a backlog
+  # gives the time between dispatches to predict from
+  seed = staggered_requests(nginx, 2, 0.1)
+  seed.each { |response, took| assert_equal "200", response.code }
+
+  # the first goes straight to the backend and the second waits about a
+  # second; anyone after that would wait two
+  results = staggered_requests(nginx, 6, 0.1)
+  codes = results.map { |response, took| response.code }
+  assert_equal ["200", "200", "429", "429", "429", "429"], codes
+
+  results[2..-1].each do |response, took|
+    assert_equal "3", response["Retry-After"]
+    assert(took < 0.5, "rejected after #{took}s")
+  end
+end
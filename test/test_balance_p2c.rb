@@ -0,0 +1,23 @@
+require File.dirname(__FILE__) + '/maxconn_test'
+include MaxconnTest
+
+# Slots are plentiful, so least connections would keep using the slow
+# backend whenever the fast one has a request out. p2c_ewma learns that
+# it is six times slower and leaves it alone.
+fast = DelayBackend.new(0.05)
+slow = DelayBackend.new(0.3)
+
+test_nginx( [fast, slow],
+  :max_connections => 4,
+  :worker_processes => 1,
+  :balance => "p2c_ewma"
+) do |nginx|
+  out = %x{httperf --num-conns 60 --hog --timeout 120 --rate 20 --port #{nginx.port}}
+  assert $?.exitstatus == 0
+  results = httperf_parse_output(out)
+  assert_equal 60, results["2xx"]
+end
+
+assert_equal 60, fast.experienced_requests + slow.experienced_requests
+assert slow.experienced_requests <= 6, 
+  "slow backend got #{slow.experienced_requests} of 60 requests"
@@ -0,0 +1,43 @@
+require File.dirname(__FILE__) + '/maxconn_test'
+
+# A backend that answers every request with a quick 503 is not "failed" as
+# far as fail_timeout goes, but the circuit breaker stops sending it
+# requests once half of its responses are errors.
+backends = [MaxconnTest::ErrorBackend.new, MaxconnTest::DelayBackend.new(0.05)]
+test_nginx(backends,
+  :max_connections => 1,
+  :circuit_breaker => "errors=50% min_requests=5 window=10s open=60s"
+) do |nginx|
+  out = %x{httperf --num-conns 60 --hog --timeout 30 --rate 20 --port #{nginx.port}}
+  assert $?.exitstatus == 0
+  results = httperf_parse_output(out)
+  assert results["2xx"] >= 50, "most requests went to the good backend"
+
+  out = %x{grep "circuit of 127.0.0.1:#{backends.first.port} is open" #{nginx.logfile}}
+  assert out != "", "circuit opened"
+end
+
+assert backends.first.experienced_requests < 10, 
+  "sick backend got #{backends.first.experienced_requests} requests"
+
+# A 404 that proxy_next_upstream passes on counts against the backend too.
+# With the only backend's circuit open there is nothing left to retry on,
+# so the request ends there instead of looking for a backend.
+backends = [MaxconnTest::NotFoundBackend.new]
+test_nginx(backends,
+  :max_connections => 1,
+  :queue_timeout => "500ms",
+  :next_upstream => "http_404",
+  :circuit_breaker => "errors=50% min_requests=5 window=10s open=60s"
+) do |nginx|
+  out = %x{httperf --num-conns 20 --hog --timeout 5 --rate 10 --port #{nginx.port}}
+  assert $?.exitstatus == 0
+  results = httperf_parse_output(out)
+  assert_equal 20, results["4xx"] + results["5xx"], "every request got an answer"
+
+  out = %x{grep "circuit of 127.0.0.1:#{backends.first.port} is open" #{nginx.logfile}}
+  assert out != "", "circuit opened"
+end
+
+assert backends.first.experienced_requests < 10, 
+  "not found backend got #{backends.first.experienced_requests} requests"
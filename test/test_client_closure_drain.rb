@@ -0,0 +1,18 @@
+require File.dirname(__FILE__) + '/maxconn_test'
+
+# Clients give up long before the backend answers. With drain the slot is
+# only released once the backend is really done with the request, so the
+# backend never sees more than its one slot's worth of requests at a time.
+backend = MaxconnTest::DelayBackend.new(0.9)
+test_nginx([backend],
+  :max_connections => 1,
+  :client_closure => "drain 5s"
+) do |nginx|
+  10.times do 
+    %x{httperf --num-conns 5 --hog --timeout 0.01 --rate 100 --port #{nginx.port}}
+    assert $?.exitstatus == 0
+  end
+  sleep 1 # the last ones finish
+end
+
+assert_equal 1, backend.experienced_max_connections
@@ -0,0 +1,32 @@
+require File.dirname(__FILE__) + '/maxconn_test'
+require 'net/http'
+include MaxconnTest
+
+# Answers with the deadline headers it was sent.
+class HeaderBackend < DelayBackend
+  def real_call(env)
+    sleep @delay
+    body = "start=#{env['HTTP_X_QUEUE_START']} remaining=#{env['HTTP_X_QUEUE_REMAINING']}\n"
+    [200, {"Content-Type" => "text/plain"}, body]
+  end
+end
+
+# The second request waits about half a second for the one slot, so the
+# backend hears it has about 9.5 of its 10 seconds left.
+test_nginx([HeaderBackend.new(0.5)],
+  :max_connections => 1,
+  :queue_timeout => "10s",
+  :deadline_headers => ""
+) do |nginx|
+  busy = Thread.new { Net::HTTP.get_response("127.0.0.1", "/", nginx.port) }
+  sleep 0.1
+  before = Time.now.to_f
+  response = Net::HTTP.get_response("127.0.0.1", "/", nginx.port)
+  assert_equal "200", response.code
+  assert_equal "200", busy.value.code
+
+  assert response.body =~ /^start=t=(\d+\.\d{3}) remaining=(\d+)$/, 
+    "got #{response.body}"
+  assert_in_delta before, $1.to_f, 1
+  assert_in_delta 9600, $2.to_i, 300
+end
@@ -0,0 +1,40 @@
+require File.dirname(__FILE__) + '/maxconn_test'
+require 'net/http'
+include MaxconnTest
+
+# Fails its health checks for the first second, then comes back.
+class LateBackend < DelayBackend
+  def start(port)
+    @up_at = Time.now + 1
+    super
+  end
+
+  def real_call(env)
+    if env["PATH_INFO"] == "/ping"
+      return [Time.now < @up_at ? 503 : 200, {"Content-Type" => "text/plain"}, "pong\n"]
+    end
+    super
+  end
+end
+
+# Requests queue up while the backend is down. When it comes back its eight
+# slots are free at once, but only two requests go out per batch; the rest
+# must follow from the posted dispatch event, and every request is served.
+backend = LateBackend.new(0.5)
+
+test_nginx([backend],
+  :max_connections => 8,
+  :dispatch_batch => 2,
+  :worker_processes => 1,
+  :queue_timeout => "20s",
+  :health_check => "interval=100ms fall=1 rise=1 path=/ping"
+) do |nginx|
+  sleep 0.5 # marked down
+  threads = (1..20).map do
+    Thread.new { Net::HTTP.get_response("127.0.0.1", "/", nginx.port) }
+  end
+  threads.each { |t| assert_equal "200", t.value.code }
+end
+
+assert_equal 20, backend.experienced_requests
+assert_equal 8, backend.experienced_max_connections
@@ -0,0 +1,31 @@
+require File.dirname(__FILE__) + '/maxconn_test'
+require 'net/http'
+
+# One slot. Account "a" queues five requests, then account "b" queues one.
+# With max_connections_fair_key the accounts take turns, so "b" is
+# answered right after the first of "a" instead of after all five.
+backends = [MaxconnTest::DelayBackend.new(0.3)]
+
+finished = []
+lock = Mutex.new
+test_nginx(backends,
+  :max_connections => 1,
+  :fair_key => "$arg_account"
+) do |nginx|
+  busy = Thread.new { Net::HTTP.get_response("127.0.0.1", "/", nginx.port) }
+  sleep 0.1
+
+  threads = %w(a a a a a b).map do |account|
+    t = Thread.new do
+      response = Net::HTTP.get_response("127.0.0.1", "/?account=#{account}", nginx.port)
+      lock.synchronize { finished << account }
+      response
+    end
+    sleep 0.02
+    t
+  end
+  threads.each { |t| assert_equal "200", t.value.code }
+  assert_equal "200", busy.value.code
+end
+
+assert_equal %w(a b a a a a), finished
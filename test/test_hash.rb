@@ -0,0 +1,35 @@
+require File.dirname(__FILE__) + '/maxconn_test'
+require 'net/http'
+
+# With max_connections_hash every request for a user lands on the same
+# backend, and the users are spread over the backends.
+backends = []
+4.times { backends << MaxconnTest::DelayBackend.new(0) }
+
+test_nginx(backends,
+  :max_connections => 2,
+  :hash_key => "$arg_user"
+) do |nginx|
+  3.times do
+    (1..20).each do |user|
+      response = Net::HTTP.get_response("127.0.0.1", "/?user=#{user}", nginx.port)
+      assert_equal "200", response.code
+    end
+  end
+
+  seen = {}
+  File.read(nginx.logfile).scan(/^GET \/\?user=(\d+) HTTP\S+ 200 .* backend=(\S+)$/) do |user, backend|
+    (seen[user] ||= []) << backend
+  end
+  assert_equal 20, seen.size, "every user was logged"
+  ports = backends.map { |b| "127.0.0.1:#{b.port}" }
+  seen.values.flatten.uniq.each do |backend|
+    assert ports.include?(backend), "logged backend #{backend} is not one of ours"
+  end
+  seen.each do |user, used|
+    assert_equal 3, used.size
+    assert_equal 1, used.uniq.size, "user #{user} went to #{used.uniq.join(', ')}"
+  end
+  assert seen.values.map { |used| used.first }.uniq.size > 1, 
+    "users should be spread over the backends"
+end
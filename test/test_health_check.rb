@@ -0,0 +1,23 @@
+require File.dirname(__FILE__) + '/maxconn_test'
+
+# The health check takes a backend that is not running out before any
+# request is sent to it, and every request goes to the live one.
+backends = [MaxconnTest::NonBackend.new, MaxconnTest::DelayBackend.new(0.1)]
+test_nginx(backends,
+  :max_connections => 2,
+  :health_check => "interval=100ms fall=2 rise=2 path=/ping"
+) do |nginx|
+  sleep 1 # a few rounds of checks
+
+  dead = backends.first
+  out = %x{grep "health check: 127.0.0.1:#{dead.port} is down" #{nginx.logfile}}
+  assert out != "", "dead backend was marked down"
+
+  out = %x{grep "health check: 127.0.0.1:#{backends.last.port} is down" #{nginx.logfile}}
+  assert_equal "", out, "live backend stays up"
+
+  out = %x{httperf --num-conns 10 --hog --timeout 30 --rate 10 --port #{nginx.port}}
+  assert $?.exitstatus == 0
+  results = httperf_parse_output(out)
+  assert_equal 10, results["2xx"]
+end
@@ -0,0 +1,23 @@
+require File.dirname(__FILE__) + '/maxconn_test'
+require 'net/http'
+include MaxconnTest
+
+# One backend takes two seconds. A request that lands on it is sent on to
+# the other backend after 200ms, so none takes anywhere near two seconds.
+slow = DelayBackend.new(2)
+fast = DelayBackend.new(0.1)
+
+test_nginx([slow, fast],
+  :max_connections => 1,
+  :worker_processes => 1,
+  :hedge => "after=200ms methods=GET max=1 budget=50%"
+) do |nginx|
+  4.times do
+    start = Time.now
+    response = Net::HTTP.get_response("127.0.0.1", "/", nginx.port)
+    assert_equal "200", response.code
+    assert Time.now - start < 1, "took #{Time.now - start}s"
+  end
+end
+
+assert fast.experienced_requests >= 4
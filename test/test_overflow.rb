@@ -0,0 +1,32 @@
+require File.dirname(__FILE__) + '/maxconn_test'
+require 'net/http'
+include MaxconnTest
+
+# One slot and room for one in the queue. Of four requests at once two are
+# served by the main backend and the other two, which would have been
+# turned away, overflow to the fallback upstream.
+main = DelayBackend.new(1)
+fallback = DelayBackend.new(0.1)
+
+test_nginx([main, fallback],
+  :max_connections => 1,
+  :max_queue_length => 1,
+  :overflow => "when=queue_full"
+) do |nginx|
+  threads = (1..4).map do |i|
+    sleep 0.1
+    Thread.new { Net::HTTP.get_response("127.0.0.1", "/", nginx.port) }
+  end
+  threads.each { |t| assert_equal "200", t.value.code }
+
+  status = Net::HTTP.get_response("127.0.0.1", "/max_connections_status", nginx.port)
+  assert_match(/"overflowed":2,/, status.body)
+
+  # the fallback has no queue, so there is nothing to log for those two
+  sleep 0.5
+  out = %x{grep -c "queue_time=- position=- backend=-" #{nginx.logfile}}
+  assert_equal "2", out.strip
+end
+
+assert_equal 2, main.experienced_requests
+assert_equal 2, fallback.experienced_requests
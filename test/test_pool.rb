@@ -0,0 +1,25 @@
+require File.dirname(__FILE__) + '/maxconn_test'
+
+# Two upstreams in one max_connections_pool point at the same backend. With
+# "max_connections 1" the backend must only ever see one request at a
+# time, not one from each upstream.
+backends = [MaxconnTest::DelayBackend.new(0.2)]
+test_nginx(backends,
+  :max_connections => 1,
+  :queue_timeout => "20s",
+  :pool => "app"
+) do |nginx|
+  threads = ["/", "/two/"].map do |uri|
+    Thread.new do
+      %x{httperf --num-conns 10 --hog --timeout 30 --rate 10 --uri #{uri} --port #{nginx.port}}
+    end
+  end
+  threads.each do |t|
+    results = httperf_parse_output(t.value)
+    assert_equal 10, results["2xx"]
+  end
+end
+
+assert_equal 1, backends.first.experienced_max_connections, 
+  "backend had too many connections"
+assert_equal 20, backends.first.experienced_requests
@@ -0,0 +1,32 @@
+require File.dirname(__FILE__) + '/maxconn_test'
+require 'net/http'
+
+# One slot and a backlog of slow low priority requests. A request in the
+# "high" class must skip the backlog and be served next.
+DELAY = 0.5
+backends = [MaxconnTest::DelayBackend.new(DELAY)]
+
+high_took = nil
+test_nginx(backends,
+  :max_connections => 1,
+  :worker_processes => 1,
+  :queue_timeout => "30s",
+  :queue_classes => ["high"],
+  :priority => "$arg_priority"
+) do |nginx|
+  low = Thread.new do
+    %x{httperf --num-conns 20 --hog --timeout 30 --rate 100 --port #{nginx.port}}
+  end
+  sleep 1
+
+  start = Time.now
+  response = Net::HTTP.get_response("127.0.0.1", "/?priority=high", nginx.port)
+  high_took = Time.now - start
+  assert_equal "200", response.code
+
+  low.join
+end
+
+# it waits for at most the request that is on the backend plus its own
+assert(high_took < DELAY * 3, "high priority request waited #{high_took}s")
+assert_equal 21, backends.first.experienced_requests
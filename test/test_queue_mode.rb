@@ -0,0 +1,73 @@
+require File.dirname(__FILE__) + '/maxconn_test'
+require 'net/http'
+
+# One slot busy for a second and three requests queued behind it, a
+# little apart. In LIFO mode the last one queued is the first answered.
+backends = [MaxconnTest::DelayBackend.new(1)]
+
+finished = []
+lock = Mutex.new
+test_nginx(backends,
+  :max_connections => 1,
+  :queue_mode => "lifo"
+) do |nginx|
+  busy = Thread.new { Net::HTTP.get_response("127.0.0.1", "/", nginx.port) }
+  sleep 0.2
+
+  threads = (1..3).map do |i|
+    t = Thread.new do
+      response = Net::HTTP.get_response("127.0.0.1", "/", nginx.port)
+      lock.synchronize { finished << i }
+      response
+    end
+    sleep 0.2
+    t
+  end
+  threads.each { |t| assert_equal "200", t.value.code }
+  assert_equal "200", busy.value.code
+end
+
+assert_equal [3, 2, 1], finished
+
+# Takes as long as the "d" parameter says, in seconds.
+class ParamDelayBackend < MaxconnTest::DelayBackend
+  def real_call(env)
+    @delay = env["QUERY_STRING"][/d=([\d.]+)/, 1].to_f
+    super
+  end
+end
+
+# Sends a request that holds the one slot for busy seconds, then three
+# quick ones queued behind it 50ms apart. Returns the order the three
+# were answered in.
+def queue_behind(nginx, busy)
+  finished = []
+  lock = Mutex.new
+  first = Thread.new { Net::HTTP.get_response("127.0.0.1", "/?d=#{busy}", nginx.port) }
+  sleep 0.1
+
+  threads = (1..3).map do |i|
+    t = Thread.new do
+      response = Net::HTTP.get_response("127.0.0.1", "/?d=0.05", nginx.port)
+      lock.synchronize { finished << i }
+      response
+    end
+    sleep 0.05
+    t
+  end
+  threads.each { |t| assert_equal "200", t.value.code }
+  assert_equal "200", first.value.code
+  finished
+end
+
+# In adaptive mode the queue is served newest first only while its oldest
+# request has waited longer than lifo_after. Behind a 1.5s request the
+# three have all waited over a second and go out newest first; behind a
+# 0.4s one none has waited 500ms, so the order is back to oldest first.
+test_nginx([ParamDelayBackend.new(0)],
+  :max_connections => 1,
+  :queue_mode => "adaptive lifo_after=500ms"
+) do |nginx|
+  assert_equal [3, 2, 1], queue_behind(nginx, 1.5)
+  assert_equal [1, 2, 3], queue_behind(nginx, 0.4)
+end
@@ -0,0 +1,25 @@
+require File.dirname(__FILE__) + '/maxconn_test'
+require 'net/http'
+
+# The only slot is busy for two seconds. A request that asks for a 300ms
+# queue timeout gives up long before the upstream's 30s.
+backends = [MaxconnTest::DelayBackend.new(2)]
+
+took = nil
+test_nginx(backends,
+  :max_connections => 1,
+  :queue_timeout => "30s",
+  :queue_timeout_variable => "$arg_timeout"
+) do |nginx|
+  busy = Thread.new { Net::HTTP.get_response("127.0.0.1", "/", nginx.port) }
+  sleep 0.5
+
+  start = Time.now
+  response = Net::HTTP.get_response("127.0.0.1", "/?timeout=300ms", nginx.port)
+  took = Time.now - start
+  assert response.code != "200", "request should have expired"
+
+  assert_equal "200", busy.value.code
+end
+
+assert(took < 1, "expired after #{took}s")
@@ -0,0 +1,64 @@
+require File.dirname(__FILE__) + '/maxconn_test'
+require 'net/http'
+include MaxconnTest
+
+# Fails its health checks for the first second, then comes back.
+class RecoveringBackend < DelayBackend
+  def start(port)
+    @up_at = Time.now + 1
+    super
+  end
+
+  def real_call(env)
+    if env["PATH_INFO"] == "/ping"
+      return [Time.now < @up_at ? 503 : 200, {"Content-Type" => "text/plain"}, "pong\n"]
+    end
+    super
+  end
+end
+
+def backend_status(nginx)
+  body = Net::HTTP.get_response("127.0.0.1", "/max_connections_status", nginx.port).body
+  body =~ /"connections":(\d+),"worker_connections":\d+,"limit":(\d+)/
+  [$1.to_i, $2.to_i]
+end
+
+# After coming back the backend starts with one slot and gains the other
+# three over four seconds. The requests take longer than that, so none
+# finishes during the ramp: the slots it gains are handed out as time
+# passes, not as requests complete.
+backend = RecoveringBackend.new(6)
+
+test_nginx([backend],
+  :max_connections => 4,
+  :max_conns => [4],
+  :slow_start => "4s",
+  :worker_processes => 1,
+  :queue_timeout => "20s",
+  :health_check => "interval=100ms fall=1 rise=1 path=/ping"
+) do |nginx|
+  sleep 1.5 # down, then up again
+  out = %x{grep "health check: 127.0.0.1:#{backend.port} is up" #{nginx.logfile}}
+  assert out != "", "backend came back"
+
+  threads = (1..6).map do
+    Thread.new { Net::HTTP.get_response("127.0.0.1", "/", nginx.port) }
+  end
+
+  sleep 0.3
+  connections, limit = backend_status(nginx)
+  assert limit <= 2, "limit #{limit} right after coming back"
+  assert_equal limit, connections
+
+  sleep 3
+  connections, limit = backend_status(nginx)
+  assert limit >= 3, "limit #{limit} near the end of the ramp"
+  assert_equal limit, connections
+
+  sleep 1
+  connections, limit = backend_status(nginx)
+  assert_equal 4, limit
+  assert_equal 4, connections
+
+  threads.each { |t| assert_equal "200", t.value.code }
+end
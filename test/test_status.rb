@@ -0,0 +1,29 @@
+require File.dirname(__FILE__) + '/maxconn_test'
+require 'net/http'
+
+# max_connections_status reports the queue and slots of the upstream. After
+# some traffic every request has been enqueued, dispatched and counted
+# against a backend, and nothing is left in flight.
+backends = []
+2.times { backends << MaxconnTest::DelayBackend.new(0.1) }
+test_nginx(backends,
+  :max_connections => 1,
+  :queue_timeout => "20s"
+) do |nginx|
+  out = %x{httperf --num-conns 20 --hog --timeout 30 --rate 20 --port #{nginx.port}}
+  assert $?.exitstatus == 0
+  results = httperf_parse_output(out)
+  assert_equal 20, results["2xx"]
+
+  json = Net::HTTP.get("127.0.0.1", "/max_connections_status", nginx.port)
+  assert json =~ /"name":"backend"/, "upstream is listed"
+  assert json =~ /"queue_length":0,/, "queue is empty"
+  assert json =~ /"enqueued":20,/, "every request was enqueued"
+  assert json =~ /"dispatched":20,/, "every request was dispatched"
+  assert_equal 20, json.scan(/"requests":(\d+)/).flatten.map { |n| n.to_i }.inject(0) { |a, n| a + n }
+  assert_equal 2, json.scan(/"connections":0,/).length, "no slots are held"
+
+  metrics = Net::HTTP.get("127.0.0.1", "/max_connections_metrics", nginx.port)
+  assert metrics =~ /^max_connections_queue_wait_seconds_count\{upstream="backend"\} 20$/
+  assert metrics =~ /^max_connections_queue_wait_seconds_bucket\{upstream="backend",le="\+Inf"\} 20$/
+end
@@ -0,0 +1,23 @@
+require File.dirname(__FILE__) + '/maxconn_test'
+
+# Every proxied request logs how long it was queued, how many requests were
+# ahead of it and which backend served it. One slow backend with one slot
+# makes requests queue behind each other.
+backends = [MaxconnTest::DelayBackend.new(0.3)]
+test_nginx(backends,
+  :max_connections => 1,
+  :queue_timeout => "20s"
+) do |nginx|
+  out = %x{httperf --num-conns 5 --hog --timeout 30 --rate 50 --port #{nginx.port}}
+  assert $?.exitstatus == 0
+  results = httperf_parse_output(out)
+  assert_equal 5, results["2xx"]
+
+  lines = File.read(nginx.logfile).scan(/queue_time=([\d.]+) position=(\d+) backend=(\S+)/)
+  assert_equal 5, lines.length, "every request was logged"
+  lines.each do |queue_time, position, backend|
+    assert_equal "127.0.0.1:#{backends.first.port}", backend
+  end
+  assert lines.any? { |queue_time, position, _| queue_time.to_f > 0.2 && position.to_i > 0 },
+    "some requests waited behind others"
+end
@@ -0,0 +1,26 @@
+require File.dirname(__FILE__) + '/maxconn_test'
+
+# A big box with weight=3 and three slots next to a small one with weight=1
+# and one slot. Selection goes by connections/weight, so the big box should
+# get about three times the traffic and neither box more than its slots.
+big = MaxconnTest::DelayBackend.new(0.3)
+small = MaxconnTest::DelayBackend.new(0.3)
+
+test_nginx([big, small],
+  :max_connections => 1,
+  :weights => [3, 1],
+  :max_conns => [3, 1],
+  :worker_processes => 1,
+  :queue_timeout => "20s"
+) do |nginx|
+  out = %x{httperf --num-conns 200 --hog --timeout 20 --rate 20 --port #{nginx.port}}
+  assert $?.exitstatus == 0
+  results = httperf_parse_output(out)
+  assert_equal 200, results["2xx"]
+end
+
+assert_in_delta(150, big.experienced_requests, 15)
+assert_in_delta(50, small.experienced_requests, 15)
+assert(big.experienced_max_connections <= 3, "big backend had too many connections")
+assert(small.experienced_max_connections <= 1, "small backend had too many connections")
+assert_equal 200, big.experienced_requests + small.experienced_requests
@@ -0,0 +1,27 @@
+require File.dirname(__FILE__) + '/maxconn_test'
+
+# With a max_connections_zone the limit is for the whole nginx, not for each
+# worker. Three workers and "max_connections 1" must never put more than one
+# request on a backend at a time.
+backends = []
+2.times { backends << MaxconnTest::DelayBackend.new(0.3) }
+test_nginx(backends,
+  :max_connections => 1,
+  :worker_processes => 3,
+  :zone => "backend_slots",
+  :queue_timeout => "20s"
+) do |nginx|
+  out = %x{httperf --num-conns 60 --hog --timeout 30 --rate 20 --port #{nginx.port}}
+  assert $?.exitstatus == 0
+  results = httperf_parse_output(out)
+  assert_equal 60, results["2xx"]
+end
+
+total_received = 0
+backends.each do |b|
+  assert_equal(1, b.experienced_max_connections, 
+    "backend #{b.port} had too many connections")
+
+  total_received += b.experienced_requests
+end
+assert_equal 60, total_received, "backends did not recieve all requests"